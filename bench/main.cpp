@@ -0,0 +1,342 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+// Microbenchmarks of the public API, run against the mock backend
+// (KNOTDNSSD_USE_MOCK) or the built-in mDNS engine (KNOTDNSSD_USE_MDNS) so they
+// need no daemon. Pass --quick for a short run.
+
+#include "knot/dnssd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+// Counting allocator: every allocation carries its size in a header so live
+// bytes can be tracked without platform specific malloc introspection.
+
+static std::atomic<uint64_t> allocations{0};
+static std::atomic<int64_t> liveBytes{0};
+
+static constexpr size_t kHeader = alignof(std::max_align_t);
+
+void* operator new(size_t size) {
+    auto* block = static_cast<char*>(std::malloc(size + kHeader));
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    std::memcpy(block, &size, sizeof(size));
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    liveBytes.fetch_add(static_cast<int64_t>(size), std::memory_order_relaxed);
+    return block + kHeader;
+}
+
+void operator delete(void* pointer) noexcept {
+    if (!pointer) {
+        return;
+    }
+    char* block = static_cast<char*>(pointer) - kHeader;
+    size_t size;
+    std::memcpy(&size, block, sizeof(size));
+    liveBytes.fetch_sub(static_cast<int64_t>(size), std::memory_order_relaxed);
+    std::free(block);
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete[](void* pointer) noexcept {
+    operator delete(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    operator delete(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+    operator delete(pointer);
+}
+
+using Clock = std::chrono::steady_clock;
+
+/// counts events from the event loop thread and lets the main thread wait for a total
+class Counter {
+public:
+    void add() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++count_;
+        cv_.notify_all();
+    }
+
+    bool waitFor(size_t count) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return cv_.wait_for(lock, std::chrono::seconds(30), [&] { return count_ >= count; });
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        count_ = 0;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t count_ = 0;
+};
+
+static double micros(Clock::duration duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+static std::vector<knot::ServiceRegistration> makeServices(const char* prefix, const char* regType, size_t count) {
+    std::vector<knot::ServiceRegistration> services;
+    services.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        knot::ServiceRegistration service;
+        service.serviceName = prefix + std::to_string(i);
+        service.regType = regType;
+        service.port = static_cast<uint16_t>(1024 + i % 50000);
+        service.txt = {{"id", std::to_string(i)}, {"v", "1"}};
+        services.push_back(std::move(service));
+    }
+    return services;
+}
+
+/// registrations start in order, so once the last one resolves all of them are in place
+static bool waitRegistered(const std::vector<knot::ServiceRegistration>& services) {
+    const knot::ServiceRegistration& last = services.back();
+    return knot::resolveService(last.serviceName.c_str(), last.regType.c_str(), nullptr, [](const std::optional<knot::ResolveReply>&) {}) == knot::Status::Ok;
+}
+
+static bool benchBrowse(size_t count) {
+    std::vector<knot::ServiceRegistration> services = makeServices("replay-", "_bench-browse._tcp", count);
+    knot::Registration registration = knot::registerServicesAsync(services);
+    if (!waitRegistered(services)) {
+        std::fprintf(stderr, "browse replay: registration failed\n");
+        return false;
+    }
+    Counter counter;
+
+    // replay of instances that are already registered
+    uint64_t allocationsBefore = allocations.load();
+    auto start = Clock::now();
+    knot::Operation browse = knot::browseServicesAsync("_bench-browse._tcp", nullptr, [&](const knot::BrowseReply& reply) {
+        if (reply.event == knot::ServiceAdded) {
+            counter.add();
+        }
+    });
+    if (!counter.waitFor(count)) {
+        std::fprintf(stderr, "browse replay: timed out\n");
+        return false;
+    }
+    auto elapsed = Clock::now() - start;
+    double allocsPerEvent = static_cast<double>(allocations.load() - allocationsBefore) / static_cast<double>(count);
+    std::printf("%-24s %8zu events %10.1f us %12.0f events/s %8.2f allocs/event\n", "browse replay", count, micros(elapsed), count / (micros(elapsed) / 1e6), allocsPerEvent);
+
+    // live events for instances registered while browsing, includes the cost of registering
+    counter.reset();
+    allocationsBefore = allocations.load();
+    start = Clock::now();
+    knot::Registration live = knot::registerServicesAsync(makeServices("live-", "_bench-browse._tcp", count + count));
+    if (!counter.waitFor(count + count)) {
+        std::fprintf(stderr, "browse live: timed out\n");
+        return false;
+    }
+    elapsed = Clock::now() - start;
+    allocsPerEvent = static_cast<double>(allocations.load() - allocationsBefore) / static_cast<double>(count * 2);
+    std::printf("%-24s %8zu events %10.1f us %12.0f events/s %8.2f allocs/event\n", "browse live", count * 2, micros(elapsed), count * 2 / (micros(elapsed) / 1e6), allocsPerEvent);
+    return true;
+}
+
+/// cold browse of many instances delivered as batches, then the same number of live changes
+static bool benchBatched(size_t count) {
+    std::vector<knot::ServiceRegistration> services = makeServices("batched-", "_bench-batched._tcp", count);
+    knot::Registration registration = knot::registerServicesAsync(services);
+    if (!waitRegistered(services)) {
+        std::fprintf(stderr, "browse batched: registration failed\n");
+        return false;
+    }
+    Counter counter;
+    std::atomic<size_t> batches{0};
+    knot::BatchOptions batch;
+    batch.window = std::chrono::milliseconds(5);
+
+    auto start = Clock::now();
+    knot::Operation browse = knot::browseServicesBatchedAsync("_bench-batched._tcp", nullptr, [&](const std::vector<knot::ServiceEvent>& events) {
+        ++batches;
+        for (const knot::ServiceEvent& event : events) {
+            if (event.event == knot::ServiceAdded) {
+                counter.add();
+            }
+        }
+    }, batch);
+    if (!counter.waitFor(count)) {
+        std::fprintf(stderr, "browse batched: timed out\n");
+        return false;
+    }
+    auto elapsed = Clock::now() - start;
+    std::printf("%-24s %8zu events %10.1f us %12.0f events/s %8zu batches\n", "browse batched", count, micros(elapsed), count / (micros(elapsed) / 1e6), batches.load());
+    return true;
+}
+
+/// browse replay with the callbacks handed to an executor whose queue is far smaller than the burst
+static bool benchExecutor(size_t count) {
+    std::vector<knot::ServiceRegistration> services = makeServices("executor-", "_bench-executor._tcp", count);
+    knot::Registration registration = knot::registerServicesAsync(services);
+    if (!waitRegistered(services)) {
+        std::fprintf(stderr, "browse executor: registration failed\n");
+        return false;
+    }
+    Counter counter;
+    knot::ExecutorOptions executorOptions;
+    executorOptions.capacity = 64;
+    knot::OperationOptions options;
+    options.executor = std::make_shared<knot::CallbackExecutor>(executorOptions);
+
+    uint64_t allocationsBefore = allocations.load();
+    auto start = Clock::now();
+    knot::Operation browse = knot::browseServicesAsync("_bench-executor._tcp", nullptr, [&](const knot::BrowseReply& reply) {
+        if (reply.event == knot::ServiceAdded) {
+            counter.add();
+        }
+    }, options);
+    if (!counter.waitFor(count)) {
+        std::fprintf(stderr, "browse executor: timed out\n");
+        return false;
+    }
+    auto elapsed = Clock::now() - start;
+    double allocsPerEvent = static_cast<double>(allocations.load() - allocationsBefore) / static_cast<double>(count);
+    std::printf("%-24s %8zu events %10.1f us %12.0f events/s %8.2f allocs/event\n", "browse executor", count, micros(elapsed), count / (micros(elapsed) / 1e6), allocsPerEvent);
+    return options.executor->dropped() == 0;
+}
+
+/// a burst of TXT updates queued for one long-lived watch before the event
+/// loop gets to them; the mock backend answers every one, the mDNS engine may
+/// fold them into fewer announcements, so only the final value is awaited
+static bool benchWatchBurst(size_t count) {
+    knot::Registration registration = knot::registerServiceAsync("bench-watch", "_bench-watch._tcp", nullptr, 8080, {{"seq", "0"}});
+    Counter initial;
+    Counter final;
+    std::atomic<size_t> updates{0};
+    std::string last = std::to_string(count);
+    knot::Operation watch = knot::watchServiceAsync("bench-watch", "_bench-watch._tcp", nullptr, [&](const knot::ServiceUpdate& update) {
+        std::optional<std::string_view> seq = update.txt.get("seq");
+        if (!seq) {
+            return;
+        }
+        if (*seq == "0") {
+            initial.add();
+            return;
+        }
+        ++updates;
+        if (*seq == last) {
+            final.add();
+        }
+    });
+    if (!initial.waitFor(1)) {
+        std::fprintf(stderr, "watch burst: no initial update\n");
+        return false;
+    }
+
+    auto start = Clock::now();
+    for (size_t i = 1; i <= count; ++i) {
+        registration.updateTxt({{"seq", std::to_string(i)}});
+    }
+    if (!final.waitFor(1)) {
+        std::fprintf(stderr, "watch burst: timed out\n");
+        return false;
+    }
+    auto elapsed = Clock::now() - start;
+    std::printf("%-24s %8zu updates %9.1f us %12.0f updates/s %8zu delivered\n", "watch burst", count, micros(elapsed), count / (micros(elapsed) / 1e6), updates.load());
+    return true;
+}
+
+static bool benchResolve(const char* label, size_t iterations) {
+    knot::Registration registration = knot::registerServiceAsync("bench-resolve", "_bench-resolve._tcp", nullptr, 8080, {{"k", "v"}});
+    std::vector<double> latencies;
+    latencies.reserve(iterations);
+    for (size_t i = 0; i < iterations; ++i) {
+        bool found = false;
+        auto start = Clock::now();
+        knot::Status status = knot::resolveService("bench-resolve", "_bench-resolve._tcp", nullptr, [&](const std::optional<knot::ResolveReply>& reply) {
+            found = reply.has_value();
+        });
+        latencies.push_back(micros(Clock::now() - start));
+        if (status != knot::Status::Ok || !found) {
+            std::fprintf(stderr, "%s: resolve failed\n", label);
+            return false;
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) { return latencies[static_cast<size_t>(p * static_cast<double>(latencies.size() - 1))]; };
+    std::printf("%-24s %8zu calls  %10.1f us p50 %9.1f us p99 %10.1f us max\n", label, iterations, percentile(0.5), percentile(0.99), latencies.back());
+    return true;
+}
+
+static bool reportMetrics(size_t iterations) {
+    knot::Metrics metrics = knot::metrics();
+    if (metrics.resolves != iterations || metrics.resolveLatency.count != iterations) {
+        std::fprintf(stderr, "metrics: %llu resolves recorded, expected %zu\n", static_cast<unsigned long long>(metrics.resolves), iterations);
+        return false;
+    }
+    std::printf("%-24s %8llu hits   %10llu us p50 %9llu us p99 %10llu us callback p99\n", "metrics", static_cast<unsigned long long>(metrics.cacheHits),
+                static_cast<unsigned long long>(metrics.resolveLatency.percentile(0.5)), static_cast<unsigned long long>(metrics.resolveLatency.percentile(0.99)),
+                static_cast<unsigned long long>(metrics.callbackTime.percentile(0.99)));
+    return true;
+}
+
+static bool benchRegistrationMemory(size_t count) {
+    std::vector<knot::ServiceRegistration> services = makeServices("memory-", "_bench-memory._tcp", count);
+    std::vector<knot::Registration> registrations;
+    registrations.reserve(count);
+    int64_t before = liveBytes.load();
+    for (const knot::ServiceRegistration& service : services) {
+        registrations.push_back(knot::registerServiceAsync(service.serviceName.c_str(), service.regType.c_str(), nullptr, service.port, service.txt));
+    }
+    if (!waitRegistered(services)) {
+        std::fprintf(stderr, "registration memory: resolve failed\n");
+        return false;
+    }
+    int64_t perService = (liveBytes.load() - before) / static_cast<int64_t>(count);
+    std::printf("%-24s %8zu services %8lld bytes/service\n", "registration memory", count, static_cast<long long>(perService));
+    return true;
+}
+
+int main(int argc, char** argv) {
+    bool quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+    size_t events = quick ? 500 : 20000;
+    size_t iterations = quick ? 200 : 20000;
+
+    knot::setDefaultTimeout(std::chrono::seconds(5));
+    bool ok = benchBrowse(events);
+    ok = benchExecutor(events) && ok;
+    ok = benchBatched(events) && ok;
+    ok = benchWatchBurst(events) && ok;
+
+    knot::CacheOptions uncached;
+    uncached.enabled = false;
+    knot::setCacheOptions(uncached);
+    ok = benchResolve("resolve (uncached)", iterations) && ok;
+    knot::setCacheOptions({});
+    ok = benchResolve("resolve (cached)", iterations) && ok;
+    knot::setMetricsEnabled(true);
+    ok = benchResolve("resolve (with metrics)", iterations) && ok;
+    ok = reportMetrics(iterations) && ok;
+    knot::setMetricsEnabled(false);
+
+    ok = benchRegistrationMemory(events) && ok;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
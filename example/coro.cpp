@@ -0,0 +1,36 @@
+#include <knot/dnssd_coro.h>
+
+#include <cstdio>
+#include <future>
+
+// Minimal eager coroutine type; any coroutine library works the same way.
+struct Task {
+    struct promise_type {
+        std::promise<void> done;
+
+        Task get_return_object() { return Task{done.get_future()}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() { done.set_value(); }
+        void unhandled_exception() { done.set_exception(std::current_exception()); }
+    };
+
+    std::future<void> done;
+};
+
+Task discover() {
+    auto stream = knot::coro::browseServices("_flowdrop._tcp", "");
+    while (auto update = co_await stream.next()) {
+        if (update->event != knot::ServiceAdded) {
+            continue;
+        }
+        auto resolved = co_await knot::coro::resolveService(update->instance.serviceName, update->instance.regType, update->instance.replyDomain);
+        if (resolved && resolved.value->hostName) {
+            std::printf("%s at %s:%u\n", update->instance.serviceName.c_str(), resolved.value->hostName->c_str(), resolved.value->port);
+        }
+    }
+}
+
+int main() {
+    discover().done.wait();
+}
@@ -8,11 +8,20 @@
 #ifndef KNOTDNSSD_H
 #define KNOTDNSSD_H
 
+#include <array>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <atomic>
+#include <chrono>
 #include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
 #include <optional>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 
 #if defined(_WIN32)
 #  define KNOTDNSSD_DLL_EXPORT __declspec(dllexport)
@@ -35,47 +44,759 @@ enum IPFamily : uint8_t {
     IPv6 = 1,
 };
 
-struct IPAddress {
+/// Address in binary form, ready for connect(); formatted only on request.
+struct KNOTDNSSD_EXPORT IPAddress {
     IPFamily family = IPv4;
-    std::string value;
+    /// network byte order, IPv4 uses the first 4 bytes
+    std::array<uint8_t, 16> bytes{};
+    /// interface the answer arrived on, 0 if unknown
+    uint32_t interfaceIndex = 0;
+    /// IPv6 zone, set for link-local addresses
+    uint32_t scopeId = 0;
+
+    /// accepts 4 (IPv4) or 16 (IPv6) bytes
+    static std::optional<IPAddress> fromBytes(const void* data, size_t size, uint32_t interfaceIndex = 0);
+
+    size_t length() const { return family == IPv6 ? 16 : 4; }
+    bool isLinkLocal() const;
+
+    /// writes a sockaddr_in or sockaddr_in6 (port in host byte order) and
+    /// returns its length, or 0 if storage is too small
+    size_t toSockaddr(uint16_t port, void* storage, size_t storageSize) const;
+    /// textual form, with "%scope" for scoped IPv6 addresses
+    std::string toString() const;
+
+    bool operator==(const IPAddress& other) const {
+        return family == other.family && bytes == other.bytes && scopeId == other.scopeId;
+    }
+    bool operator!=(const IPAddress& other) const { return !(*this == other); }
+};
+
+class TxtView;
+
+/// TXT record kept in RFC 6763 wire format: a sequence of length-prefixed
+/// "key=value" strings. It is serialized once and handed to the daemon as is;
+/// reading it goes through string_views into the wire buffer.
+class KNOTDNSSD_EXPORT TxtRecord {
+public:
+    struct Entry {
+        std::string_view key;
+        /// std::nullopt for boolean attributes written without '='
+        std::optional<std::string_view> value;
+    };
+
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Entry;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Entry*;
+        using reference = const Entry&;
+
+        const_iterator() = default;
+
+        reference operator*() const { return entry_; }
+        pointer operator->() const { return &entry_; }
+        const_iterator& operator++() { advance(); return *this; }
+        const_iterator operator++(int) { const_iterator copy = *this; advance(); return copy; }
+        bool operator==(const const_iterator& other) const { return position_ == other.position_; }
+        bool operator!=(const const_iterator& other) const { return position_ != other.position_; }
+
+    private:
+        friend class TxtRecord;
+        friend class TxtView;
+        const_iterator(std::string_view wire, size_t position) : wire_(wire), position_(position) { load(); }
+
+        void advance() {
+            position_ += 1 + static_cast<uint8_t>(wire_[position_]);
+            load();
+        }
+
+        void load();
+
+        std::string_view wire_;
+        size_t position_ = 0;
+        Entry entry_;
+    };
+
+    TxtRecord() = default;
+    /// implicit so the former map based signatures keep compiling
+    TxtRecord(const std::unordered_map<std::string, std::string>& txt);
+    TxtRecord(std::initializer_list<std::pair<std::string_view, std::string_view>> txt);
+
+    /// copies the wire bytes once; truncated trailing strings are dropped
+    static TxtRecord fromWire(const void* data, size_t size);
+
+    /// replaces any previous value; false if the pair exceeds 255 bytes
+    bool set(std::string_view key, std::string_view value);
+    /// adds a boolean attribute; false if the key exceeds 255 bytes
+    bool set(std::string_view key);
+    bool remove(std::string_view key);
+
+    /// keys are compared case-insensitively, see RFC 6763, section 6.4;
+    /// boolean attributes yield an empty value
+    std::optional<std::string_view> get(std::string_view key) const;
+    bool contains(std::string_view key) const;
+
+    const_iterator begin() const { return const_iterator(wire_, 0); }
+    const_iterator end() const { return const_iterator(wire_, wire_.size()); }
+    bool empty() const { return begin() == end(); }
+
+    /// wire format, may be empty
+    const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(wire_.data()); }
+    size_t size() const { return wire_.size(); }
+
+    std::unordered_map<std::string, std::string> toMap() const;
+
+    /// valid until the record is modified or destroyed
+    TxtView view() const;
+
+    bool operator==(const TxtRecord& other) const { return wire_ == other.wire_; }
+    bool operator!=(const TxtRecord& other) const { return wire_ != other.wire_; }
+
+private:
+    std::string wire_;
+};
+
+/// Read-only TxtRecord over wire bytes owned by someone else; copies and
+/// allocates nothing.
+class KNOTDNSSD_EXPORT TxtView {
+public:
+    using const_iterator = TxtRecord::const_iterator;
+
+    TxtView() = default;
+    /// truncated trailing strings are ignored
+    TxtView(const void* data, size_t size);
+
+    /// same rules as TxtRecord::get
+    std::optional<std::string_view> get(std::string_view key) const;
+    bool contains(std::string_view key) const;
+
+    const_iterator begin() const { return const_iterator(wire_, 0); }
+    const_iterator end() const { return const_iterator(wire_, wire_.size()); }
+    bool empty() const { return begin() == end(); }
+
+    const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(wire_.data()); }
+    size_t size() const { return wire_.size(); }
+
+private:
+    friend class TxtRecord;
+    const_iterator find(std::string_view key) const;
+
+    std::string_view wire_;
+};
+
+enum BrowseEvent : uint8_t {
+    ServiceAdded = 0,
+    ServiceRemoved = 1,
 };
 
 struct BrowseReply {
     const char* serviceName;
     const char* regType;
     const char* replyDomain;
+    BrowseEvent event = ServiceAdded;
+    /// further events are already queued; Avahi sets it for its whole initial burst
+    bool moreComing = false;
+    /// interface the event was seen on, 0 if unknown
+    uint32_t interfaceIndex = 0;
+    /// deduplicated browses only: the interfaces the instance is known on as
+    /// of this event, ascending; empty for ServiceRemoved
+    const uint32_t* interfaces = nullptr;
+    size_t interfaceCount = 0;
 };
 
 struct ResolveReply {
     std::optional<std::string> hostName;
     std::optional<IPAddress> ip;
     uint16_t port = 0;
-    std::unordered_map<std::string, std::string> txt;
+    TxtRecord txt;
+};
+
+/// What changed about a watched instance, see watchServiceAsync. The first
+/// update sets every field that is known; later ones only those that changed.
+struct ServiceUpdate {
+    std::optional<std::string> hostName;
+    std::optional<IPAddress> ip;
+    /// the address is no longer known, ip is unset then
+    bool ipRemoved = false;
+    std::optional<uint16_t> port;
+    /// TXT entries that are new or have a new value
+    TxtRecord txt;
+    /// TXT keys that are gone
+    std::vector<std::string> txtRemoved;
 };
 
 template<typename Signature>
 using Fn = std::function<Signature>;
 using BrowseCallback = Fn<void(const BrowseReply&)>;
 using ResolveCallback = Fn<void(const std::optional<ResolveReply>&)>;
+using ServiceUpdateCallback = Fn<void(const ServiceUpdate&)>;
 using QueryCallback = Fn<void(const std::optional<IPAddress>&)>;
+using AddressCallback = Fn<void(const IPAddress&)>;
+/// decides on the raw TXT record whether a resolved instance is wanted
+using TxtPredicate = Fn<bool(const TxtView& txt)>;
+
+template<typename Signature>
+class FunctionRef;
+
+/// Non-owning reference to a callable, two pointers wide. Binding one copies
+/// and allocates nothing, so the referenced callable must outlive it; the
+/// blocking functions take their callbacks this way.
+template<typename R, typename... Args>
+class FunctionRef<R(Args...)> {
+public:
+    template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, FunctionRef> && std::is_invocable_r_v<R, F&, Args...>>>
+    FunctionRef(F&& callable) noexcept
+            : object_(const_cast<void*>(static_cast<const void*>(std::addressof(callable)))),
+              invoke_([](void* object, Args... args) -> R {
+                  return (*static_cast<std::remove_reference_t<F>*>(object))(std::forward<Args>(args)...);
+              }) {}
+
+    R operator()(Args... args) const { return invoke_(object_, std::forward<Args>(args)...); }
+
+private:
+    void* object_;
+    R (*invoke_)(void*, Args...);
+};
+
+using BrowseCallbackRef = FunctionRef<void(const BrowseReply&)>;
+using ResolveCallbackRef = FunctionRef<void(const std::optional<ResolveReply>&)>;
+using QueryCallbackRef = FunctionRef<void(const std::optional<IPAddress>&)>;
+
+/// Callbacks of resolveAddressesAsync, all of them optional.
+struct AddressHandlers {
+    /// every address as soon as it arrives, either family
+    AddressCallback onAddress;
+    /// once, with the address to connect to first: IPv6 is preferred, an IPv4
+    /// answer is held back for resolutionDelay in case an IPv6 one follows
+    /// (Happy Eyeballs, RFC 8305, section 3)
+    AddressCallback onFirstUsable;
+    /// both families have answered or have no answer; the operation completes
+    Fn<void()> onComplete;
+    std::chrono::milliseconds resolutionDelay = std::chrono::milliseconds(50);
+};
+
+enum class Status : uint8_t {
+    /// completed on its own, with a result
+    Ok = 0,
+    /// the deadline passed first
+    Timeout = 1,
+    /// cancelled by the caller or torn down with its handle
+    Cancelled = 2,
+    /// the daemon reported an error
+    Failed = 3,
+};
+
+class CallbackExecutor;
+
+/// Limits an operation to one network interface and/or address family.
+/// Bonjour has no family parameter for these calls and ignores family.
+struct NetworkScope {
+    /// as returned by if_nametoindex(), 0 for every interface
+    uint32_t interfaceIndex = 0;
+    /// unset for both families
+    std::optional<IPFamily> family;
+};
+
+struct OperationOptions {
+    /// unset uses the library default for one-shot operations and no deadline
+    /// for registrations, browses and watches; zero disables the deadline
+    std::optional<std::chrono::milliseconds> timeout;
+    /// called once on the event loop thread when the operation ends
+    Fn<void(Status)> onComplete;
+    /// runs the callbacks and onComplete there instead of on the event loop thread
+    std::shared_ptr<CallbackExecutor> executor;
+    /// applies to registrations, browses and resolves
+    NetworkScope scope;
+    /// browses only: daemons report an instance once per interface and
+    /// family it is seen on; deduplicated browses report it once, listing
+    /// the interfaces in BrowseReply::interfaces
+    bool deduplicate = true;
+};
+
+enum class OverflowPolicy : uint8_t {
+    /// the event loop waits for room, so the daemon socket fills up instead
+    Block = 0,
+    /// the callback is discarded and counted in CallbackExecutor::dropped()
+    Drop = 1,
+    /// callbacks wait in an overflow list of the same capacity, where a queued
+    /// ServiceAdded and a later ServiceRemoved of the same instance cancel
+    /// out; once that list is full too the event loop waits
+    Coalesce = 2,
+};
+
+struct ExecutorOptions {
+    /// rounded up to a power of two
+    size_t capacity = 1024;
+    OverflowPolicy overflow = OverflowPolicy::Block;
+    /// runs drain on a thread of the caller's choosing, at most one drain is
+    /// scheduled at a time; unset starts a library thread
+    Fn<void(Fn<void()> drain)> schedule;
+};
+
+namespace detail {
+class ExecutorState;
+}
+
+/// Moves user callbacks off the event loop, so a slow handler cannot stall
+/// event processing.
+///
+/// The event loop hands callbacks over through a bounded lock-free queue;
+/// they run one at a time, in the order they were produced. A callback that
+/// is queued when its operation is cancelled is dropped, but one that is
+/// already running may still finish after cancel() returned. With the Block
+/// policy callbacks must not call the blocking functions of this library.
+class KNOTDNSSD_EXPORT CallbackExecutor {
+public:
+    CallbackExecutor();
+    explicit CallbackExecutor(ExecutorOptions options);
+    /// runs what is still queued, later callbacks are dropped
+    ~CallbackExecutor();
+    CallbackExecutor(const CallbackExecutor&) = delete;
+    CallbackExecutor& operator=(const CallbackExecutor&) = delete;
+
+    /// callbacks discarded by the overflow policy or after destruction
+    uint64_t dropped() const;
+    /// callbacks waiting to run
+    size_t pending() const;
+
+private:
+    friend class detail::ExecutorState;
+    std::shared_ptr<detail::ExecutorState> state_;
+};
+
+struct CacheOptions {
+    /// resolve and address results are cached for their record TTL
+    bool enabled = true;
+    /// serve expired results at once and refresh them in the background
+    bool staleWhileRevalidate = false;
+    /// how long past its TTL a result may still be served
+    std::chrono::seconds maxStale = std::chrono::minutes(5);
+    size_t maxEntries = 4096;
+};
+
+/// Latency distribution over power-of-two buckets: bucket 0 counts samples
+/// below 1 µs, bucket i those in [2^(i-1), 2^i) µs, the last one everything
+/// from about 33 s up.
+struct KNOTDNSSD_EXPORT LatencyHistogram {
+    static constexpr size_t kBuckets = 27;
+
+    std::array<uint64_t, kBuckets> buckets{};
+    uint64_t count = 0;
+    uint64_t sumMicros = 0;
+
+    /// upper bound in microseconds of the bucket holding quantile q (0 to 1);
+    /// 0 without samples
+    uint64_t percentile(double q) const;
+};
+
+/// Load of one event loop, see shardStats().
+struct ShardStats {
+    /// operations started on it
+    uint64_t operations = 0;
+    /// posted tasks, timers and socket events handled
+    uint64_t dispatches = 0;
+    /// time spent handling them rather than waiting for the next
+    std::chrono::microseconds busy{0};
+    /// posted tasks waiting to run
+    size_t queued = 0;
+};
+
+/// Snapshot of the library counters, see metrics().
+struct Metrics {
+    /// browse events received by browses and directories
+    uint64_t servicesAdded = 0;
+    uint64_t servicesRemoved = 0;
+    /// resolveServiceAsync and queryIPv*AddressAsync calls
+    uint64_t resolves = 0;
+    uint64_t queries = 0;
+    /// operations that ended, by status
+    uint64_t completed = 0;
+    uint64_t timeouts = 0;
+    uint64_t cancellations = 0;
+    uint64_t failures = 0;
+    /// daemon connections re-established after they were lost
+    uint64_t reconnects = 0;
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    /// operations started and not yet finished
+    int64_t inFlight = 0;
+    /// from the call to the first answer, cache hits included
+    LatencyHistogram resolveLatency;
+    LatencyHistogram queryLatency;
+    /// time spent inside user callbacks on the event loop thread
+    LatencyHistogram callbackTime;
+    /// log messages lost to rate limiting or to a full log queue
+    uint64_t logsDropped = 0;
+};
+
+enum class LogLevel : uint8_t {
+    /// only compiled in with the KNOTDNSSD_DEBUG_LOG build option
+    Debug = 0,
+    Info = 1,
+    Warning = 2,
+    Error = 3,
+};
+
+/// Receives the library's diagnostics on its logging thread, never on the
+/// event loop thread, one message at a time. suppressed counts the messages
+/// from the same place that the rate limit dropped since the previous one.
+using LogSink = Fn<void(LogLevel level, std::string_view message, uint64_t suppressed)>;
+
+struct LogOptions {
+    /// less severe messages are discarded before they are formatted
+    LogLevel level = LogLevel::Info;
+    /// messages each place in the library may log per interval, the rest
+    /// is counted and dropped; 0 lifts the limit
+    unsigned burst = 10;
+    std::chrono::milliseconds interval = std::chrono::seconds(1);
+};
+
+namespace detail {
+class OperationState;
+class CancellationState;
+class DirectoryState;
+class RegistrationState;
+}
+
+/// Stop signal for blocking operations, backed by an eventfd (self-pipe on
+/// other platforms) that wakes the event loop as soon as cancel() is called.
+/// Copies share the same state, so one token can stop many operations.
+class KNOTDNSSD_EXPORT CancellationToken {
+public:
+    CancellationToken();
+
+    /// non-blocking, safe from any thread and from signal handlers
+    void cancel();
+    bool cancelled() const;
+    /// longest observed delay between cancel() and the teardown of a bound operation
+    std::chrono::steady_clock::duration teardownLatency() const;
+
+private:
+    friend class Operation;
+    std::shared_ptr<detail::CancellationState> state_;
+};
+
+/// Handle to an operation running on the library event loop.
+/// Callbacks are invoked on the event loop thread. Destroying the handle
+/// cancels the operation unless it was detached.
+class KNOTDNSSD_EXPORT Operation {
+public:
+    Operation() noexcept = default;
+    explicit Operation(std::shared_ptr<detail::OperationState> state) noexcept;
+    Operation(Operation&& other) noexcept = default;
+    Operation& operator=(Operation&& other) noexcept;
+    Operation(const Operation&) = delete;
+    Operation& operator=(const Operation&) = delete;
+    ~Operation();
+
+    /// non-blocking, no callbacks are delivered once it returns
+    void cancel();
+    /// cancels the operation once the token is cancelled
+    void bind(const CancellationToken& token);
+    /// lets the operation run until it completes on its own
+    void detach() noexcept;
+    bool done() const;
+    /// blocking operation, must not be called from a callback
+    void wait() const;
+    /// blocking operation, must not be called from a callback
+    bool waitFor(std::chrono::milliseconds timeout) const;
+    /// how the operation ended, unset while it is running
+    std::optional<Status> status() const;
+
+    explicit operator bool() const noexcept { return static_cast<bool>(state_); }
+
+protected:
+    std::shared_ptr<detail::OperationState> state_;
+};
+
+struct ServiceRegistration {
+    std::string serviceName;
+    std::string regType;
+    /// empty for the default domain
+    std::string domain;
+    uint16_t port = 0;
+    TxtRecord txt;
+    /// such as "_printer" for a "_http._tcp" service, see RFC 6763, section 7.1
+    std::vector<std::string> subtypes;
+};
+
+/// Services advertised together over one entry group (Avahi) or one shared
+/// daemon connection (Bonjour). Cancelling withdraws all of them.
+class KNOTDNSSD_EXPORT Registration : public Operation {
+public:
+    Registration() noexcept = default;
+    Registration(std::shared_ptr<detail::OperationState> state, std::shared_ptr<detail::RegistrationState> registration) noexcept;
+
+    /// non-blocking; replaces the TXT record of the service at index in place,
+    /// without withdrawing and re-announcing it
+    void updateTxt(const TxtRecord& txt, size_t index = 0);
+
+private:
+    std::shared_ptr<detail::RegistrationState> registration_;
+};
+
+struct ServiceInstance {
+    std::string serviceName;
+    std::string regType;
+    std::string replyDomain;
+};
+
+/// Change of the instance set reported by a batched browse.
+struct ServiceEvent {
+    BrowseEvent event = ServiceAdded;
+    ServiceInstance instance;
+};
+
+using BrowseBatchCallback = Fn<void(const std::vector<ServiceEvent>& events)>;
+
+struct BatchOptions {
+    /// events are held at least this long after the first one of a batch, so
+    /// that bursts the daemon reports piecemeal end up in one batch; zero
+    /// delivers as soon as the daemon has nothing more queued
+    std::chrono::milliseconds window{0};
+    /// delivers early once this many instances changed, zero for no limit
+    size_t maxEvents = 0;
+};
+
+/// Live set of the instances of one service type, maintained by a browse.
+///
+/// The browse thread applies add/remove events to a private working set and
+/// publishes immutable snapshots RCU-style, once per burst of events. Readers
+/// pin the current snapshot without locks or copies; retired snapshots are
+/// reclaimed once no reader can still see them.
+class KNOTDNSSD_EXPORT ServiceDirectory {
+public:
+    struct Snapshot {
+        /// incremented on every publication
+        uint64_t version = 0;
+        /// some instances come from loadSnapshot() and were not confirmed by
+        /// the browse yet; unconfirmed ones are dropped once it settles
+        bool provisional = false;
+        /// ordered by service name
+        std::vector<std::shared_ptr<const ServiceInstance>> instances;
+
+        const ServiceInstance* find(std::string_view serviceName) const;
+    };
+
+    /// Pins a snapshot; keep it short-lived and never let it outlive the directory.
+    class KNOTDNSSD_EXPORT View {
+    public:
+        View(View&& other) noexcept;
+        View(const View&) = delete;
+        View& operator=(const View&) = delete;
+        View& operator=(View&&) = delete;
+        ~View();
+
+        const Snapshot& operator*() const { return *snapshot_; }
+        const Snapshot* operator->() const { return snapshot_; }
+
+    private:
+        friend class ServiceDirectory;
+        View(const detail::DirectoryState* state, const Snapshot* snapshot) : state_(state), snapshot_(snapshot) {}
+
+        const detail::DirectoryState* state_;
+        const Snapshot* snapshot_;
+    };
+
+    /// non-blocking, starts browsing right away
+    ServiceDirectory(const char* regType, const char* domain);
+    ~ServiceDirectory();
+    ServiceDirectory(const ServiceDirectory&) = delete;
+    ServiceDirectory& operator=(const ServiceDirectory&) = delete;
+
+    /// lock-free, safe from any thread
+    View view() const;
+
+private:
+    std::shared_ptr<detail::DirectoryState> state_;
+    Operation browse_;
+};
+
+/// applies to the resolve and address caches
+KNOTDNSSD_EXPORT
+void setCacheOptions(const CacheOptions& options);
+
+KNOTDNSSD_EXPORT
+void clearCache();
+
+/// Writes the resolve and address caches and the instances of every live
+/// ServiceDirectory to path, replacing the file atomically. The format is
+/// compact and read in place, see loadSnapshot(). false on I/O errors.
+KNOTDNSSD_EXPORT
+bool saveSnapshot(const char* path);
+
+/// Warm start from a file written by saveSnapshot(), meant to be called once
+/// before any operation starts. Its entries are provisional: until their TTL
+/// ends the caches answer lookups from them at once and revalidate them with
+/// a query in the background, dropping those no peer confirms. Directories
+/// created afterwards start out with the saved instances until their browse
+/// settles, which takes a few seconds at most even if nothing answers.
+/// Entries that expired more than maxAge ago are skipped. false if the file
+/// is missing or malformed.
+KNOTDNSSD_EXPORT
+bool loadSnapshot(const char* path, std::chrono::seconds maxAge = std::chrono::hours(1));
+
+/// deadline of one-shot operations (resolves and address queries) that set
+/// no timeout of their own, 10 s unless changed; zero disables it
+KNOTDNSSD_EXPORT
+void setDefaultTimeout(std::chrono::milliseconds timeout);
+
+/// Spreads operations over count event loop threads, each with a daemon
+/// connection (or mDNS sockets) of its own. Browses, registrations and
+/// directories go to the shard their service type hashes to, resolves by
+/// instance name and address queries by host name; the callbacks of one
+/// operation keep running in order on its shard. Only takes effect before
+/// the first operation starts (or shardStats() is called); the default is a
+/// single loop.
+KNOTDNSSD_EXPORT
+void setShardCount(unsigned count);
+
+/// one entry per event loop, lock-free apart from a short lock per loop
+KNOTDNSSD_EXPORT
+std::vector<ShardStats> shardStats();
+
+/// off by default; applies to operations started afterwards, so in-flight
+/// and latency figures only cover operations started while it is on
+KNOTDNSSD_EXPORT
+void setMetricsEnabled(bool enabled);
+
+/// lock-free, safe from any thread; cheap enough to scrape every second
+KNOTDNSSD_EXPORT
+Metrics metrics();
+
+/// zeroes every counter except inFlight
+KNOTDNSSD_EXPORT
+void resetMetrics();
+
+/// Replaces the sink, by default every message goes to stderr; an empty sink
+/// restores that. Messages are handed over through a bounded queue, so the
+/// event loop never waits for the sink; when it is full they are dropped.
+KNOTDNSSD_EXPORT
+void setLogSink(LogSink sink, const LogOptions& options = {});
+
+/// non-blocking, the service stays registered until the operation is cancelled
+[[nodiscard]] KNOTDNSSD_EXPORT
+Registration registerServiceAsync(const char* serviceName, const char* regType, const char* domain, uint16_t port, const TxtRecord& txt, const OperationOptions& options = {});
+
+/// non-blocking, registers all services at once; they stay registered until
+/// the operation is cancelled
+[[nodiscard]] KNOTDNSSD_EXPORT
+Registration registerServicesAsync(std::vector<ServiceRegistration> services, const OperationOptions& options = {});
+
+/// non-blocking, browses until the operation is cancelled; reports both
+/// ServiceAdded and ServiceRemoved events
+[[nodiscard]] KNOTDNSSD_EXPORT
+Operation browseServicesAsync(const char* regType, const char* domain, BrowseCallback callback, const OperationOptions& options = {});
+
+/// non-blocking, like browseServicesAsync but only reports the instances
+/// registered with subtype (such as "_printer"); the daemon does the
+/// filtering, so other instances never reach the library. Replies carry the
+/// base regType, ready to be resolved.
+[[nodiscard]] KNOTDNSSD_EXPORT
+Operation browseSubtypeAsync(const char* regType, const char* subtype, const char* domain, BrowseCallback callback, const OperationOptions& options = {});
+
+/// non-blocking, browses until the operation is cancelled and reports how
+/// the instance set changed, one batch at a time. Batches end where the
+/// daemon signals that nothing more is coming and the window has passed; the
+/// initial one holds everything known when the browse starts. Each instance
+/// is reported once however many interfaces it is seen on, and one that
+/// appears and vanishes within a batch is not reported at all.
+[[nodiscard]] KNOTDNSSD_EXPORT
+Operation browseServicesBatchedAsync(const char* regType, const char* domain, BrowseBatchCallback callback, const BatchOptions& batch = {}, const OperationOptions& options = {});
+
+/// non-blocking, completes after the first reply or with std::nullopt once
+/// the deadline passes; concurrent lookups of the same instance share one
+/// query and answers are cached for their TTL
+[[nodiscard]] KNOTDNSSD_EXPORT
+Operation resolveServiceAsync(const char* serviceName, const char* regType, const char* domain, ResolveCallback callback, const OperationOptions& options = {});
+
+/// non-blocking, like resolveServiceAsync, but match sees the TXT record in
+/// wire form before any reply is built. An instance it rejects completes the
+/// operation with Status::Ok and never reaches callback. Filtered lookups
+/// always ask the daemon, they neither use nor fill the cache.
+[[nodiscard]] KNOTDNSSD_EXPORT
+Operation resolveServiceAsync(const char* serviceName, const char* regType, const char* domain, TxtPredicate match, ResolveCallback callback, const OperationOptions& options = {});
+
+/// non-blocking, keeps the instance resolved until the operation is
+/// cancelled and reports each change of its host, address, port or TXT
+/// record, such as a load figure the service republishes. It neither uses nor
+/// fills the resolve cache. A daemon error completes the operation with
+/// Status::Failed. Leave noticing that the instance went away to a browse:
+/// Avahi ends the watch with Status::Failed then, the other backends keep
+/// waiting for the instance to come back.
+[[nodiscard]] KNOTDNSSD_EXPORT
+Operation watchServiceAsync(const char* serviceName, const char* regType, const char* domain, ServiceUpdateCallback callback, const OperationOptions& options = {});
+
+/// non-blocking, completes after the first reply; cached like resolveServiceAsync
+[[nodiscard]] KNOTDNSSD_EXPORT
+Operation queryIPv6AddressAsync(const char* hostName, QueryCallback callback, const OperationOptions& options = {});
+
+/// non-blocking, completes after the first reply; cached like resolveServiceAsync
+[[nodiscard]] KNOTDNSSD_EXPORT
+Operation queryIPv4AddressAsync(const char* hostName, QueryCallback callback, const OperationOptions& options = {});
+
+/// non-blocking, queries A and AAAA records concurrently and streams the
+/// addresses of both families; completes once both have answered
+[[nodiscard]] KNOTDNSSD_EXPORT
+Operation resolveAddressesAsync(const char* hostName, AddressHandlers handlers, const OperationOptions& options = {});
+
+// The blocking functions wait for the event loop and so cannot run on its
+// thread. Called from a library callback they return at once without
+// starting anything, those returning a Status with Status::Failed; use the
+// asynchronous variants there. Callbacks run by a CallbackExecutor are free
+// to block.
+
+/// blocking operation, isStopped is polled every 100 ms; prefer the CancellationToken overload; from a callback it returns at once
+KNOTDNSSD_EXPORT
+void registerService(const char* serviceName, const char* regType, const char* domain, uint16_t port, const TxtRecord& txt, const Fn<bool()>& isStopped);
+
+/// blocking operation, returns right after the token is cancelled; from a callback it returns at once
+KNOTDNSSD_EXPORT
+void registerService(const char* serviceName, const char* regType, const char* domain, uint16_t port, const TxtRecord& txt, const CancellationToken& token);
+
+/// blocking operation, reports ServiceAdded events only;
+/// isStopped is polled every 100 ms, prefer the CancellationToken overload; from a callback it returns at once
+KNOTDNSSD_EXPORT
+void browseServices(const char* regType, const char* domain, BrowseCallbackRef callback, const Fn<bool()>& isStopped);
+
+/// blocking operation, reports ServiceAdded events only;
+/// returns right after the token is cancelled; from a callback it returns at once
+KNOTDNSSD_EXPORT
+void browseServices(const char* regType, const char* domain, BrowseCallbackRef callback, const CancellationToken& token);
+
+/// blocking operation, bounded by the default timeout; from a callback it fails at once
+KNOTDNSSD_EXPORT
+Status resolveService(const char* serviceName, const char* regType, const char* domain, ResolveCallbackRef callback);
+
+/// blocking operation, returns right after the token is cancelled; from a callback it fails at once
+KNOTDNSSD_EXPORT
+Status resolveService(const char* serviceName, const char* regType, const char* domain, ResolveCallbackRef callback, const CancellationToken& token);
+
+/// blocking operation, bounded by the default timeout; from a callback it fails at once
+KNOTDNSSD_EXPORT
+Status queryIPv6Address(const char* hostName, QueryCallbackRef callback);
 
-/// blocking operation
+/// blocking operation, returns right after the token is cancelled; from a callback it fails at once
 KNOTDNSSD_EXPORT
-void registerService(const char* serviceName, const char* regType, const char* domain, uint16_t port, const std::unordered_map<std::string, std::string>& txt, const Fn<bool()>& isStopped);
+Status queryIPv6Address(const char* hostName, QueryCallbackRef callback, const CancellationToken& token);
 
-/// blocking operation
+/// blocking operation, bounded by the default timeout; from a callback it fails at once
 KNOTDNSSD_EXPORT
-void browseServices(const char* regType, const char* domain, const BrowseCallback& callback, const Fn<bool()>& isStopped);
+Status queryIPv4Address(const char* hostName, QueryCallbackRef callback);
 
-/// blocking operation
+/// blocking operation, returns right after the token is cancelled; from a callback it fails at once
 KNOTDNSSD_EXPORT
-void resolveService(const char* serviceName, const char* regType, const char* domain, const ResolveCallback& callback);
+Status queryIPv4Address(const char* hostName, QueryCallbackRef callback, const CancellationToken& token);
 
+/// blocking operation, returns once both families have answered or the default timeout passed; from a callback it fails at once
 KNOTDNSSD_EXPORT
-void queryIPv6Address(const char* hostName, const QueryCallback& callback);
+Status resolveAddresses(const char* hostName, const AddressHandlers& handlers);
 
+/// blocking operation, returns right after the token is cancelled; from a callback it fails at once
 KNOTDNSSD_EXPORT
-void queryIPv4Address(const char* hostName, const QueryCallback& callback);
+Status resolveAddresses(const char* hostName, const AddressHandlers& handlers, const CancellationToken& token);
 
 }
 
@@ -0,0 +1,356 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_CORO_H
+#define KNOTDNSSD_CORO_H
+
+// Opt-in C++20 awaitables on top of the callback API; the library itself
+// stays C++17. They work with any coroutine type: the operation starts when
+// it is awaited and the coroutine resumes on the event loop thread (or on
+// OperationOptions::executor) once the operation has ended. No thread blocks
+// in between, so one thread can await any number of discoveries.
+//
+// Cancel an awaited operation through a CancellationToken, the coroutine
+// then resumes with Status::Cancelled. A suspended coroutine may also be
+// destroyed, but not while the event loop could be resuming it.
+
+#include "knot/dnssd.h"
+
+#if !defined(__cpp_impl_coroutine) || !__has_include(<coroutine>)
+#  error "knot/dnssd_coro.h needs C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <deque>
+#include <mutex>
+
+namespace knot::coro {
+
+template<typename T>
+struct Result {
+    /// unset on timeout, cancellation or failure
+    std::optional<T> value;
+    Status status = Status::Cancelled;
+
+    explicit operator bool() const { return value.has_value(); }
+};
+
+/// Browse event that owns its strings, unlike BrowseReply.
+struct BrowseUpdate {
+    BrowseEvent event = ServiceAdded;
+    ServiceInstance instance;
+    bool moreComing = false;
+    /// see BrowseReply::interfaces
+    std::vector<uint32_t> interfaces;
+};
+
+namespace detail {
+
+/// Shared between an awaiter and the callbacks of its operation.
+template<typename T>
+class AwaitState {
+public:
+    void setHandle(std::coroutine_handle<> handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        handle_ = handle;
+    }
+
+    void setValue(T value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        value_ = std::move(value);
+    }
+
+    /// appends to a collected value, see resolveAddresses()
+    template<typename Item>
+    void append(const Item& item) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!value_) {
+            value_.emplace();
+        }
+        value_->push_back(item);
+    }
+
+    /// onComplete, runs exactly once
+    void complete(Status status) {
+        std::coroutine_handle<> handle;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            status_ = status;
+            handle = std::exchange(handle_, nullptr);
+        }
+        if (handle) {
+            handle.resume();
+        }
+    }
+
+    /// keeps the operation; cancels it right away if the awaiter is gone
+    void adopt(Operation op) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (abandoned_) {
+            lock.unlock();
+            op.cancel();
+            return;
+        }
+        op_ = std::move(op);
+    }
+
+    /// the awaiter is destroyed: nothing may be resumed any more
+    void abandon() {
+        Operation op;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            abandoned_ = true;
+            handle_ = nullptr;
+            op = std::move(op_);
+        }
+        op.cancel();
+    }
+
+    Result<T> take() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // a collection that got no item is still a successful, empty answer
+        if constexpr (requires(T& collection) { collection.clear(); }) {
+            if (!value_ && status_ == Status::Ok) {
+                value_.emplace();
+            }
+        }
+        return Result<T>{std::move(value_), status_};
+    }
+
+private:
+    std::mutex mutex_;
+    std::coroutine_handle<> handle_;
+    std::optional<T> value_;
+    Status status_ = Status::Cancelled;
+    Operation op_;
+    bool abandoned_ = false;
+};
+
+/// Awaiter of a one-shot operation; starter runs the callback API with
+/// options whose onComplete resumes the coroutine.
+template<typename T>
+class OperationAwaiter {
+public:
+    using State = AwaitState<T>;
+    using Starter = Fn<Operation(const std::shared_ptr<State>& state, const OperationOptions& options)>;
+
+    OperationAwaiter(Starter starter, OperationOptions options, std::optional<CancellationToken> token)
+            : state_(std::make_shared<State>()), starter_(std::move(starter)), options_(std::move(options)), token_(std::move(token)) {}
+
+    OperationAwaiter(OperationAwaiter&&) noexcept = default;
+    OperationAwaiter(const OperationAwaiter&) = delete;
+    OperationAwaiter& operator=(const OperationAwaiter&) = delete;
+
+    ~OperationAwaiter() {
+        if (state_) {
+            state_->abandon();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        // the coroutine may resume on the event loop before this returns,
+        // taking the awaiter with it, so everything needed is moved out first
+        std::shared_ptr<State> state = state_;
+        Starter starter = std::move(starter_);
+        std::optional<CancellationToken> token = std::move(token_);
+        OperationOptions options = std::move(options_);
+        options.onComplete = [state, onComplete = std::move(options.onComplete)](Status status) {
+            if (onComplete) {
+                onComplete(status);
+            }
+            state->complete(status);
+        };
+        state->setHandle(handle);
+        Operation op = starter(state, options);
+        if (token) {
+            op.bind(*token);
+        }
+        state->adopt(std::move(op));
+    }
+
+    Result<T> await_resume() { return state_->take(); }
+
+private:
+    std::shared_ptr<State> state_;
+    Starter starter_;
+    OperationOptions options_;
+    std::optional<CancellationToken> token_;
+};
+
+}
+
+/// co_await yields the first reply, see resolveServiceAsync
+[[nodiscard]] inline detail::OperationAwaiter<ResolveReply> resolveService(std::string serviceName, std::string regType, std::string domain, OperationOptions options = {}, std::optional<CancellationToken> token = std::nullopt) {
+    return {[serviceName = std::move(serviceName), regType = std::move(regType), domain = std::move(domain)](const auto& state, const OperationOptions& options) {
+        return resolveServiceAsync(serviceName.c_str(), regType.c_str(), domain.c_str(), [state](const std::optional<ResolveReply>& reply) {
+            if (reply) {
+                state->setValue(*reply);
+            }
+        }, options);
+    }, std::move(options), std::move(token)};
+}
+
+/// co_await yields the first AAAA answer
+[[nodiscard]] inline detail::OperationAwaiter<IPAddress> queryIPv6Address(std::string hostName, OperationOptions options = {}, std::optional<CancellationToken> token = std::nullopt) {
+    return {[hostName = std::move(hostName)](const auto& state, const OperationOptions& options) {
+        return queryIPv6AddressAsync(hostName.c_str(), [state](const std::optional<IPAddress>& address) {
+            if (address) {
+                state->setValue(*address);
+            }
+        }, options);
+    }, std::move(options), std::move(token)};
+}
+
+/// co_await yields the first A answer
+[[nodiscard]] inline detail::OperationAwaiter<IPAddress> queryIPv4Address(std::string hostName, OperationOptions options = {}, std::optional<CancellationToken> token = std::nullopt) {
+    return {[hostName = std::move(hostName)](const auto& state, const OperationOptions& options) {
+        return queryIPv4AddressAsync(hostName.c_str(), [state](const std::optional<IPAddress>& address) {
+            if (address) {
+                state->setValue(*address);
+            }
+        }, options);
+    }, std::move(options), std::move(token)};
+}
+
+/// co_await yields the addresses of both families, IPv6 first once both have answered
+[[nodiscard]] inline detail::OperationAwaiter<std::vector<IPAddress>> resolveAddresses(std::string hostName, OperationOptions options = {}, std::optional<CancellationToken> token = std::nullopt) {
+    return {[hostName = std::move(hostName)](const auto& state, const OperationOptions& options) {
+        AddressHandlers handlers;
+        handlers.onAddress = [state](const IPAddress& address) { state->append(address); };
+        return resolveAddressesAsync(hostName.c_str(), std::move(handlers), options);
+    }, std::move(options), std::move(token)};
+}
+
+/// Browse whose events are awaited one by one:
+///
+///     auto stream = knot::coro::browseServices("_http._tcp", "");
+///     while (auto update = co_await stream.next()) { ... }
+///
+/// Events that arrive while nobody awaits are buffered without bound.
+/// Destroying the stream cancels the browse; a pending next() then resumes
+/// with std::nullopt.
+class BrowseStream {
+    class State;
+
+public:
+    class NextAwaiter {
+    public:
+        explicit NextAwaiter(std::shared_ptr<State> state) : state_(std::move(state)) {}
+
+        bool await_ready() const { return state_->ready(); }
+        bool await_suspend(std::coroutine_handle<> handle) { return state_->park(handle); }
+        std::optional<BrowseUpdate> await_resume() { return state_->pop(); }
+
+    private:
+        std::shared_ptr<State> state_;
+    };
+
+    BrowseStream(std::string regType, std::string domain, OperationOptions options = {}, std::optional<CancellationToken> token = std::nullopt)
+            : state_(std::make_shared<State>()) {
+        auto state = state_;
+        options.onComplete = [state, onComplete = std::move(options.onComplete)](Status status) {
+            if (onComplete) {
+                onComplete(status);
+            }
+            state->finish(status);
+        };
+        op_ = browseServicesAsync(regType.c_str(), domain.c_str(), [state](const BrowseReply& reply) {
+            state->push(BrowseUpdate{reply.event, ServiceInstance{reply.serviceName, reply.regType, reply.replyDomain}, reply.moreComing,
+                                     std::vector<uint32_t>(reply.interfaces, reply.interfaces + reply.interfaceCount)});
+        }, options);
+        if (token) {
+            op_.bind(*token);
+        }
+    }
+
+    BrowseStream(BrowseStream&&) noexcept = default;
+    BrowseStream& operator=(BrowseStream&&) noexcept = default;
+
+    /// std::nullopt once the browse has ended and every buffered event was taken
+    [[nodiscard]] NextAwaiter next() { return NextAwaiter(state_); }
+
+    void cancel() { op_.cancel(); }
+    /// how the browse ended, unset while it is running
+    std::optional<Status> status() const { return state_->status(); }
+
+private:
+    class State {
+    public:
+        bool ready() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return !updates_.empty() || status_;
+        }
+
+        /// false resumes at once, an update arrived in the meantime
+        bool park(std::coroutine_handle<> handle) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!updates_.empty() || status_) {
+                return false;
+            }
+            handle_ = handle;
+            return true;
+        }
+
+        std::optional<BrowseUpdate> pop() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (updates_.empty()) {
+                return std::nullopt;
+            }
+            BrowseUpdate update = std::move(updates_.front());
+            updates_.pop_front();
+            return update;
+        }
+
+        void push(BrowseUpdate update) {
+            std::coroutine_handle<> handle;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                updates_.push_back(std::move(update));
+                handle = std::exchange(handle_, nullptr);
+            }
+            if (handle) {
+                handle.resume();
+            }
+        }
+
+        void finish(Status status) {
+            std::coroutine_handle<> handle;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                status_ = status;
+                handle = std::exchange(handle_, nullptr);
+            }
+            if (handle) {
+                handle.resume();
+            }
+        }
+
+        std::optional<Status> status() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return status_;
+        }
+
+    private:
+        mutable std::mutex mutex_;
+        std::deque<BrowseUpdate> updates_;
+        std::coroutine_handle<> handle_;
+        std::optional<Status> status_;
+    };
+
+    std::shared_ptr<State> state_;
+    Operation op_;
+};
+
+[[nodiscard]] inline BrowseStream browseServices(std::string regType, std::string domain, OperationOptions options = {}, std::optional<CancellationToken> token = std::nullopt) {
+    return BrowseStream(std::move(regType), std::move(domain), std::move(options), std::move(token));
+}
+
+}
+
+#endif //KNOTDNSSD_CORO_H
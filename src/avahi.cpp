@@ -8,148 +8,457 @@
 #if defined(USE_AVAHI)
 
 #include "knot/dnssd.h"
+#include "backend.h"
+#include "log.h"
+#include "metrics.h"
 
 #include <avahi-client/client.h>
 #include <avahi-client/publish.h>
 #include <avahi-client/lookup.h>
-#include <avahi-common/simple-watch.h>
+#include <avahi-common/watch.h>
 #include <avahi-common/error.h>
 #include <avahi-common/malloc.h>
-#include <iostream>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <netinet/in.h>
+#include <sys/time.h>
+
+using knot::detail::Reactor;
+
+// AvahiPoll adapter that runs avahi-client's watches and timeouts on the
+// library reactor, so every client shares one event loop thread.
+
+struct AvahiWatch {
+    Reactor* reactor;
+    Reactor::Id id;
+    int fd;
+    AvahiWatchEvent events;
+    AvahiWatchEvent happened;
+    AvahiWatchCallback callback;
+    void* userdata;
+};
+
+struct AvahiTimeout {
+    Reactor* reactor;
+    Reactor::Id id;
+    AvahiTimeoutCallback callback;
+    void* userdata;
+};
 
 namespace knot {
 
-void loop(AvahiSimplePoll *poll, const std::function<bool()>& isStopped) {
-    while (!isStopped()) {
-        avahi_simple_poll_iterate(poll, 100);
+static unsigned to_reactor_events(AvahiWatchEvent event) {
+    unsigned events = 0;
+    if (event & AVAHI_WATCH_IN) {
+        events |= Reactor::Readable;
     }
+    if (event & AVAHI_WATCH_OUT) {
+        events |= Reactor::Writable;
+    }
+    return events;
 }
 
-static AvahiStringList* create_avahi_txt(const std::unordered_map<std::string, std::string>& txt) {
-    AvahiStringList* txt_list = nullptr;
-    for (const auto& [key, value] : txt) {
-        txt_list = avahi_string_list_add_pair(txt_list, key.c_str(), value.c_str());
+static AvahiWatchEvent to_avahi_events(unsigned events) {
+    int event = 0;
+    if (events & Reactor::Readable) {
+        event |= AVAHI_WATCH_IN;
     }
-    return txt_list;
+    if (events & Reactor::Writable) {
+        event |= AVAHI_WATCH_OUT;
+    }
+    if (events & Reactor::Error) {
+        event |= AVAHI_WATCH_ERR;
+    }
+    if (events & Reactor::HangUp) {
+        event |= AVAHI_WATCH_HUP;
+    }
+    return static_cast<AvahiWatchEvent>(event);
 }
 
-struct RegisterContext {
-    AvahiSimplePoll* poll;
-    AvahiEntryGroup* group;
-    const char* serviceName;
-    const char* regType;
-    const char* domain;
-    uint16_t port;
-    const std::unordered_map<std::string, std::string>& txt;
-};
+static AvahiWatch* poll_watch_new(const AvahiPoll* api, int fd, AvahiWatchEvent event, AvahiWatchCallback callback, void* userdata) {
+    auto* reactor = static_cast<Reactor*>(api->userdata);
+    auto* watch = new AvahiWatch{reactor, 0, fd, event, static_cast<AvahiWatchEvent>(0), callback, userdata};
+    watch->id = reactor->addWatch(fd, to_reactor_events(event), [watch](unsigned events) {
+        watch->happened = to_avahi_events(events);
+        watch->callback(watch, watch->fd, watch->happened, watch->userdata);
+    });
+    return watch;
+}
 
-void reg_client_callback(AvahiClient* client, AvahiClientState state, void* userdata) {
-    auto* context = static_cast<RegisterContext*>(userdata);
+static void poll_watch_update(AvahiWatch* watch, AvahiWatchEvent event) {
+    watch->events = event;
+    watch->reactor->updateWatch(watch->id, to_reactor_events(event));
+}
 
-    switch (state) {
-        case AVAHI_CLIENT_S_RUNNING:
-            if (!context->group) {
-                context->group = avahi_entry_group_new(client, nullptr, nullptr);
-                if (!context->group) {
-                    return;
-                }
+static AvahiWatchEvent poll_watch_get_events(AvahiWatch* watch) {
+    return watch->happened;
+}
 
-                AvahiStringList* txt_list = create_avahi_txt(context->txt);
-                avahi_entry_group_add_service_strlst(context->group, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, static_cast<AvahiPublishFlags>(0), context->serviceName, context->regType, context->domain, nullptr, context->port, txt_list);
-                avahi_string_list_free(txt_list);
-                int ret = avahi_entry_group_commit(context->group);
-                if (ret < 0) {
-                    std::cerr << "Failed to commit entry group: " << avahi_strerror(ret) << std::endl;
-                }
-            }
+static void poll_watch_free(AvahiWatch* watch) {
+    watch->reactor->removeWatch(watch->id);
+    delete watch;
+}
 
-            break;
+static Reactor::Clock::time_point to_deadline(const struct timeval* tv) {
+    // avahi hands out absolute wall clock times, the reactor runs on a monotonic clock
+    struct timeval now{};
+    gettimeofday(&now, nullptr);
+    auto delta = std::chrono::seconds(tv->tv_sec - now.tv_sec) + std::chrono::microseconds(tv->tv_usec - now.tv_usec);
+    if (delta.count() < 0) {
+        delta = delta.zero();
+    }
+    return Reactor::Clock::now() + std::chrono::duration_cast<Reactor::Clock::duration>(delta);
+}
 
-        case AVAHI_CLIENT_FAILURE:
-            std::cerr << "Client failure: " << avahi_strerror(avahi_client_errno(client)) << std::endl;
-            avahi_simple_poll_quit(context->poll);
+static void poll_timeout_update(AvahiTimeout* timeout, const struct timeval* tv) {
+    if (timeout->id) {
+        timeout->reactor->removeTimer(timeout->id);
+        timeout->id = 0;
+    }
+    if (tv) {
+        timeout->id = timeout->reactor->addTimer(to_deadline(tv), [timeout] {
+            timeout->id = 0;
+            timeout->callback(timeout, timeout->userdata);
+        });
+    }
+}
 
-            break;
+static AvahiTimeout* poll_timeout_new(const AvahiPoll* api, const struct timeval* tv, AvahiTimeoutCallback callback, void* userdata) {
+    auto* timeout = new AvahiTimeout{static_cast<Reactor*>(api->userdata), 0, callback, userdata};
+    poll_timeout_update(timeout, tv);
+    return timeout;
+}
 
-        case AVAHI_CLIENT_S_COLLISION:
+static void poll_timeout_free(AvahiTimeout* timeout) {
+    if (timeout->id) {
+        timeout->reactor->removeTimer(timeout->id);
+    }
+    delete timeout;
+}
 
-            /* Let's drop our registered services. When the server is back
-             * in AVAHI_SERVER_RUNNING state we will register them
-             * again with the new host name. */
+/// Something that lives on top of the shared client: a registration, a
+/// browser or a resolver. start() is called whenever the client reaches the
+/// running state, stop() whenever the objects it created became invalid.
+struct Attachment {
+    virtual ~Attachment() = default;
+    virtual void start(AvahiClient* client) = 0;
+    virtual void stop() = 0;
+    virtual void onClientState(AvahiClientState) {}
+};
 
-        case AVAHI_CLIENT_S_REGISTERING:
+/// Long-lived avahi-daemon connection shared by every operation of a reactor.
+///
+/// The client is created lazily on first use with AVAHI_CLIENT_NO_FAIL, so it
+/// survives daemon restarts: attachments are stopped while the daemon is away
+/// and started again once the client is back in the running state. A hard
+/// client failure frees the client and reconnects with exponential backoff.
+class ClientConnection {
+public:
+    explicit ClientConnection(Reactor& reactor) : reactor_(reactor), poll_{
+            &reactor,
+            poll_watch_new,
+            poll_watch_update,
+            poll_watch_get_events,
+            poll_watch_free,
+            poll_timeout_new,
+            poll_timeout_update,
+            poll_timeout_free
+    } {}
+
+    Reactor& reactor() { return reactor_; }
+
+    void attach(Attachment* attachment) {
+        attachments_.push_back(attachment);
+        if (!client_ && !reconnectTimer_) {
+            connect();
+        }
+        if (client_ && state_ == AVAHI_CLIENT_S_RUNNING) {
+            attachment->start(client_);
+        }
+    }
 
-            /* The server records are now being established. This
-             * might be caused by a host name change. We need to wait
-             * for our own records to register until the host name is
-             * properly esatblished. */
+    void detach(Attachment* attachment) {
+        attachments_.erase(std::remove(attachments_.begin(), attachments_.end(), attachment), attachments_.end());
+    }
 
-            if (context->group) {
-                avahi_entry_group_reset(context->group);
-            }
+private:
+    static void client_callback(AvahiClient* client, AvahiClientState state, void* userdata) {
+        static_cast<ClientConnection*>(userdata)->onState(client, state);
+    }
 
-            break;
+    void connect() {
+        int error;
+        AvahiClient* client = avahi_client_new(&poll_, AVAHI_CLIENT_NO_FAIL, client_callback, this, &error);
+        if (!client) {
+            KNOTDNSSD_LOG_ERROR("Failed to create client: %s", avahi_strerror(error));
+            scheduleReconnect();
+            return;
+        }
+        client_ = client;
+        state_ = AVAHI_CLIENT_CONNECTING;
+        backoff_ = std::chrono::milliseconds(0);
+        onState(client, avahi_client_get_state(client));
+    }
+
+    void scheduleReconnect() {
+        backoff_ = std::min<std::chrono::milliseconds>(std::max<std::chrono::milliseconds>(backoff_ * 2, std::chrono::milliseconds(250)), std::chrono::seconds(30));
+        reconnectTimer_ = reactor_.addTimer(Reactor::Clock::now() + backoff_, [this] {
+            reconnectTimer_ = 0;
+            connect();
+        });
+    }
+
+    void onState(AvahiClient* client, AvahiClientState state) {
+        // the callback can run from inside avahi_client_new, before client_ is set;
+        // connect() replays the initial state once it is
+        if (client != client_ || state == state_) {
+            return;
+        }
+        state_ = state;
+
+        switch (state) {
+            case AVAHI_CLIENT_S_RUNNING:
+                if (connectedBefore_) {
+                    knot::detail::count(&knot::detail::MetricsRegistry::reconnects);
+                }
+                connectedBefore_ = true;
+                for (Attachment* attachment : std::vector<Attachment*>(attachments_)) {
+                    attachment->start(client);
+                }
+                break;
+
+            case AVAHI_CLIENT_S_COLLISION:
+            case AVAHI_CLIENT_S_REGISTERING:
+                for (Attachment* attachment : std::vector<Attachment*>(attachments_)) {
+                    attachment->onClientState(state);
+                }
+                break;
+
+            case AVAHI_CLIENT_CONNECTING:
+                // the daemon went away, everything created on the client is gone with it
+                stopAll();
+                break;
+
+            case AVAHI_CLIENT_FAILURE:
+                KNOTDNSSD_LOG_ERROR("Client failure: %s", avahi_strerror(avahi_client_errno(client)));
+                stopAll();
+                // the client cannot be freed from inside its own callback
+                reactor_.post([this, client] {
+                    if (client_ == client) {
+                        avahi_client_free(client);
+                        client_ = nullptr;
+                        state_ = AVAHI_CLIENT_CONNECTING;
+                        scheduleReconnect();
+                    }
+                });
+                break;
+        }
+    }
 
-        case AVAHI_CLIENT_CONNECTING:
-            ;
+    void stopAll() {
+        for (Attachment* attachment : std::vector<Attachment*>(attachments_)) {
+            attachment->stop();
+        }
     }
+
+    Reactor& reactor_;
+    AvahiPoll poll_;
+    AvahiClient* client_ = nullptr;
+    AvahiClientState state_ = AVAHI_CLIENT_CONNECTING;
+    std::vector<Attachment*> attachments_;
+    Reactor::Id reconnectTimer_ = 0;
+    std::chrono::milliseconds backoff_{0};
+    /// the daemon was reachable once, so reaching it again is a reconnect
+    bool connectedBefore_ = false;
+};
+
+/// reactor thread only; the connection lives as long as the process
+static ClientConnection& connection_for(Reactor& reactor) {
+    static std::mutex mutex;
+    // never destroyed, the reactor thread may still run during static destruction
+    static auto* connections = new std::unordered_map<Reactor*, std::unique_ptr<ClientConnection>>();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& connection = (*connections)[&reactor];
+    if (!connection) {
+        connection = std::make_unique<ClientConnection>(reactor);
+    }
+    return *connection;
+}
+
+/// Attaches the context to the reactor's connection and ties its lifetime to the operation.
+template<typename Context>
+static void attach_operation(Context* context) {
+    ClientConnection& connection = connection_for(context->op->reactor());
+    context->op->setTeardown([context, &connection] {
+        connection.detach(context);
+        context->stop();
+        delete context;
+    });
+    connection.attach(context);
 }
 
-void registerService(const char* serviceName, const char* regType, const char* domain, uint16_t port, const std::unordered_map<std::string, std::string>& txt, const Fn<bool()>& isStopped) {
-    AvahiSimplePoll* poll = nullptr;
-    char* name = nullptr;
-    RegisterContext* context = nullptr;
-    AvahiClient* client = nullptr;
-    int error;
+static AvahiIfIndex to_avahi_interface(const NetworkScope& scope) {
+    return scope.interfaceIndex ? static_cast<AvahiIfIndex>(scope.interfaceIndex) : AVAHI_IF_UNSPEC;
+}
 
-    poll = avahi_simple_poll_new();
-    if (!poll) {
-        std::cerr << "Failed to create simple poll object." << std::endl;
-        goto fail;
+static AvahiProtocol to_avahi_protocol(const NetworkScope& scope) {
+    if (!scope.family) {
+        return AVAHI_PROTO_UNSPEC;
     }
+    return *scope.family == IPv6 ? AVAHI_PROTO_INET6 : AVAHI_PROTO_INET;
+}
 
-    name = avahi_strdup(serviceName);
-    if (!name) {
-        goto fail;
+static AvahiStringList* to_avahi_txt(const TxtRecord& txt) {
+    AvahiStringList* txt_list = nullptr;
+    if (!txt.empty() && avahi_string_list_parse(txt.data(), txt.size(), &txt_list) < 0) {
+        KNOTDNSSD_LOG_ERROR("Failed to parse TXT record");
+        return nullptr;
     }
+    return txt_list;
+}
 
-    context = new RegisterContext{
-        poll,
-        nullptr,
-        serviceName,
-        regType,
-        domain,
-        port,
-        txt
-    };
+/// Serializes the list into wire format. The buffer is reused, so a TXT
+/// filter can look at the record without any allocation once it has grown.
+static TxtView serialize_avahi_txt(AvahiStringList* txt) {
+    thread_local std::string wire;
+    size_t size = 0;
+    for (AvahiStringList* item = txt; item; item = avahi_string_list_get_next(item)) {
+        size += 1 + avahi_string_list_get_size(item);
+    }
+    if (wire.size() < size) {
+        wire.resize(size);
+    }
+    size = avahi_string_list_serialize(txt, wire.data(), size);
+    return TxtView(wire.data(), size);
+}
 
-    client = avahi_client_new(avahi_simple_poll_get(poll), static_cast<AvahiClientFlags>(0), reg_client_callback, context, &error);
-    if (!client) {
-        std::cerr << "Failed to create client: " << avahi_strerror(error) << std::endl;
-        goto fail;
+/// All services of a batch live in one entry group, so they are probed,
+/// announced and withdrawn together.
+struct RegisterContext : Attachment {
+    detail::OperationPtr op;
+    AvahiEntryGroup* group = nullptr;
+    detail::RegisterRequest request;
+    /// converted once per TXT change, reused whenever the group has to be re-registered
+    std::vector<AvahiStringList*> txt;
+
+    ~RegisterContext() override {
+        for (AvahiStringList* list : txt) {
+            avahi_string_list_free(list);
+        }
     }
 
-    loop(poll, isStopped);
+    void start(AvahiClient* client) override {
+        if (!group) {
+            group = avahi_entry_group_new(client, nullptr, nullptr);
+            if (!group) {
+                KNOTDNSSD_LOG_ERROR("Failed to create entry group: %s", avahi_strerror(avahi_client_errno(client)));
+                return;
+            }
+        }
+        if (avahi_entry_group_is_empty(group)) {
+            for (size_t i = 0; i < request.services.size(); ++i) {
+                const ServiceRegistration& service = request.services[i];
+                int ret = avahi_entry_group_add_service_strlst(group, to_avahi_interface(request.scope), to_avahi_protocol(request.scope), static_cast<AvahiPublishFlags>(0), service.serviceName.c_str(), service.regType.c_str(), detail::toCString(service.domain), nullptr, service.port, txt[i]);
+                if (ret < 0) {
+                    KNOTDNSSD_LOG_ERROR("Failed to add service '%s': %s", service.serviceName.c_str(), avahi_strerror(ret));
+                    continue;
+                }
+                for (const std::string& subtype : service.subtypes) {
+                    ret = avahi_entry_group_add_service_subtype(group, to_avahi_interface(request.scope), to_avahi_protocol(request.scope), static_cast<AvahiPublishFlags>(0), service.serviceName.c_str(), service.regType.c_str(), detail::toCString(service.domain), detail::subtypeName(subtype, service.regType).c_str());
+                    if (ret < 0) {
+                        KNOTDNSSD_LOG_ERROR("Failed to add subtype '%s' to service '%s': %s", subtype.c_str(), service.serviceName.c_str(), avahi_strerror(ret));
+                    }
+                }
+            }
+            int ret = avahi_entry_group_commit(group);
+            if (ret < 0) {
+                KNOTDNSSD_LOG_ERROR("Failed to commit entry group: %s", avahi_strerror(ret));
+            }
+        }
+    }
 
-fail:
-    if (context && context->group) {
-        avahi_entry_group_free(context->group);
+    void updateTxt(size_t index, const TxtRecord& record) {
+        if (index >= request.services.size()) {
+            KNOTDNSSD_LOG_WARNING("TXT update for unknown service index %zu", index);
+            return;
+        }
+        ServiceRegistration& service = request.services[index];
+        service.txt = record;
+        avahi_string_list_free(txt[index]);
+        txt[index] = to_avahi_txt(record);
+        // a group that is not committed yet picks the new record up in start()
+        if (group && !avahi_entry_group_is_empty(group)) {
+            int ret = avahi_entry_group_update_service_txt_strlst(group, to_avahi_interface(request.scope), to_avahi_protocol(request.scope), static_cast<AvahiPublishFlags>(0), service.serviceName.c_str(), service.regType.c_str(), detail::toCString(service.domain), txt[index]);
+            if (ret < 0) {
+                KNOTDNSSD_LOG_ERROR("Failed to update TXT record of '%s': %s", service.serviceName.c_str(), avahi_strerror(ret));
+            }
+        }
+    }
+
+    void stop() override {
+        if (group) {
+            avahi_entry_group_free(group);
+            group = nullptr;
+        }
     }
-    delete context;
-    if (client) {
-        avahi_client_free(client);
+
+    void onClientState(AvahiClientState) override {
+
+        /* Let's drop our registered services. When the server is back
+         * in AVAHI_SERVER_RUNNING state we will register them
+         * again with the new host name. */
+
+        /* The server records are now being established. This
+         * might be caused by a host name change. We need to wait
+         * for our own records to register until the host name is
+         * properly esatblished. */
+
+        if (group) {
+            avahi_entry_group_reset(group);
+        }
     }
-    if (poll) {
-        avahi_simple_poll_free(poll);
+};
+
+void detail::startRegister(const OperationPtr& op, RegisterRequest request) {
+    auto* context = new RegisterContext;
+    context->op = op;
+    for (const ServiceRegistration& service : request.services) {
+        context->txt.push_back(to_avahi_txt(service.txt));
     }
-    avahi_free(name);
+    context->request = std::move(request);
+    // only called while the operation is active, i.e. before the teardown frees the context
+    context->request.registration->updateTxt = [context](size_t index, const TxtRecord& txt) {
+        context->updateTxt(index, txt);
+    };
+    attach_operation(context);
 }
 
-struct BrowseContext {
-    AvahiSimplePoll* poll;
-    AvahiClient* client;
-    const BrowseCallback& callback;
+struct BrowseContext : Attachment {
+    detail::OperationPtr op;
+    AvahiServiceBrowser* browser = nullptr;
+    detail::BrowseRequest request;
+    /// avahi reports no "more coming" flag, so the initial burst is flagged until ALL_FOR_NOW
+    bool allForNow = false;
+
+    void start(AvahiClient* client) override;
+
+    /// subtype browsers report the subtype name, callers resolve with the base type
+    const char* type(const char* reported) const {
+        return request.subtype.empty() ? reported : request.regType.c_str();
+    }
+
+    void stop() override {
+        if (browser) {
+            avahi_service_browser_free(browser);
+            browser = nullptr;
+            allForNow = false;
+            if (op->active() && request.reset) {
+                request.reset();
+            }
+        }
+    }
 };
 
 void browse_callback(
@@ -164,73 +473,86 @@ void browse_callback(
         void *userdata
 ) {
     auto *context = static_cast<BrowseContext *>(userdata);
+    if (!context->op->active()) {
+        return;
+    }
+    uint32_t interfaceIndex = interface > 0 ? static_cast<uint32_t>(interface) : 0;
 
     switch (event) {
         case AVAHI_BROWSER_FAILURE:
-            //fprintf(stderr, "(Browser) %s\n", avahi_strerror(avahi_client_errno(avahi_service_browser_get_client(browser))));
-            avahi_simple_poll_quit(context->poll);
+            KNOTDNSSD_LOG_ERROR("(Browser) %s", avahi_strerror(avahi_client_errno(avahi_service_browser_get_client(browser))));
+            context->op->complete(Status::Failed);
             return;
 
         case AVAHI_BROWSER_NEW:
-            //fprintf(stderr, "(Browser) NEW: service '%s' of type '%s' in domain '%s'\n", name, type, domain);
-            context->callback({name, type, domain});
+            KNOTDNSSD_LOG_DEBUG("(Browser) NEW: service '%s' of type '%s' in domain '%s'", name, type, domain);
+            context->request.callback({name, context->type(type), domain, ServiceAdded, !context->allForNow, interfaceIndex});
             break;
 
         case AVAHI_BROWSER_REMOVE:
-            //fprintf(stderr, "(Browser) REMOVE: service '%s' of type '%s' in domain '%s'\n", name, type, domain);
+            KNOTDNSSD_LOG_DEBUG("(Browser) REMOVE: service '%s' of type '%s' in domain '%s'", name, type, domain);
+            context->request.callback({name, context->type(type), domain, ServiceRemoved, !context->allForNow, interfaceIndex});
             break;
 
         case AVAHI_BROWSER_ALL_FOR_NOW:
+            KNOTDNSSD_LOG_DEBUG("(Browser) ALL_FOR_NOW");
+            context->allForNow = true;
+            if (context->request.allForNow) {
+                context->request.allForNow();
+            }
+            break;
+
         case AVAHI_BROWSER_CACHE_EXHAUSTED:
-            //fprintf(stderr, "(Browser) %s\n", event == AVAHI_BROWSER_CACHE_EXHAUSTED ? "CACHE_EXHAUSTED" : "ALL_FOR_NOW");
             break;
     }
 }
 
-void browseServices(const char *regType, const char *domain, const BrowseCallback& callback, const Fn<bool()>& isStopped) {
-    AvahiClient* client = nullptr;
-    BrowseContext* context = nullptr;
-    AvahiServiceBrowser* browser = nullptr;
-    int error;
-
-    AvahiSimplePoll* poll = avahi_simple_poll_new();
-    if (!poll) {
-        std::cerr << "Failed to create simple poll object." << std::endl;
-        goto fail;
+void BrowseContext::start(AvahiClient* client) {
+    if (browser) {
+        return;
     }
-
-    client = avahi_client_new(avahi_simple_poll_get(poll), static_cast<AvahiClientFlags>(0), nullptr, nullptr, &error);
-    if (!client) {
-        std::cerr << "Failed to create client: " << avahi_strerror(error) << std::endl;
-        goto fail;
+    std::string type = request.subtype.empty() ? request.regType : detail::subtypeName(request.subtype, request.regType);
+    browser = avahi_service_browser_new(client, to_avahi_interface(request.scope), to_avahi_protocol(request.scope), type.c_str(), detail::toCString(request.domain), static_cast<AvahiLookupFlags>(0), browse_callback, this);
+    if (!browser) {
+        KNOTDNSSD_LOG_ERROR("Failed to create service browser: %s", avahi_strerror(avahi_client_errno(client)));
+        op->complete(Status::Failed);
     }
+}
 
-    context = new BrowseContext{poll, client, callback};
+void detail::startBrowse(const OperationPtr& op, BrowseRequest request) {
+    auto* context = new BrowseContext;
+    context->op = op;
+    context->request = std::move(request);
+    attach_operation(context);
+}
 
-    browser = avahi_service_browser_new(client, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, regType, domain, static_cast<AvahiLookupFlags>(0), browse_callback, context);
-    if (!browser) {
-        std::cerr << "Failed to create service browser: " << std::string(avahi_strerror(avahi_client_errno(client))) << std::endl;
-        goto fail;
+static std::optional<IPAddress> to_ip_address(const AvahiAddress* address, AvahiIfIndex interface) {
+    uint32_t index = interface > 0 ? static_cast<uint32_t>(interface) : 0;
+    if (address->proto == AVAHI_PROTO_INET6) {
+        return IPAddress::fromBytes(address->data.ipv6.address, sizeof(address->data.ipv6.address), index);
     }
+    // ipv4.address is already in network byte order
+    return IPAddress::fromBytes(&address->data.ipv4.address, sizeof(address->data.ipv4.address), index);
+}
 
-    loop(poll, isStopped);
+struct ResolveContext : Attachment {
+    detail::OperationPtr op;
+    AvahiServiceResolver* resolver = nullptr;
+    detail::ResolveRequest request;
 
-fail:
-    if (browser) {
-        avahi_service_browser_free(browser);
-    }
-    delete context;
-    if (client) {
-        avahi_client_free(client);
-    }
-    if (poll) {
-        avahi_simple_poll_free(poll);
+    void start(AvahiClient* client) override;
+
+    void stop() override {
+        if (resolver) {
+            avahi_service_resolver_free(resolver);
+            resolver = nullptr;
+        }
     }
-}
+};
 
 void resolve_callback(
-    AvahiServiceResolver *resolver,
-    AVAHI_GCC_UNUSED AvahiIfIndex interface,
+    AVAHI_GCC_UNUSED AvahiServiceResolver *resolver,
+    AvahiIfIndex interface,
     AVAHI_GCC_UNUSED AvahiProtocol protocol,
     AvahiResolverEvent event,
     const char* name,
@@ -240,55 +562,202 @@ void resolve_callback(
     const AvahiAddress *address,
     uint16_t port,
     AvahiStringList* txt,
-    AvahiLookupResultFlags flags,
-    AVAHI_GCC_UNUSED void* userdata
+    AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+    void* userdata
 ) {
-    assert(resolver);
+    auto* context = static_cast<ResolveContext*>(userdata);
+    if (!context->op->active()) {
+        return;
+    }
+    // one-shot: the resolver is released by the operation teardown. A watching
+    // one stays open, Avahi reports FOUND again whenever the instance changes.
+    if (!context->request.watch || event != AVAHI_RESOLVER_FOUND) {
+        context->op->complete(event == AVAHI_RESOLVER_FOUND ? Status::Ok : Status::Failed);
+    }
 
     switch (event) {
         case AVAHI_RESOLVER_FAILURE:
-            fprintf(stderr, "(Resolver) Failed to resolve service '%s' of type '%s' in domain '%s': %s\n", name, type, domain, avahi_strerror(avahi_client_errno(avahi_service_resolver_get_client(resolver))));
+            KNOTDNSSD_LOG_ERROR("(Resolver) Failed to resolve service '%s' of type '%s' in domain '%s': %s", name, type, domain, avahi_strerror(avahi_client_errno(avahi_service_resolver_get_client(resolver))));
+            context->request.callback(std::nullopt, 0);
             break;
 
         case AVAHI_RESOLVER_FOUND: {
-            char a[AVAHI_ADDRESS_STR_MAX], *t;
-
-            fprintf(stderr, "Service '%s' of type '%s' in domain '%s':\n", name, type, domain);
-
-            avahi_address_snprint(a, sizeof(a), address);
-            t = avahi_string_list_to_string(txt);
-            fprintf(stderr,
-                    "\t%s:%u (%s)\n"
-                    "\tTXT=%s\n"
-                    "\tcookie is %u\n"
-                    "\tis_local: %i\n"
-                    "\tour_own: %i\n"
-                    "\twide_area: %i\n"
-                    "\tmulticast: %i\n"
-                    "\tcached: %i\n",
-                    host_name, port, a,
-                    t,
-                    avahi_string_list_get_service_cookie(txt),
-                    !!(flags & AVAHI_LOOKUP_RESULT_LOCAL),
-                    !!(flags & AVAHI_LOOKUP_RESULT_OUR_OWN),
-                    !!(flags & AVAHI_LOOKUP_RESULT_WIDE_AREA),
-                    !!(flags & AVAHI_LOOKUP_RESULT_MULTICAST),
-                    !!(flags & AVAHI_LOOKUP_RESULT_CACHED));
-
-            avahi_free(t);
+            TxtView wire = serialize_avahi_txt(txt);
+            if (detail::accepts(context->request.filter, wire.data(), wire.size())) {
+                context->request.callback({{host_name, to_ip_address(address, interface), port, TxtRecord::fromWire(wire.data(), wire.size())}}, detail::kHostRecordTtl);
+            }
+            break;
+        }
+    }
+}
+
+void ResolveContext::start(AvahiClient* client) {
+    if (resolver) {
+        return;
+    }
+    AvahiProtocol protocol = to_avahi_protocol(request.scope);
+    resolver = avahi_service_resolver_new(client, to_avahi_interface(request.scope), protocol, request.serviceName.c_str(), request.regType.c_str(), detail::toCString(request.domain), protocol, static_cast<AvahiLookupFlags>(0), resolve_callback, this);
+    if (!resolver) {
+        KNOTDNSSD_LOG_ERROR("Failed to create service resolver: %s", avahi_strerror(avahi_client_errno(client)));
+        op->complete(Status::Failed);
+        request.callback(std::nullopt, 0);
+    }
+}
+
+void detail::startResolve(const OperationPtr& op, ResolveRequest request) {
+    auto* context = new ResolveContext;
+    context->op = op;
+    context->request = std::move(request);
+    attach_operation(context);
+}
+
+struct QueryContext : Attachment {
+    detail::OperationPtr op;
+    AvahiHostNameResolver* resolver = nullptr;
+    detail::QueryRequest request;
+
+    void start(AvahiClient* client) override;
+
+    void stop() override {
+        if (resolver) {
+            avahi_host_name_resolver_free(resolver);
+            resolver = nullptr;
         }
     }
+};
+
+void host_name_resolve_callback(
+    AvahiHostNameResolver* resolver,
+    AvahiIfIndex interface,
+    AVAHI_GCC_UNUSED AvahiProtocol protocol,
+    AvahiResolverEvent event,
+    const char* name,
+    const AvahiAddress* address,
+    AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+    void* userdata
+) {
+    auto* context = static_cast<QueryContext*>(userdata);
+    if (!context->op->active()) {
+        return;
+    }
+    context->op->complete(event == AVAHI_RESOLVER_FOUND ? Status::Ok : Status::Failed);
+
+    switch (event) {
+        case AVAHI_RESOLVER_FAILURE:
+            KNOTDNSSD_LOG_ERROR("(Resolver) Failed to resolve host name '%s': %s", name, avahi_strerror(avahi_client_errno(avahi_host_name_resolver_get_client(resolver))));
+            context->request.callback(std::nullopt, 0);
+            break;
 
-    avahi_service_resolver_free(resolver);
+        case AVAHI_RESOLVER_FOUND:
+            context->request.callback(to_ip_address(address, interface), detail::kHostRecordTtl);
+            break;
+    }
+}
+
+void QueryContext::start(AvahiClient* client) {
+    if (resolver) {
+        return;
+    }
+    AvahiProtocol aprotocol = request.family == IPv6 ? AVAHI_PROTO_INET6 : AVAHI_PROTO_INET;
+    resolver = avahi_host_name_resolver_new(client, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, request.hostName.c_str(), aprotocol, static_cast<AvahiLookupFlags>(0), host_name_resolve_callback, this);
+    if (!resolver) {
+        KNOTDNSSD_LOG_ERROR("Failed to create host name resolver: %s", avahi_strerror(avahi_client_errno(client)));
+        op->complete(Status::Failed);
+        request.callback(std::nullopt, 0);
+    }
 }
 
-void resolveService(const char* serviceName, const char* regType, const char* domain, const ResolveCallback& callback) {
+void detail::startQuery(const OperationPtr& op, QueryRequest request) {
+    auto* context = new QueryContext;
+    context->op = op;
+    context->request = std::move(request);
+    attach_operation(context);
+}
+
+/// One host name resolver per family, running side by side.
+struct AddressContext : Attachment {
+    detail::OperationPtr op;
+    detail::AddressRequest request;
+    /// indexed by IPFamily
+    AvahiHostNameResolver* resolvers[2] = {nullptr, nullptr};
+    bool done[2] = {false, false};
+
+    void start(AvahiClient* client) override;
+
+    void stop() override {
+        for (AvahiHostNameResolver*& resolver : resolvers) {
+            if (resolver) {
+                avahi_host_name_resolver_free(resolver);
+                resolver = nullptr;
+            }
+        }
+    }
+
+    void finish(IPFamily family) {
+        done[family] = true;
+        if (resolvers[family]) {
+            avahi_host_name_resolver_free(resolvers[family]);
+            resolvers[family] = nullptr;
+        }
+        request.familyDone(family);
+    }
+};
+
+void address_resolve_callback(
+    AvahiHostNameResolver* resolver,
+    AvahiIfIndex interface,
+    AVAHI_GCC_UNUSED AvahiProtocol protocol,
+    AvahiResolverEvent event,
+    const char* name,
+    const AvahiAddress* address,
+    AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+    void* userdata
+) {
+    auto* context = static_cast<AddressContext*>(userdata);
+    if (!context->op->active()) {
+        return;
+    }
+    IPFamily family = resolver == context->resolvers[IPv6] ? IPv6 : IPv4;
+
+    switch (event) {
+        case AVAHI_RESOLVER_FAILURE:
+            // a host without addresses of this family times out here as well
+            KNOTDNSSD_LOG_ERROR("(Resolver) Failed to resolve host name '%s': %s", name, avahi_strerror(avahi_client_errno(avahi_host_name_resolver_get_client(resolver))));
+            break;
+
+        case AVAHI_RESOLVER_FOUND:
+            if (auto ip = to_ip_address(address, interface)) {
+                context->request.onAddress(*ip);
+            }
+            break;
+    }
+    if (context->op->active()) {
+        context->finish(family);
+    }
 }
 
-void queryIPv6Address(const char* hostName, const QueryCallback& callback) {
+void AddressContext::start(AvahiClient* client) {
+    for (IPFamily family : {IPv4, IPv6}) {
+        if (done[family] || resolvers[family]) {
+            continue;
+        }
+        AvahiProtocol aprotocol = family == IPv6 ? AVAHI_PROTO_INET6 : AVAHI_PROTO_INET;
+        resolvers[family] = avahi_host_name_resolver_new(client, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, request.hostName.c_str(), aprotocol, static_cast<AvahiLookupFlags>(0), address_resolve_callback, this);
+        if (!resolvers[family]) {
+            KNOTDNSSD_LOG_ERROR("Failed to create host name resolver: %s", avahi_strerror(avahi_client_errno(client)));
+            finish(family);
+            if (!op->active()) {
+                return;
+            }
+        }
+    }
 }
 
-void queryIPv4Address(const char* hostName, const QueryCallback& callback) {
+void detail::startAddresses(const OperationPtr& op, AddressRequest request) {
+    auto* context = new AddressContext;
+    context->op = op;
+    context->request = std::move(request);
+    attach_operation(context);
 }
 
 }
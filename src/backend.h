@@ -0,0 +1,139 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_BACKEND_H
+#define KNOTDNSSD_BACKEND_H
+
+#include "knot/dnssd.h"
+#include "operation.h"
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace knot::detail {
+
+/// Event loop of the shard key hashes to, the first one for an empty key.
+/// Each loop has its own daemon connection, see setShardCount().
+Reactor& reactor(std::string_view shardKey = {});
+
+/// Link between a Registration handle and the backend; reactor thread only.
+class RegistrationState {
+public:
+    /// installed by the backend, replaces the TXT record of services[index]
+    Fn<void(size_t index, const TxtRecord& txt)> updateTxt;
+};
+
+struct RegisterRequest {
+    std::vector<ServiceRegistration> services;
+    std::shared_ptr<RegistrationState> registration;
+    NetworkScope scope;
+};
+
+struct BrowseRequest {
+    std::string regType;
+    std::string domain;
+    BrowseCallback callback;
+    /// optional; the daemon has delivered everything it currently knows
+    Fn<void()> allForNow;
+    /// optional; previously reported instances are gone without remove events
+    Fn<void()> reset;
+    /// optional; only instances registered with this subtype are reported
+    std::string subtype;
+    NetworkScope scope;
+};
+
+/// "_printer._sub._http._tcp", the name subtype instances are listed under,
+/// see RFC 6763, section 7.1
+inline std::string subtypeName(const std::string& subtype, const std::string& regType) {
+    return subtype + "._sub." + regType;
+}
+
+/// Records that carry a host name (SRV, A, AAAA) live 120 s in mDNS, see
+/// RFC 6762, section 10. Used when the daemon API does not report a TTL.
+constexpr uint32_t kHostRecordTtl = 120;
+
+/// Backend replies carry the record TTL in seconds so results can be cached.
+using ResolveReplyHandler = Fn<void(const std::optional<ResolveReply>&, uint32_t ttl)>;
+using QueryReplyHandler = Fn<void(const std::optional<IPAddress>&, uint32_t ttl)>;
+
+struct ResolveRequest {
+    std::string serviceName;
+    std::string regType;
+    std::string domain;
+    ResolveReplyHandler callback;
+    /// optional; checked before the reply is built, see accepts()
+    TxtPredicate filter;
+    NetworkScope scope;
+    /// the backend keeps the lookup open and replies again whenever the
+    /// instance changes, the operation only completes on an error
+    bool watch = false;
+};
+
+/// Whether a reply with this TXT record is wanted. The backend completes the
+/// operation with Status::Ok instead of building a reply it rejects.
+inline bool accepts(const TxtPredicate& filter, const void* txt, size_t size) {
+    return !filter || filter(TxtView(txt, size));
+}
+
+struct QueryRequest {
+    std::string hostName;
+    IPFamily family = IPv4;
+    QueryReplyHandler callback;
+};
+
+/// Both families are queried at once. The backend reports every address and
+/// calls familyDone once per family, after its first answers or when it has
+/// none; the operation is completed by the caller.
+struct AddressRequest {
+    std::string hostName;
+    AddressCallback onAddress;
+    Fn<void(IPFamily family)> familyDone;
+};
+
+/// see knot::setDefaultTimeout, zero for no deadline
+std::chrono::milliseconds defaultTimeout();
+
+/// Creates an operation and arms its options. Nothing may be posted for the
+/// operation before, so its completion hook can never be missed. One-shot
+/// operations fall back to the library default deadline; onTimeout reports
+/// the timeout to the caller's callback.
+OperationPtr create(const OperationOptions& options, std::string_view shardKey, bool oneShot = false, Fn<void()> onTimeout = nullptr);
+
+/// Starts the operation on the reactor thread.
+template<typename Request>
+Operation start(void (*starter)(const OperationPtr&, Request), Request request, OperationPtr op) {
+    op->reactor().post([op, starter, request = std::move(request)]() mutable {
+        if (op->active()) {
+            starter(op, std::move(request));
+        }
+    });
+    return Operation(op);
+}
+
+inline std::string toString(const char* value) {
+    return value ? std::string(value) : std::string();
+}
+
+/// empty strings stand for "let the daemon choose", which both APIs spell as NULL
+inline const char* toCString(const std::string& value) {
+    return value.empty() ? nullptr : value.c_str();
+}
+
+// Implemented by the selected backend. Called on the reactor thread with an
+// active operation; the backend installs a teardown on it and calls
+// op->cancel() once the operation can produce no more events.
+void startRegister(const OperationPtr& op, RegisterRequest request);
+void startBrowse(const OperationPtr& op, BrowseRequest request);
+void startResolve(const OperationPtr& op, ResolveRequest request);
+void startQuery(const OperationPtr& op, QueryRequest request);
+void startAddresses(const OperationPtr& op, AddressRequest request);
+
+}
+
+#endif //KNOTDNSSD_BACKEND_H
@@ -0,0 +1,176 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#include "knot/dnssd.h"
+#include "backend.h"
+#include "executor.h"
+#include "metrics.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace knot {
+
+namespace detail {
+
+/// Turns the browse event stream into batches of instance set changes;
+/// reactor thread only.
+///
+/// Every batch is the difference between the instances reported at the last
+/// delivery and the ones seen now, so repeated sightings on several
+/// interfaces and add/remove flaps within a batch cancel out.
+class BatchState {
+public:
+    BatchState(OperationPtr op, BrowseBatchCallback callback, const BatchOptions& options)
+            : op_(std::move(op)), callback_(std::move(callback)), options_(options) {}
+
+    void apply(const BrowseReply& reply) {
+        std::string key = reply.serviceName;
+        key.push_back('\0');
+        key.append(reply.regType);
+        key.push_back('\0');
+        key.append(reply.replyDomain);
+
+        Tracked& tracked = instances_[key];
+        if (reply.event == ServiceAdded) {
+            if (tracked.sightings++ == 0) {
+                tracked.instance = ServiceInstance{reply.serviceName, reply.regType, reply.replyDomain};
+            }
+        } else if (tracked.sightings > 0) {
+            --tracked.sightings;
+        }
+        mark(key, tracked);
+        idle_ = !reply.moreComing;
+        if (options_.maxEvents > 0 && changed_.size() >= options_.maxEvents) {
+            flush();
+        } else {
+            maybeFlush();
+        }
+    }
+
+    void allForNow() {
+        settled_ = true;
+        idle_ = true;
+        maybeFlush();
+    }
+
+    /// the daemon lost every instance without remove events
+    void reset() {
+        for (auto& [key, tracked] : instances_) {
+            tracked.sightings = 0;
+            mark(key, tracked);
+        }
+        settled_ = false;
+        idle_ = false;
+    }
+
+    /// called by the operation teardown
+    void stop() {
+        if (timer_) {
+            op_->reactor().removeTimer(timer_);
+            timer_ = 0;
+        }
+    }
+
+private:
+    struct Tracked {
+        ServiceInstance instance;
+        unsigned sightings = 0;
+        /// visible as of the last delivered batch
+        bool reported = false;
+        bool changed = false;
+    };
+
+    void mark(const std::string& key, Tracked& tracked) {
+        if (tracked.changed) {
+            return;
+        }
+        tracked.changed = true;
+        changed_.push_back(key);
+        if (changed_.size() == 1) {
+            startWindow();
+        }
+    }
+
+    void startWindow() {
+        windowOpen_ = options_.window.count() > 0;
+        if (windowOpen_) {
+            timer_ = op_->reactor().addTimer(Reactor::Clock::now() + options_.window, [this] {
+                timer_ = 0;
+                windowOpen_ = false;
+                maybeFlush();
+            });
+        }
+    }
+
+    void maybeFlush() {
+        if (settled_ && idle_ && !windowOpen_ && !changed_.empty()) {
+            flush();
+        }
+    }
+
+    void flush() {
+        stop();
+        windowOpen_ = false;
+        std::vector<ServiceEvent> events;
+        for (const std::string& key : changed_) {
+            auto it = instances_.find(key);
+            Tracked& tracked = it->second;
+            tracked.changed = false;
+            bool visible = tracked.sightings > 0;
+            if (visible != tracked.reported) {
+                tracked.reported = visible;
+                events.push_back({visible ? ServiceAdded : ServiceRemoved, tracked.instance});
+            }
+            if (!visible) {
+                instances_.erase(it);
+            }
+        }
+        changed_.clear();
+        if (!events.empty() && op_->active()) {
+            callback_(events);
+        }
+    }
+
+    OperationPtr op_;
+    BrowseBatchCallback callback_;
+    BatchOptions options_;
+    std::unordered_map<std::string, Tracked> instances_;
+    /// keys in the order they first changed within the batch
+    std::vector<std::string> changed_;
+    Reactor::Id timer_ = 0;
+    bool windowOpen_ = false;
+    /// the daemon has reported what it knew when the browse started
+    bool settled_ = false;
+    /// the last event had nothing queued behind it
+    bool idle_ = false;
+};
+
+}
+
+Operation browseServicesBatchedAsync(const char* regType, const char* domain, BrowseBatchCallback callback, const BatchOptions& batch, const OperationOptions& options) {
+    detail::OperationPtr op = detail::create(options, detail::toString(regType));
+    auto state = std::make_shared<detail::BatchState>(op, detail::dispatched(op, options.executor, detail::timed(std::move(callback))), batch);
+    detail::BrowseRequest request;
+    request.regType = detail::toString(regType);
+    request.domain = detail::toString(domain);
+    request.callback = detail::counted([state](const BrowseReply& reply) { state->apply(reply); });
+    request.allForNow = [state] { state->allForNow(); };
+    request.reset = [state] { state->reset(); };
+    op->reactor().post([op, state, request = std::move(request)]() mutable {
+        if (!op->active()) {
+            return;
+        }
+        // the state refers back to the operation, the finish hook breaks that cycle
+        op->onFinish([state] { state->stop(); });
+        detail::startBrowse(op, std::move(request));
+    });
+    return Operation(op);
+}
+
+}
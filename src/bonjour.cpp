@@ -8,17 +8,27 @@
 #if defined(USE_BONJOUR)
 
 #include "knot/dnssd.h"
+#include "backend.h"
+#include "log.h"
+#include "metrics.h"
 #include <dns_sd.h>
+#include <algorithm> // remove
 #include <functional> // function
+#include <memory> // unique_ptr
+#include <mutex> // mutex
 #include <string> // string
-#include "util.h"
+#include <unordered_map> // unordered_map
+#include <vector> // vector
 
-#if !defined(_WIN32)
-#include <sys/select.h>
-#include <unistd.h>
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
 #include <netinet/in.h>
 #endif
 
+using knot::detail::Reactor;
+
 const char* knotdnssd_bonjour_error_to_str(DNSServiceErrorType error) {
     switch (error) {
         default: return "Unrecognized error code";
@@ -59,148 +69,329 @@ const char* knotdnssd_bonjour_error_to_str(DNSServiceErrorType error) {
     }
 }
 
-void knotdnssd_bonjour_loop(DNSServiceRef sdRef, const std::function<bool()>& isStopped) {
-    int fd = DNSServiceRefSockFD(sdRef);
+/// Common part of every operation: the daemon reference and, unless it
+/// runs over the session connection, its own reactor watch.
+struct BonjourContext {
+    knot::detail::OperationPtr op;
+    DNSServiceRef sdRef = nullptr;
+    /// sdRef is subordinate to the session connection
+    bool shared = false;
+    Reactor::Id watch = 0;
+
+    virtual ~BonjourContext() = default;
+};
+
+/// DNSServiceProcessResult handles a single reply. Going back through the
+/// poll loop for each one costs a full iteration per reply, so everything
+/// already queued on the socket is handled at once. Operations finish on a
+/// posted task, so ref stays valid while the callbacks run.
+DNSServiceErrorType knotdnssd_bonjour_drain(DNSServiceRef ref, knot::detail::NativeSocket fd) {
+    DNSServiceErrorType err = kDNSServiceErr_NoError;
+    Reactor::drain(fd, [ref, &err] {
+        err = DNSServiceProcessResult(ref);
+        return err == kDNSServiceErr_NoError;
+    });
+    return err;
+}
+
+/// Hands the results of ref to the daemon library whenever its socket is readable.
+Reactor::Id knotdnssd_bonjour_watch(BonjourContext* context, DNSServiceRef ref) {
+    auto fd = DNSServiceRefSockFD(ref);
     if (fd == -1) {
-        fprintf(stderr, "Couldn't ref sock fd\n");
-        return;
+        KNOTDNSSD_LOG_ERROR("Couldn't ref sock fd");
+        return 0;
     }
+    auto sock = static_cast<knot::detail::NativeSocket>(fd);
+    return context->op->reactor().addWatch(sock, Reactor::Readable, [context, ref, sock](unsigned) {
+        DNSServiceErrorType err = knotdnssd_bonjour_drain(ref, sock);
+        if (err != kDNSServiceErr_NoError) {
+            KNOTDNSSD_LOG_ERROR("DNSServiceProcessResult failed with error: %s", knotdnssd_bonjour_error_to_str(err));
+            context->op->complete(knot::Status::Failed);
+        }
+    });
+}
+
+/// One mDNSResponder connection per reactor. Every operation is a subordinate
+/// reference on it (kDNSServiceFlagsShareConnection), so all of them share a
+/// single socket drained by one DNSServiceProcessResult watch.
+///
+/// The connection is opened on first use. If it breaks, every operation on
+/// it is finished and the next operation opens a new one. The Avahi
+/// compatibility layer cannot share connections; there every operation keeps
+/// a connection of its own.
+class BonjourSession {
+public:
+    explicit BonjourSession(Reactor& reactor) : reactor_(reactor) {}
+
+    /// The reference a new operation is created from, with the flags it needs.
+    /// A null reference means the operation gets a connection of its own.
+    DNSServiceRef prepare(DNSServiceFlags& flags) {
 #if defined(AVAHI_BONJOUR_COMPAT)
-    while (!isStopped()) {
-        fd_set readFds;
-        FD_ZERO(&readFds);
-        FD_SET(fd, &readFds);
-
-        struct timeval timeout{};
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-
-        int nfds = select(fd + 1, &readFds, nullptr, nullptr, &timeout);
-        if (nfds > 0) {
-            if (FD_ISSET(fd, &readFds)) {
-                DNSServiceErrorType err = DNSServiceProcessResult(sdRef);
-                if (err != kDNSServiceErr_NoError) {
-                    fprintf(stderr, "DNSServiceProcessResult failed with error: %s\n", knotdnssd_bonjour_error_to_str(err));
-                    break;
-                }
-            }
-        } else if (nfds < 0) {
-            fprintf(stderr, "Error occurred in select\n");
-            break;
+        (void) flags;
+        return nullptr;
+#else
+        if (!connection_ && !connect()) {
+            return nullptr;
         }
+        flags |= kDNSServiceFlagsShareConnection;
+        return connection_;
+#endif
+    }
 
-        sleep(1);
+    void attach(BonjourContext* context) {
+        contexts_.push_back(context);
     }
-#else
-    while (!isStopped()) {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        int nfds = select(fd + 1, &fds, nullptr, nullptr, nullptr);
-        if (nfds > 0) {
-            DNSServiceErrorType err = DNSServiceProcessResult(sdRef);
+
+    void detach(BonjourContext* context) {
+        contexts_.erase(std::remove(contexts_.begin(), contexts_.end(), context), contexts_.end());
+    }
+
+private:
+    bool connect() {
+        DNSServiceErrorType err = DNSServiceCreateConnection(&connection_);
+        if (err != kDNSServiceErr_NoError) {
+            KNOTDNSSD_LOG_ERROR("DNSServiceCreateConnection failed with error: %s", knotdnssd_bonjour_error_to_str(err));
+            connection_ = nullptr;
+            return false;
+        }
+        auto fd = DNSServiceRefSockFD(connection_);
+        if (fd == -1) {
+            KNOTDNSSD_LOG_ERROR("Couldn't ref sock fd");
+            DNSServiceRefDeallocate(connection_);
+            connection_ = nullptr;
+            return false;
+        }
+        if (connectedBefore_) {
+            knot::detail::count(&knot::detail::MetricsRegistry::reconnects);
+        }
+        connectedBefore_ = true;
+        auto sock = static_cast<knot::detail::NativeSocket>(fd);
+        watch_ = reactor_.addWatch(sock, Reactor::Readable, [this, sock](unsigned) {
+            DNSServiceErrorType err = knotdnssd_bonjour_drain(connection_, sock);
             if (err != kDNSServiceErr_NoError) {
-                fprintf(stderr, "DNSServiceProcessResult failed with error: %s\n", knotdnssd_bonjour_error_to_str(err));
-                break;
+                KNOTDNSSD_LOG_ERROR("DNSServiceProcessResult failed with error: %s", knotdnssd_bonjour_error_to_str(err));
+                disconnect();
             }
-        } else {
-            break;
+        });
+        return true;
+    }
+
+    void disconnect() {
+        reactor_.removeWatch(watch_);
+        watch_ = 0;
+        // subordinate references must be released before the connection they live on
+        for (BonjourContext* context : std::vector<BonjourContext*>(contexts_)) {
+            context->op->report(knot::Status::Failed);
+            context->op->finish();
         }
+        DNSServiceRefDeallocate(connection_);
+        connection_ = nullptr;
     }
-#endif
+
+    Reactor& reactor_;
+    DNSServiceRef connection_ = nullptr;
+    Reactor::Id watch_ = 0;
+    std::vector<BonjourContext*> contexts_;
+    /// a broken connection was open before, so opening one again is a reconnect
+    bool connectedBefore_ = false;
+};
+
+/// reactor thread only; the session lives as long as the process
+BonjourSession& knotdnssd_bonjour_session(Reactor& reactor) {
+    static std::mutex mutex;
+    // never destroyed, the reactor thread may still run during static destruction
+    static auto* sessions = new std::unordered_map<Reactor*, std::unique_ptr<BonjourSession>>();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& session = (*sessions)[&reactor];
+    if (!session) {
+        session = std::make_unique<BonjourSession>(reactor);
+    }
+    return *session;
 }
 
-void knotdnssd_bonjour_serialize_txt_rec(TXTRecordRef& txtRecord, const std::unordered_map<std::string, std::string>& txt) {
-    for (const auto& [key, value] : txt) {
-        TXTRecordSetValue(&txtRecord, key.c_str(), static_cast<uint8_t>(value.length()), value.c_str());
+/// Points context->sdRef at the session connection and returns the flags the
+/// daemon call needs; the call then replaces sdRef with the subordinate reference.
+DNSServiceFlags knotdnssd_bonjour_share(BonjourContext* context) {
+    DNSServiceFlags flags = 0;
+    context->sdRef = knotdnssd_bonjour_session(context->op->reactor()).prepare(flags);
+    context->shared = context->sdRef != nullptr;
+    return flags;
+}
+
+/// Takes ownership of the context: it is released by the operation teardown.
+void knotdnssd_bonjour_attach(BonjourContext* context) {
+    BonjourSession& session = knotdnssd_bonjour_session(context->op->reactor());
+    context->op->setTeardown([context, &session] {
+        if (context->watch) {
+            context->op->reactor().removeWatch(context->watch);
+        }
+        if (context->shared) {
+            session.detach(context);
+        }
+        DNSServiceRef sdRef = context->sdRef;
+        // subclasses release references that depend on sdRef first
+        delete context;
+        if (sdRef) {
+            DNSServiceRefDeallocate(sdRef);
+        }
+    });
+    if (!context->sdRef) {
+        context->op->report(knot::Status::Failed);
+        context->op->finish();
+        return;
     }
+    if (context->shared) {
+        session.attach(context);
+        return;
+    }
+    context->watch = knotdnssd_bonjour_watch(context, context->sdRef);
+    if (!context->watch) {
+        context->op->report(knot::Status::Failed);
+        context->op->finish();
+    }
+}
+
+/// "_http._tcp,_printer,_scanner": the daemon API takes subtypes as a comma separated list
+std::string knotdnssd_bonjour_regtype(const std::string& regType, const std::vector<std::string>& subtypes) {
+    std::string result = regType;
+    for (const std::string& subtype : subtypes) {
+        result.push_back(',');
+        result.append(subtype);
+    }
+    return result;
 }
 
 namespace knot {
 
-void registerService(const char *serviceName, const char *regType, const char *domain, uint16_t port,
-                     const std::unordered_map<std::string, std::string>& txt, const std::function<bool()>& isStopped) {
-    DNSServiceRef sdRef;
-    TXTRecordRef txtRecord;
-    TXTRecordCreate(&txtRecord, 0, nullptr);
-    knotdnssd_bonjour_serialize_txt_rec(txtRecord, txt);
-    DNSServiceErrorType err = DNSServiceRegister(&sdRef, 0, kDNSServiceInterfaceIndexAny,
-                                                 serviceName, regType, domain,
-                                                 nullptr,
-                                                 htons(port),
-                                                 TXTRecordGetLength(&txtRecord),TXTRecordGetBytesPtr(&txtRecord),
-                                                 nullptr, nullptr);
-    if (err != kDNSServiceErr_NoError) {
-        fprintf(stderr, "DNSServiceRegister failed with error: %s\n", knotdnssd_bonjour_error_to_str(err));
-    } else {
-        knotdnssd_bonjour_loop(sdRef, isStopped);
+/// Every service of a batch is its own subordinate reference on the session
+/// connection; sdRef is the first of them. Without connection sharing each
+/// further service also needs a watch of its own.
+struct RegisterContext : BonjourContext {
+    detail::RegisterRequest request;
+    /// one per registered service, null where registration failed
+    std::vector<DNSServiceRef> services;
+    std::vector<Reactor::Id> watches;
+
+    ~RegisterContext() override {
+        for (Reactor::Id id : watches) {
+            op->reactor().removeWatch(id);
+        }
+        for (DNSServiceRef ref : services) {
+            if (ref && ref != sdRef) {
+                DNSServiceRefDeallocate(ref);
+            }
+        }
+    }
+
+    void updateTxt(size_t index, const TxtRecord& txt) {
+        if (index >= services.size() || !services[index]) {
+            KNOTDNSSD_LOG_WARNING("TXT update for unknown service index %zu", index);
+            return;
+        }
+        request.services[index].txt = txt;
+        // a null record reference addresses the service's primary TXT record
+        DNSServiceErrorType err = DNSServiceUpdateRecord(services[index], nullptr, 0, static_cast<uint16_t>(txt.size()), txt.data(), 0);
+        if (err != kDNSServiceErr_NoError) {
+            KNOTDNSSD_LOG_ERROR("DNSServiceUpdateRecord failed with error: %s", knotdnssd_bonjour_error_to_str(err));
+        }
+    }
+};
+
+void detail::startRegister(const OperationPtr& op, RegisterRequest request) {
+    auto* context = new RegisterContext;
+    context->op = op;
+    context->request = std::move(request);
+    for (const ServiceRegistration& service : context->request.services) {
+        DNSServiceFlags flags = 0;
+        DNSServiceRef ref = knotdnssd_bonjour_session(op->reactor()).prepare(flags);
+        bool shared = ref != nullptr;
+        std::string regType = knotdnssd_bonjour_regtype(service.regType, service.subtypes);
+        // the record is already in wire format, an empty one is sent as length 0
+        DNSServiceErrorType err = DNSServiceRegister(&ref, flags, context->request.scope.interfaceIndex,
+                                                     toCString(service.serviceName), regType.c_str(), toCString(service.domain),
+                                                     nullptr,
+                                                     htons(service.port),
+                                                     static_cast<uint16_t>(service.txt.size()), service.txt.data(),
+                                                     nullptr, nullptr);
+        if (err != kDNSServiceErr_NoError) {
+            KNOTDNSSD_LOG_ERROR("DNSServiceRegister failed with error: %s", knotdnssd_bonjour_error_to_str(err));
+            ref = nullptr;
+        }
+        context->services.push_back(ref);
+        if (!ref) {
+            continue;
+        }
+        if (!context->sdRef) {
+            context->sdRef = ref;
+            context->shared = shared;
+        } else if (!shared) {
+            if (Reactor::Id watch = knotdnssd_bonjour_watch(context, ref)) {
+                context->watches.push_back(watch);
+            }
+        }
     }
-    DNSServiceRefDeallocate(sdRef);
-    TXTRecordDeallocate(&txtRecord);
+    // only called while the operation is active, i.e. before the teardown frees the context
+    context->request.registration->updateTxt = [context](size_t index, const TxtRecord& txt) {
+        context->updateTxt(index, txt);
+    };
+    knotdnssd_bonjour_attach(context);
 }
 
+struct BrowseContext : BonjourContext {
+    detail::BrowseRequest request;
+};
+
 void DNSSD_API knotdnssd_bonjour_browse_reply(
         DNSServiceRef,
-        DNSServiceFlags,
-        uint32_t,
+        DNSServiceFlags flags,
+        uint32_t interfaceIndex,
         DNSServiceErrorType errorCode,
         const char* serviceName,
         const char* regType,
         const char* replyDomain,
         void* context
 ) {
+    auto* browseContext = static_cast<BrowseContext*>(context);
+    if (!browseContext->op->active()) {
+        return;
+    }
     if (errorCode != kDNSServiceErr_NoError) {
-        fprintf(stderr, "knotdnssd_bonjour_browse_reply failed with error: %s\n", knotdnssd_bonjour_error_to_str(errorCode));
+        KNOTDNSSD_LOG_ERROR("knotdnssd_bonjour_browse_reply failed with error: %s", knotdnssd_bonjour_error_to_str(errorCode));
         return;
     }
-    const BrowseCallback& callback = *static_cast<BrowseCallback*>(context);
-    callback({serviceName, regType, replyDomain});
-}
-
-void browseServices(const char* regType, const char* domain, const BrowseCallback& callback,
-                 const std::function<bool()>& isStopped) {
-    void* callbackPtr = static_cast<void*>(const_cast<BrowseCallback*>(&callback));
-    DNSServiceRef sdRef;
-    DNSServiceErrorType err = DNSServiceBrowse(&sdRef, 0, kDNSServiceInterfaceIndexAny,
-                                               regType, domain,
-                                               knotdnssd_bonjour_browse_reply, callbackPtr);
-    if (err != kDNSServiceErr_NoError) {
-        fprintf(stderr, "DNSServiceBrowse failed with error: %s\n", knotdnssd_bonjour_error_to_str(err));
-    } else {
-        knotdnssd_bonjour_loop(sdRef, isStopped);
+    bool moreComing = flags & kDNSServiceFlagsMoreComing;
+    BrowseEvent event = flags & kDNSServiceFlagsAdd ? ServiceAdded : ServiceRemoved;
+    browseContext->request.callback({serviceName, regType, replyDomain, event, moreComing, interfaceIndex});
+    if (!moreComing && browseContext->request.allForNow && browseContext->op->active()) {
+        browseContext->request.allForNow();
     }
-    DNSServiceRefDeallocate(sdRef);
 }
 
-std::unordered_map<std::string, std::string> knotdnssd_bonjour_parse_txt_rec(const std::string& txtRecord) {
-    std::unordered_map<std::string, std::string> txt;
-
-    size_t startPos = 0;
-    size_t endPos = txtRecord.find('\x05');
-
-    while (endPos != std::string::npos) {
-        std::string pair = txtRecord.substr(startPos, endPos - startPos);
-        size_t equalPos = pair.find('=');
-        if (equalPos != std::string::npos) {
-            std::string key = pair.substr(0, equalPos);
-            std::string value = pair.substr(equalPos + 1);
-            txt.emplace(key, value);
-        }
-        startPos = endPos + 1;
-        endPos = txtRecord.find('\x05', startPos);
+void detail::startBrowse(const OperationPtr& op, BrowseRequest request) {
+    auto* context = new BrowseContext;
+    context->op = op;
+    context->request = std::move(request);
+    DNSServiceFlags flags = knotdnssd_bonjour_share(context);
+    std::string regType = context->request.regType;
+    if (!context->request.subtype.empty()) {
+        regType = knotdnssd_bonjour_regtype(regType, {context->request.subtype});
     }
-
-    std::string pair = txtRecord.substr(startPos);
-    size_t equalPos = pair.find('=');
-    if (equalPos != std::string::npos) {
-        std::string key = pair.substr(0, equalPos);
-        std::string value = pair.substr(equalPos + 1);
-        txt.emplace(key, value);
+    DNSServiceErrorType err = DNSServiceBrowse(&context->sdRef, flags, context->request.scope.interfaceIndex,
+                                               regType.c_str(), toCString(context->request.domain),
+                                               knotdnssd_bonjour_browse_reply, context);
+    if (err != kDNSServiceErr_NoError) {
+        KNOTDNSSD_LOG_ERROR("DNSServiceBrowse failed with error: %s", knotdnssd_bonjour_error_to_str(err));
+        context->sdRef = nullptr;
     }
-
-    return txt;
+    knotdnssd_bonjour_attach(context);
 }
 
+struct ResolveContext : BonjourContext {
+    detail::ResolveReplyHandler callback;
+    TxtPredicate filter;
+    bool watch = false;
+};
+
 void DNSSD_API knotdnssd_bonjour_resolve_reply(
         DNSServiceRef,
         DNSServiceFlags,
@@ -213,35 +404,52 @@ void DNSSD_API knotdnssd_bonjour_resolve_reply(
         const unsigned char* txtRecord,
         void* context
 ) {
-    const ResolveCallback& callback = *static_cast<ResolveCallback*>(context);
+    auto* resolveContext = static_cast<ResolveContext*>(context);
+    if (!resolveContext->op->active()) {
+        return;
+    }
+    // one-shot: no further replies once the first one was delivered. The
+    // daemon keeps a resolve open and replies again when SRV or TXT change,
+    // which is all a watch needs.
+    if (!resolveContext->watch || errorCode != kDNSServiceErr_NoError) {
+        resolveContext->op->complete(errorCode == kDNSServiceErr_NoError ? Status::Ok : Status::Failed);
+    }
+    const auto& callback = resolveContext->callback;
     if (errorCode != kDNSServiceErr_NoError) {
-        fprintf(stderr, "knotdnssd_bonjour_resolve_reply failed with error: %s\n", knotdnssd_bonjour_error_to_str(errorCode));
-        callback(std::nullopt);
+        KNOTDNSSD_LOG_ERROR("knotdnssd_bonjour_resolve_reply failed with error: %s", knotdnssd_bonjour_error_to_str(errorCode));
+        callback(std::nullopt, 0);
         return;
     }
-    std::string txtString(reinterpret_cast<const char*>(txtRecord), txtLen);
-    if (!txtString.empty()) {
-        txtString = txtString.substr(1);
+    if (!detail::accepts(resolveContext->filter, txtRecord, txtLen)) {
+        return;
     }
-    auto txt = knotdnssd_bonjour_parse_txt_rec(txtString);
-    callback({{hosttarget, std::nullopt, htons(port), txt}});
+    auto txt = TxtRecord::fromWire(txtRecord, txtLen);
+    // DNSServiceResolve does not report the SRV TTL
+    callback({{hosttarget, std::nullopt, ntohs(port), txt}}, detail::kHostRecordTtl);
 }
 
-void resolveService(const char* serviceName, const char* regType, const char* domain,
-                    const ResolveCallback& callback) {
-    void* callbackPtr = static_cast<void*>(const_cast<ResolveCallback*>(&callback));
-    DNSServiceRef sdRef;
-    DNSServiceErrorType err = DNSServiceResolve(&sdRef, 0, kDNSServiceInterfaceIndexAny,
-                                                serviceName, regType, domain,
-                                                knotdnssd_bonjour_resolve_reply, callbackPtr);
+void detail::startResolve(const OperationPtr& op, ResolveRequest request) {
+    auto* context = new ResolveContext;
+    context->op = op;
+    context->callback = std::move(request.callback);
+    context->filter = std::move(request.filter);
+    context->watch = request.watch;
+    DNSServiceFlags flags = knotdnssd_bonjour_share(context);
+    DNSServiceErrorType err = DNSServiceResolve(&context->sdRef, flags, request.scope.interfaceIndex,
+                                                request.serviceName.c_str(), request.regType.c_str(), toCString(request.domain),
+                                                knotdnssd_bonjour_resolve_reply, context);
     if (err != kDNSServiceErr_NoError) {
-        fprintf(stderr, "DNSServiceResolve failed with error: %s\n", knotdnssd_bonjour_error_to_str(err));
-    } else {
-        DNSServiceProcessResult(sdRef);
+        KNOTDNSSD_LOG_ERROR("DNSServiceResolve failed with error: %s", knotdnssd_bonjour_error_to_str(err));
+        context->sdRef = nullptr;
+        context->callback(std::nullopt, 0);
     }
-    DNSServiceRefDeallocate(sdRef);
+    knotdnssd_bonjour_attach(context);
 }
 
+struct QueryContext : BonjourContext {
+    detail::QueryReplyHandler callback;
+};
+
 void DNSSD_API knotdnssd_bonjour_query_reply(
         DNSServiceRef                       sdRef,
         DNSServiceFlags                     flags,
@@ -255,51 +463,214 @@ void DNSSD_API knotdnssd_bonjour_query_reply(
         uint32_t                            ttl,
         void                                *context
 ) {
-    const QueryCallback& callback = *static_cast<QueryCallback*>(context);
+    auto* queryContext = static_cast<QueryContext*>(context);
+    if (!queryContext->op->active()) {
+        return;
+    }
+    const auto& callback = queryContext->callback;
     if (errorCode != kDNSServiceErr_NoError) {
-        fprintf(stderr, "knotdnssd_bonjour_query_reply failed with error: %s\n", knotdnssd_bonjour_error_to_str(errorCode));
-        callback(std::nullopt);
+        queryContext->op->complete(Status::Failed);
+        KNOTDNSSD_LOG_ERROR("knotdnssd_bonjour_query_reply failed with error: %s", knotdnssd_bonjour_error_to_str(errorCode));
+        callback(std::nullopt, 0);
         return;
     }
-    if (rdlen != 4 && rdlen != 16) {
-        fprintf(stderr, "knotdnssd_bonjour_query_reply received invalid address\n");
-        callback(std::nullopt);
+    // a record that expired or went away, the lookup waits for one that is there
+    if (!(flags & kDNSServiceFlagsAdd)) {
+        return;
     }
-    const char* stringAddress = knotdnssd_parse_inet_addr(rdlen, rdata);
-    if (stringAddress == nullptr) {
-        callback(std::nullopt);
+    std::optional<IPAddress> address = IPAddress::fromBytes(rdata, rdlen, interfaceIndex);
+    queryContext->op->complete(address ? Status::Ok : Status::Failed);
+    if (!address) {
+        KNOTDNSSD_LOG_ERROR("knotdnssd_bonjour_query_reply received invalid address");
+        callback(std::nullopt, 0);
+        return;
     }
-    callback({{rdlen == 16 ? IPv6 : IPv4, std::string(stringAddress)}});
+    callback(address, ttl);
 }
 
-void queryIPv6Address(const char* hostName, const QueryCallback& callback) {
-    void* callbackPtr = static_cast<void*>(const_cast<QueryCallback*>(&callback));
-    DNSServiceRef sdRef;
-    DNSServiceErrorType err = DNSServiceQueryRecord(&sdRef, 0, kDNSServiceInterfaceIndexAny, hostName,
-                                                    kDNSServiceType_AAAA, kDNSServiceClass_IN,
-                                                    knotdnssd_bonjour_query_reply, callbackPtr);
+void detail::startQuery(const OperationPtr& op, QueryRequest request) {
+    auto* context = new QueryContext;
+    context->op = op;
+    context->callback = std::move(request.callback);
+    uint16_t rrtype = request.family == IPv6 ? kDNSServiceType_AAAA : kDNSServiceType_A;
+    DNSServiceFlags flags = knotdnssd_bonjour_share(context);
+    DNSServiceErrorType err = DNSServiceQueryRecord(&context->sdRef, flags, kDNSServiceInterfaceIndexAny, request.hostName.c_str(),
+                                                    rrtype, kDNSServiceClass_IN,
+                                                    knotdnssd_bonjour_query_reply, context);
     if (err != kDNSServiceErr_NoError) {
-        fprintf(stderr, "DNSServiceQueryRecord failed with error: %s\n", knotdnssd_bonjour_error_to_str(err));
-    } else {
-        DNSServiceProcessResult(sdRef);
+        KNOTDNSSD_LOG_ERROR("DNSServiceQueryRecord failed with error: %s", knotdnssd_bonjour_error_to_str(err));
+        context->sdRef = nullptr;
+        context->callback(std::nullopt, 0);
     }
-    DNSServiceRefDeallocate(sdRef);
+    knotdnssd_bonjour_attach(context);
 }
 
-void queryIPv4Address(const char* hostName, const QueryCallback& callback) {
-    void* callbackPtr = static_cast<void*>(const_cast<QueryCallback*>(&callback));
-    DNSServiceRef sdRef;
-    DNSServiceErrorType err = DNSServiceQueryRecord(&sdRef, 0, kDNSServiceInterfaceIndexAny, hostName,
+struct AddressContext : BonjourContext {
+    detail::AddressRequest request;
+    /// indexed by IPFamily
+    bool answered[2] = {false, false};
+    bool done[2] = {false, false};
+#if defined(AVAHI_BONJOUR_COMPAT)
+    /// the compatibility layer has no DNSServiceGetAddrInfo: sdRef queries A, this one AAAA
+    DNSServiceRef ipv6 = nullptr;
+    Reactor::Id ipv6Watch = 0;
+
+    ~AddressContext() override {
+        if (ipv6Watch) {
+            op->reactor().removeWatch(ipv6Watch);
+        }
+        if (ipv6) {
+            DNSServiceRefDeallocate(ipv6);
+        }
+    }
+#endif
+
+    void finish(IPFamily family) {
+        if (!done[family] && op->active()) {
+            done[family] = true;
+            request.familyDone(family);
+        }
+    }
+
+    void onAnswer(const std::optional<IPAddress>& address, IPFamily family, DNSServiceFlags flags) {
+        if (address) {
+            answered[family] = true;
+            request.onAddress(*address);
+        } else {
+            // negative answer, the host has no address of this family
+            finish(family);
+        }
+        if (!(flags & kDNSServiceFlagsMoreComing)) {
+            for (IPFamily answeredFamily : {IPv4, IPv6}) {
+                if (answered[answeredFamily]) {
+                    finish(answeredFamily);
+                }
+            }
+        }
+    }
+};
+
+#if defined(AVAHI_BONJOUR_COMPAT)
+
+void DNSSD_API knotdnssd_bonjour_address_reply(
+        DNSServiceRef,
+        DNSServiceFlags flags,
+        uint32_t interfaceIndex,
+        DNSServiceErrorType errorCode,
+        const char*,
+        uint16_t rrtype,
+        uint16_t,
+        uint16_t rdlen,
+        const void* rdata,
+        uint32_t,
+        void* context
+) {
+    auto* addressContext = static_cast<AddressContext*>(context);
+    if (!addressContext->op->active()) {
+        return;
+    }
+    IPFamily family = rrtype == kDNSServiceType_AAAA ? IPv6 : IPv4;
+    if (errorCode != kDNSServiceErr_NoError) {
+        KNOTDNSSD_LOG_ERROR("knotdnssd_bonjour_address_reply failed with error: %s", knotdnssd_bonjour_error_to_str(errorCode));
+        addressContext->finish(family);
+        return;
+    }
+    if (!(flags & kDNSServiceFlagsAdd)) {
+        return;
+    }
+    addressContext->onAnswer(IPAddress::fromBytes(rdata, rdlen, interfaceIndex), family, flags);
+}
+
+void detail::startAddresses(const OperationPtr& op, AddressRequest request) {
+    auto* context = new AddressContext;
+    context->op = op;
+    context->request = std::move(request);
+    DNSServiceErrorType err = DNSServiceQueryRecord(&context->sdRef, 0, kDNSServiceInterfaceIndexAny, context->request.hostName.c_str(),
                                                     kDNSServiceType_A, kDNSServiceClass_IN,
-                                                    knotdnssd_bonjour_query_reply, callbackPtr);
+                                                    knotdnssd_bonjour_address_reply, context);
+    if (err != kDNSServiceErr_NoError) {
+        KNOTDNSSD_LOG_ERROR("DNSServiceQueryRecord failed with error: %s", knotdnssd_bonjour_error_to_str(err));
+        context->sdRef = nullptr;
+    }
+    err = DNSServiceQueryRecord(&context->ipv6, 0, kDNSServiceInterfaceIndexAny, context->request.hostName.c_str(),
+                                kDNSServiceType_AAAA, kDNSServiceClass_IN,
+                                knotdnssd_bonjour_address_reply, context);
     if (err != kDNSServiceErr_NoError) {
-        fprintf(stderr, "DNSServiceQueryRecord failed with error: %s\n", knotdnssd_bonjour_error_to_str(err));
+        KNOTDNSSD_LOG_ERROR("DNSServiceQueryRecord failed with error: %s", knotdnssd_bonjour_error_to_str(err));
+        context->ipv6 = nullptr;
+        context->finish(IPv6);
+    } else {
+        context->ipv6Watch = knotdnssd_bonjour_watch(context, context->ipv6);
+    }
+    knotdnssd_bonjour_attach(context);
+}
+
+#else
+
+void DNSSD_API knotdnssd_bonjour_address_reply(
+        DNSServiceRef,
+        DNSServiceFlags flags,
+        uint32_t interfaceIndex,
+        DNSServiceErrorType errorCode,
+        const char*,
+        const struct sockaddr* address,
+        uint32_t,
+        void* context
+) {
+    auto* addressContext = static_cast<AddressContext*>(context);
+    if (!addressContext->op->active()) {
+        return;
+    }
+    bool negative = errorCode == kDNSServiceErr_NoSuchRecord;
+    if (errorCode != kDNSServiceErr_NoError && !negative) {
+        KNOTDNSSD_LOG_ERROR("knotdnssd_bonjour_address_reply failed with error: %s", knotdnssd_bonjour_error_to_str(errorCode));
+        addressContext->finish(IPv4);
+        addressContext->finish(IPv6);
+        return;
+    }
+    if (!(flags & kDNSServiceFlagsAdd) || !address) {
+        return;
+    }
+    std::optional<IPAddress> ip;
+    IPFamily family;
+    if (address->sa_family == AF_INET6) {
+        family = IPv6;
+        auto* sin6 = reinterpret_cast<const struct sockaddr_in6*>(address);
+        if (!negative) {
+            ip = IPAddress::fromBytes(&sin6->sin6_addr, sizeof(sin6->sin6_addr), interfaceIndex);
+            ip->scopeId = sin6->sin6_scope_id;
+        }
+    } else if (address->sa_family == AF_INET) {
+        family = IPv4;
+        auto* sin = reinterpret_cast<const struct sockaddr_in*>(address);
+        if (!negative) {
+            ip = IPAddress::fromBytes(&sin->sin_addr, sizeof(sin->sin_addr), interfaceIndex);
+        }
     } else {
-        DNSServiceProcessResult(sdRef);
+        return;
     }
-    DNSServiceRefDeallocate(sdRef);
+    addressContext->onAnswer(ip, family, flags);
 }
 
+void detail::startAddresses(const OperationPtr& op, AddressRequest request) {
+    auto* context = new AddressContext;
+    context->op = op;
+    context->request = std::move(request);
+    // intermediates carry the negative answers that tell a missing family apart from a slow one
+    DNSServiceFlags flags = knotdnssd_bonjour_share(context) | kDNSServiceFlagsReturnIntermediates;
+    DNSServiceErrorType err = DNSServiceGetAddrInfo(&context->sdRef, flags, kDNSServiceInterfaceIndexAny,
+                                                    kDNSServiceProtocol_IPv4 | kDNSServiceProtocol_IPv6,
+                                                    context->request.hostName.c_str(),
+                                                    knotdnssd_bonjour_address_reply, context);
+    if (err != kDNSServiceErr_NoError) {
+        KNOTDNSSD_LOG_ERROR("DNSServiceGetAddrInfo failed with error: %s", knotdnssd_bonjour_error_to_str(err));
+        context->sdRef = nullptr;
+    }
+    knotdnssd_bonjour_attach(context);
+}
+
+#endif
+
 }
 
 #endif  // USE_BONJOUR
@@ -0,0 +1,147 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_BROWSE_DEDUP_H
+#define KNOTDNSSD_BROWSE_DEDUP_H
+
+#include "knot/dnssd.h"
+#include "operation.h"
+
+#include <cstdint>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace knot::detail {
+
+/// Collapses the events a daemon reports once per interface and address
+/// family into one event per instance; reactor thread only.
+///
+/// An event flagged moreComing is held back until the next one passes or
+/// the burst ends. So the burst still ends on an event without the flag even
+/// if its last raw event was a duplicate, and an added instance lists every
+/// interface it was seen on within the burst.
+class BrowseDedup {
+public:
+    BrowseDedup(OperationPtr op, BrowseCallback callback) : op_(std::move(op)), callback_(std::move(callback)) {}
+
+    void apply(const BrowseReply& reply) {
+        std::string key = reply.serviceName;
+        key.push_back('\0');
+        key.append(reply.regType);
+        key.push_back('\0');
+        key.append(reply.replyDomain);
+
+        bool passes = false;
+        if (reply.event == ServiceAdded) {
+            Tracked& tracked = instances_[key];
+            passes = tracked.interfaces.empty();
+            if (passes) {
+                tracked.instance = ServiceInstance{reply.serviceName, reply.regType, reply.replyDomain};
+            }
+            tracked.interfaces.insert(reply.interfaceIndex);
+        } else {
+            auto it = instances_.find(key);
+            if (it != instances_.end() && it->second.interfaces.erase(reply.interfaceIndex) > 0) {
+                passes = it->second.interfaces.empty();
+                if (passes) {
+                    instances_.erase(it);
+                }
+            }
+        }
+
+        if (!passes) {
+            if (!reply.moreComing) {
+                flush(false);
+            }
+            return;
+        }
+        flush(true);
+        if (reply.moreComing) {
+            pending_ = Pending{std::move(key), ServiceInstance{reply.serviceName, reply.regType, reply.replyDomain}, reply.event, reply.interfaceIndex};
+        } else {
+            deliver(key, reply, false);
+        }
+    }
+
+    void allForNow() {
+        flush(false);
+    }
+
+    /// the daemon lost every instance without remove events
+    void reset() {
+        pending_.reset();
+        std::vector<ServiceInstance> gone;
+        for (auto& [key, tracked] : instances_) {
+            gone.push_back(std::move(tracked.instance));
+        }
+        instances_.clear();
+        for (size_t i = 0; i < gone.size() && op_->active(); ++i) {
+            BrowseReply reply{gone[i].serviceName.c_str(), gone[i].regType.c_str(), gone[i].replyDomain.c_str(), ServiceRemoved, i + 1 < gone.size()};
+            callback_(reply);
+        }
+    }
+
+private:
+    struct Tracked {
+        ServiceInstance instance;
+        /// where the instance is up, 0 where the daemon does not say; an add
+        /// repeated on an interface changes nothing, one remove there ends it
+        std::set<uint32_t> interfaces;
+    };
+
+    struct Pending {
+        std::string key;
+        ServiceInstance instance;
+        BrowseEvent event;
+        uint32_t interfaceIndex;
+    };
+
+    void flush(bool moreComing) {
+        if (!pending_) {
+            return;
+        }
+        Pending pending = std::move(*pending_);
+        pending_.reset();
+        BrowseReply reply{pending.instance.serviceName.c_str(), pending.instance.regType.c_str(), pending.instance.replyDomain.c_str(), pending.event};
+        reply.interfaceIndex = pending.interfaceIndex;
+        deliver(pending.key, reply, moreComing);
+    }
+
+    void deliver(const std::string& key, BrowseReply reply, bool moreComing) {
+        if (!op_->active()) {
+            return;
+        }
+        reply.moreComing = moreComing;
+        interfaces_.clear();
+        auto it = reply.event == ServiceAdded ? instances_.find(key) : instances_.end();
+        if (it != instances_.end()) {
+            for (uint32_t interface : it->second.interfaces) {
+                if (interface != 0) {
+                    interfaces_.push_back(interface);
+                }
+            }
+        }
+        reply.interfaces = interfaces_.data();
+        reply.interfaceCount = interfaces_.size();
+        callback_(reply);
+    }
+
+    OperationPtr op_;
+    BrowseCallback callback_;
+    std::unordered_map<std::string, Tracked> instances_;
+    std::optional<Pending> pending_;
+    /// storage behind BrowseReply::interfaces
+    std::vector<uint32_t> interfaces_;
+};
+
+}
+
+#endif //KNOTDNSSD_BROWSE_DEDUP_H
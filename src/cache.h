@@ -0,0 +1,268 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_CACHE_H
+#define KNOTDNSSD_CACHE_H
+
+#include "knot/dnssd.h"
+#include "backend.h"
+#include "metrics.h"
+#include "operation.h"
+
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace knot::detail {
+
+/// TTL-bound result cache with single-flight lookups.
+///
+/// Concurrent lookups of a key share one daemon query; every caller still
+/// gets its own operation, and the shared query is cancelled only when all of
+/// them are or the library default timeout passes. In stale-while-revalidate
+/// mode an expired value is handed out at once while a background query
+/// refreshes it. Provisional values, seeded from a warm-start snapshot, are
+/// revalidated the same way even within their TTL; one the query cannot
+/// confirm is dropped.
+template<typename Value>
+class ResultCache {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = Fn<void(const std::optional<Value>&)>;
+    using Done = Fn<void(const std::optional<Value>&, uint32_t ttl)>;
+    using Fetch = Fn<void(const OperationPtr& op, Done done)>;
+
+    void setOptions(const CacheOptions& options) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        options_ = options;
+        if (!options_.enabled) {
+            clearLocked();
+        }
+    }
+
+    CacheOptions options() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return options_;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        clearLocked();
+    }
+
+    /// calls visit(key, value, expires) for every entry holding a value
+    template<typename Visit>
+    void forEach(Visit visit) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& [key, entry] : entries_) {
+            if (entry.value) {
+                visit(key, *entry.value, entry.expires);
+            }
+        }
+    }
+
+    /// adds a provisional value unless key is cached or being looked up already
+    void seed(const std::string& key, Value value, Clock::time_point expires) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!options_.enabled) {
+            return;
+        }
+        Entry& entry = entries_[key];
+        if (entry.value || entry.inflight) {
+            return;
+        }
+        entry.value = std::move(value);
+        entry.expires = expires;
+        entry.provisional = true;
+        evictLocked();
+    }
+
+    Operation lookup(const OperationPtr& op, const std::string& key, Callback callback, Fetch fetch) {
+        Reactor& reactor = op->reactor();
+        std::lock_guard<std::mutex> lock(mutex_);
+        Entry& entry = entries_[key];
+        auto now = Clock::now();
+
+        bool fresh = now < entry.expires;
+        if (entry.value && !entry.provisional && fresh) {
+            count(&MetricsRegistry::cacheHits);
+            deliver(op, std::move(callback), *entry.value);
+            return Operation(op);
+        }
+
+        // provisional values are served within the same bounds as confirmed ones
+        bool stale = options_.staleWhileRevalidate && now < entry.expires + options_.maxStale;
+        if (entry.value && (fresh || stale)) {
+            count(&MetricsRegistry::cacheHits);
+            deliver(op, std::move(callback), *entry.value);
+            if (!entry.inflight) {
+                startFetch(reactor, key, entry, std::move(fetch));
+            }
+            return Operation(op);
+        }
+
+        count(&MetricsRegistry::cacheMisses);
+        entry.waiters.push_back({op, std::move(callback)});
+        reactor.post([this, op, key] {
+            // the shared query may already have answered this waiter
+            if (!op->finished()) {
+                op->setTeardown([this, op, key] { removeWaiter(key, op); });
+            }
+        });
+        if (!entry.inflight) {
+            startFetch(reactor, key, entry, std::move(fetch));
+        }
+        return Operation(op);
+    }
+
+private:
+    struct Waiter {
+        OperationPtr op;
+        Callback callback;
+    };
+
+    struct Entry {
+        std::optional<Value> value;
+        Clock::time_point expires;
+        OperationPtr inflight;
+        std::vector<Waiter> waiters;
+        /// loaded from a snapshot and not confirmed by a query since
+        bool provisional = false;
+    };
+
+    static void deliver(const OperationPtr& op, Callback callback, Value value) {
+        op->reactor().post([op, callback = std::move(callback), value = std::move(value)] {
+            if (op->active()) {
+                op->report(Status::Ok);
+                callback(value);
+            }
+            op->finish();
+        });
+    }
+
+    void startFetch(Reactor& reactor, const std::string& key, Entry& entry, Fetch fetch) {
+        auto fetchOp = std::make_shared<OperationState>(reactor);
+        entry.inflight = fetchOp;
+        reactor.post([this, fetchOp, key, fetch = std::move(fetch)] {
+            if (!fetchOp->active()) {
+                return;
+            }
+            fetch(fetchOp, [this, fetchOp, key](const std::optional<Value>& value, uint32_t ttl) {
+                complete(key, fetchOp, value, ttl);
+            });
+        });
+        // a peer that never answers must not hold the key forever: later
+        // lookups would join the hung query and refreshes never be retried
+        std::chrono::milliseconds timeout = defaultTimeout();
+        if (timeout.count() > 0) {
+            setDeadline(fetchOp, timeout, [this, fetchOp, key] {
+                complete(key, fetchOp, std::nullopt, 0, Status::Timeout);
+            });
+        }
+    }
+
+    /// failure is what waiters are told when there is no value
+    void complete(const std::string& key, const OperationPtr& fetchOp, const std::optional<Value>& value, uint32_t ttl, Status failure = Status::Failed) {
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(key);
+            if (it == entries_.end() || it->second.inflight != fetchOp) {
+                return;
+            }
+            Entry& entry = it->second;
+            entry.inflight = nullptr;
+            waiters.swap(entry.waiters);
+            if (value && ttl > 0) {
+                entry.value = value;
+                entry.expires = Clock::now() + std::chrono::seconds(ttl);
+                entry.provisional = false;
+            } else {
+                entries_.erase(it);
+            }
+            evictLocked();
+        }
+        for (auto& waiter : waiters) {
+            if (waiter.op->active()) {
+                waiter.op->report(value ? Status::Ok : failure);
+                waiter.callback(value);
+            }
+            waiter.op->finish();
+        }
+    }
+
+    void removeWaiter(const std::string& key, const OperationPtr& op) {
+        OperationPtr abandoned;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(key);
+            if (it == entries_.end()) {
+                return;
+            }
+            Entry& entry = it->second;
+            auto& waiters = entry.waiters;
+            for (auto w = waiters.begin(); w != waiters.end(); ++w) {
+                if (w->op == op) {
+                    waiters.erase(w);
+                    break;
+                }
+            }
+            // nobody is interested any more; background refreshes have no waiters and keep running
+            if (waiters.empty() && entry.inflight && !entry.value) {
+                abandoned = std::move(entry.inflight);
+                entries_.erase(it);
+            }
+        }
+        if (abandoned) {
+            abandoned->cancel();
+        }
+    }
+
+    void evictLocked() {
+        if (entries_.size() <= options_.maxEntries) {
+            return;
+        }
+        auto horizon = Clock::now() - (options_.staleWhileRevalidate ? Clock::duration(options_.maxStale) : Clock::duration::zero());
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            const Entry& entry = it->second;
+            bool expired = entry.value && horizon >= entry.expires;
+            it = !entry.inflight && expired ? entries_.erase(it) : std::next(it);
+        }
+        for (auto it = entries_.begin(); it != entries_.end() && entries_.size() > options_.maxEntries;) {
+            it = !it->second.inflight ? entries_.erase(it) : std::next(it);
+        }
+    }
+
+    void clearLocked() {
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->second.inflight) {
+                it->second.value.reset();
+                it->second.provisional = false;
+                ++it;
+            } else {
+                it = entries_.erase(it);
+            }
+        }
+    }
+
+    mutable std::mutex mutex_;
+    CacheOptions options_;
+    std::unordered_map<std::string, Entry> entries_;
+};
+
+/// keyed by instance and network scope
+ResultCache<ResolveReply>& resolveCache();
+/// keyed by host name and record type
+ResultCache<IPAddress>& queryCache();
+
+}
+
+#endif //KNOTDNSSD_CACHE_H
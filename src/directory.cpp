@@ -0,0 +1,325 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#include "knot/dnssd.h"
+#include "backend.h"
+#include "metrics.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace knot {
+
+namespace detail {
+
+/// A daemon that finds nothing may never say that all is known for now
+/// (Bonjour only does so within a reply), the browse counts as settled then.
+constexpr std::chrono::seconds kSettleDelay(3);
+
+/// Writer side runs on the reactor thread only.
+///
+/// Every snapshot counts its own readers, so a long-lived view only holds
+/// back the snapshot it pins. A reader stays in entering_ from loading the
+/// pointer until its count is raised: once entering_ reads zero after a
+/// snapshot was unpublished, nobody can pin it anew and it is freed as soon
+/// as its own count drops to zero.
+class DirectoryState {
+public:
+    using Snapshot = ServiceDirectory::Snapshot;
+
+    DirectoryState(std::string regType, std::string domain)
+            : regType_(std::move(regType)), domain_(std::move(domain)), current_(new Pinned) {}
+
+    ~DirectoryState() {
+        delete current_.load();
+        for (const Retired& retired : retired_) {
+            delete retired.snapshot;
+        }
+    }
+
+    const Snapshot* pin() const {
+        entering_.fetch_add(1, std::memory_order_seq_cst);
+        const Pinned* snapshot = current_.load(std::memory_order_seq_cst);
+        snapshot->readers.fetch_add(1, std::memory_order_seq_cst);
+        entering_.fetch_sub(1, std::memory_order_seq_cst);
+        return snapshot;
+    }
+
+    void unpin(const Snapshot* snapshot) const {
+        static_cast<const Pinned*>(snapshot)->readers.fetch_sub(1, std::memory_order_release);
+    }
+
+    const std::string& regType() const { return regType_; }
+    const std::string& domain() const { return domain_; }
+
+    /// before the browse starts: publishes the instances of a warm-start
+    /// snapshot, they stay until the browse settles without confirming them
+    void seed(const std::vector<ServiceInstance>& instances) {
+        for (const ServiceInstance& instance : instances) {
+            std::string key = instance.serviceName;
+            key.push_back('\0');
+            key.append(instance.regType);
+            key.push_back('\0');
+            key.append(instance.replyDomain);
+            Tracked& tracked = instances_[key];
+            if (!tracked.instance) {
+                tracked.instance = std::make_shared<const ServiceInstance>(instance);
+                tracked.provisional = true;
+                ++provisional_;
+                dirty_ = true;
+            }
+        }
+        publish();
+    }
+
+    void apply(const BrowseReply& reply) {
+        std::string key = reply.serviceName;
+        key.push_back('\0');
+        key.append(reply.regType);
+        key.push_back('\0');
+        key.append(reply.replyDomain);
+
+        // instances are reported once per interface and protocol
+        if (reply.event == ServiceAdded) {
+            Tracked& tracked = instances_[key];
+            if (tracked.provisional) {
+                // confirmed, and already visible
+                tracked.provisional = false;
+                --provisional_;
+                dirty_ = dirty_ || provisional_ == 0;
+                tracked.sightings = 1;
+            } else if (tracked.sightings++ == 0) {
+                tracked.instance = std::make_shared<const ServiceInstance>(ServiceInstance{reply.serviceName, reply.regType, reply.replyDomain});
+                dirty_ = true;
+            }
+        } else {
+            auto it = instances_.find(key);
+            if (it != instances_.end() && (it->second.provisional || --it->second.sightings == 0)) {
+                provisional_ -= it->second.provisional ? 1 : 0;
+                instances_.erase(it);
+                dirty_ = true;
+            }
+        }
+
+        if (settled_ && !reply.moreComing) {
+            publish();
+        }
+    }
+
+    void allForNow() {
+        settled_ = true;
+        // whatever the snapshot knew and the network did not confirm is gone
+        for (auto it = instances_.begin(); provisional_ > 0 && it != instances_.end();) {
+            if (it->second.provisional) {
+                --provisional_;
+                it = instances_.erase(it);
+                dirty_ = true;
+            } else {
+                ++it;
+            }
+        }
+        publish();
+    }
+
+    void reset() {
+        dirty_ = dirty_ || !instances_.empty();
+        instances_.clear();
+        provisional_ = 0;
+        settled_ = false;
+        publish();
+    }
+
+    /// settles the browse after kSettleDelay unless the daemon does so first
+    void settleLater(Reactor& reactor) {
+        cancelSettle(reactor);
+        settleTimer_ = reactor.addTimer(Reactor::Clock::now() + kSettleDelay, [this] {
+            settleTimer_ = 0;
+            if (!settled_) {
+                allForNow();
+            }
+        });
+    }
+
+    void cancelSettle(Reactor& reactor) {
+        if (settleTimer_) {
+            reactor.removeTimer(settleTimer_);
+            settleTimer_ = 0;
+        }
+    }
+
+private:
+    struct Tracked {
+        std::shared_ptr<const ServiceInstance> instance;
+        unsigned sightings = 0;
+        /// seeded from a snapshot, not seen by the browse yet
+        bool provisional = false;
+    };
+
+    void publish() {
+        reclaim();
+        if (!dirty_) {
+            return;
+        }
+        dirty_ = false;
+        auto* snapshot = new Pinned;
+        snapshot->version = ++version_;
+        snapshot->provisional = provisional_ > 0;
+        snapshot->instances.reserve(instances_.size());
+        for (const auto& [key, tracked] : instances_) {
+            snapshot->instances.push_back(tracked.instance);
+        }
+        retired_.push_back({current_.exchange(snapshot, std::memory_order_seq_cst)});
+        reclaim();
+    }
+
+    void reclaim() {
+        if (retired_.empty()) {
+            return;
+        }
+        // all of retired_ is unpublished by now
+        bool quiet = entering_.load(std::memory_order_seq_cst) == 0;
+        retired_.erase(std::remove_if(retired_.begin(), retired_.end(), [quiet](Retired& retired) {
+            retired.quiesced = retired.quiesced || quiet;
+            if (!retired.quiesced || retired.snapshot->readers.load(std::memory_order_acquire) != 0) {
+                return false;
+            }
+            delete retired.snapshot;
+            return true;
+        }), retired_.end());
+    }
+
+    const std::string regType_;
+    const std::string domain_;
+
+    struct Pinned : Snapshot {
+        mutable std::atomic<uint32_t> readers{0};
+    };
+
+    struct Retired {
+        const Pinned* snapshot;
+        /// no reader can pin it anew
+        bool quiesced = false;
+    };
+
+    mutable std::atomic<uint32_t> entering_{0};
+    std::atomic<const Pinned*> current_;
+    std::vector<Retired> retired_;
+
+    // keyed by name, type and domain, so snapshots come out ordered by name
+    std::map<std::string, Tracked> instances_;
+    uint64_t version_ = 0;
+    size_t provisional_ = 0;
+    bool dirty_ = false;
+    bool settled_ = false;
+    Reactor::Id settleTimer_ = 0;
+};
+
+/// Live directories, for saveSnapshot().
+struct DirectoryRegistry {
+    std::mutex mutex;
+    std::vector<std::weak_ptr<DirectoryState>> states;
+};
+
+static DirectoryRegistry& directoryRegistry() {
+    // never destroyed, directories may outlive static destruction
+    static auto* instance = new DirectoryRegistry();
+    return *instance;
+}
+
+static void enroll(const std::shared_ptr<DirectoryState>& state) {
+    DirectoryRegistry& registry = directoryRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto& states = registry.states;
+    states.erase(std::remove_if(states.begin(), states.end(), [](const auto& state) { return state.expired(); }), states.end());
+    states.push_back(state);
+}
+
+std::vector<DirectoryInstance> directoryInstances() {
+    std::vector<std::shared_ptr<DirectoryState>> states;
+    {
+        DirectoryRegistry& registry = directoryRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (const auto& weak : registry.states) {
+            if (auto state = weak.lock()) {
+                states.push_back(std::move(state));
+            }
+        }
+    }
+    std::vector<DirectoryInstance> instances;
+    for (const auto& state : states) {
+        const ServiceDirectory::Snapshot* snapshot = state->pin();
+        for (const auto& instance : snapshot->instances) {
+            instances.push_back({state->regType(), state->domain(), *instance});
+        }
+        state->unpin(snapshot);
+    }
+    return instances;
+}
+
+}
+
+const ServiceInstance* ServiceDirectory::Snapshot::find(std::string_view serviceName) const {
+    auto it = std::lower_bound(instances.begin(), instances.end(), serviceName, [](const auto& instance, std::string_view name) {
+        return instance->serviceName < name;
+    });
+    if (it != instances.end() && (*it)->serviceName == serviceName) {
+        return it->get();
+    }
+    return nullptr;
+}
+
+ServiceDirectory::View::View(View&& other) noexcept : state_(other.state_), snapshot_(other.snapshot_) {
+    other.state_ = nullptr;
+}
+
+ServiceDirectory::View::~View() {
+    if (state_) {
+        state_->unpin(snapshot_);
+    }
+}
+
+ServiceDirectory::ServiceDirectory(const char* regType, const char* domain)
+        : state_(std::make_shared<detail::DirectoryState>(detail::toString(regType), detail::toString(domain))) {
+    state_->seed(detail::warmInstances(state_->regType(), state_->domain()));
+    detail::enroll(state_);
+    // the callbacks keep the state alive until the browse is torn down
+    auto state = state_;
+    detail::OperationPtr op = detail::create({}, state->regType());
+    detail::Reactor& reactor = op->reactor();
+    detail::BrowseRequest request;
+    request.regType = state->regType();
+    request.domain = state->domain();
+    request.callback = detail::counted([state](const BrowseReply& reply) { state->apply(reply); });
+    request.allForNow = [state] { state->allForNow(); };
+    request.reset = [state, &reactor] {
+        state->reset();
+        state->settleLater(reactor);
+    };
+    browse_ = detail::start(detail::startBrowse, std::move(request), op);
+    // posted after the start of the browse
+    reactor.post([op, state] {
+        if (!op->active()) {
+            return;
+        }
+        detail::Reactor& reactor = op->reactor();
+        state->settleLater(reactor);
+        op->onFinish([&reactor, state] { state->cancelSettle(reactor); });
+    });
+}
+
+ServiceDirectory::~ServiceDirectory() = default;
+
+ServiceDirectory::View ServiceDirectory::view() const {
+    return View(state_.get(), state_->pin());
+}
+
+}
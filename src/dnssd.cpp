@@ -0,0 +1,712 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#include "knot/dnssd.h"
+#include "backend.h"
+#include "browse_dedup.h"
+#include "cache.h"
+#include "executor.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cctype>
+#include <unordered_map>
+#include <vector>
+
+namespace knot {
+
+namespace detail {
+
+static std::atomic<unsigned> shardCount{1};
+
+struct Shard {
+    Reactor reactor;
+    std::atomic<uint64_t> operations{0};
+};
+
+/// Created on first use, their number is fixed from then on.
+struct Shards {
+    Shards() : all(std::max(1u, shardCount.load(std::memory_order_relaxed))) {
+        for (auto& shard : all) {
+            shard = std::make_unique<Shard>();
+        }
+    }
+
+    // the first loop stops last, backends may still post to it from the others
+    ~Shards() {
+        for (auto it = all.rbegin(); it != all.rend(); ++it) {
+            (*it)->reactor.stop();
+        }
+    }
+
+    std::vector<std::unique_ptr<Shard>> all;
+};
+
+static std::vector<std::unique_ptr<Shard>>& shards() {
+    static Shards instance;
+    return instance.all;
+}
+
+/// FNV-1a of the key, spread by jump consistent hashing (Lamping and Veach),
+/// so a changed shard count moves as few service types as possible.
+static size_t shardIndex(std::string_view key, size_t count) {
+    if (count == 1 || key.empty()) {
+        return 0;
+    }
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : key) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    int64_t bucket = -1;
+    int64_t next = 0;
+    while (next < static_cast<int64_t>(count)) {
+        bucket = next;
+        hash = hash * 2862933555777941757ull + 1;
+        next = static_cast<int64_t>(static_cast<double>(bucket + 1) * (static_cast<double>(1ll << 31) / static_cast<double>((hash >> 33) + 1)));
+    }
+    return static_cast<size_t>(bucket);
+}
+
+static Shard& shard(std::string_view key) {
+    auto& all = shards();
+    return *all[shardIndex(key, all.size())];
+}
+
+Reactor& reactor(std::string_view shardKey) {
+    return shard(shardKey).reactor;
+}
+
+// Never destroyed: tasks and deadlines the caches post to the reactors refer
+// back to them, and the reactor threads are only stopped after static
+// destruction got to the caches.
+ResultCache<ResolveReply>& resolveCache() {
+    static auto* instance = new ResultCache<ResolveReply>();
+    return *instance;
+}
+
+ResultCache<IPAddress>& queryCache() {
+    static auto* instance = new ResultCache<IPAddress>();
+    return *instance;
+}
+
+static std::atomic<int64_t> defaultTimeoutMs{10000};
+
+std::chrono::milliseconds defaultTimeout() {
+    return std::chrono::milliseconds(defaultTimeoutMs.load(std::memory_order_relaxed));
+}
+
+/// First half of create(): the operation with its completion hooks, so
+/// callbacks can be bound to it before the deadline refers to them.
+static OperationPtr prepare(const OperationOptions& options, std::string_view shardKey) {
+    Shard& target = shard(shardKey);
+    target.operations.fetch_add(1, std::memory_order_relaxed);
+    auto op = std::make_shared<OperationState>(target.reactor);
+    if (metricsEnabled()) {
+        metricsRegistry().inFlight.fetch_add(1, std::memory_order_relaxed);
+        op->reactor().post([op] {
+            op->onFinish([op] { recordFinish(*op->status()); });
+        });
+    }
+    if (options.onComplete) {
+        op->reactor().post([op, onComplete = dispatched(op, options.executor, options.onComplete, true)] {
+            op->onFinish([op, onComplete] { onComplete(*op->status()); });
+        });
+    }
+    return op;
+}
+
+static void arm(const OperationPtr& op, const OperationOptions& options, bool oneShot, Fn<void()> onTimeout) {
+    std::chrono::milliseconds timeout(0);
+    if (options.timeout) {
+        timeout = *options.timeout;
+    } else if (oneShot) {
+        timeout = defaultTimeout();
+    }
+    if (timeout.count() > 0) {
+        setDeadline(op, timeout, std::move(onTimeout));
+    }
+}
+
+OperationPtr create(const OperationOptions& options, std::string_view shardKey, bool oneShot, Fn<void()> onTimeout) {
+    OperationPtr op = prepare(options, shardKey);
+    arm(op, options, oneShot, std::move(onTimeout));
+    return op;
+}
+
+static std::string cacheKey(std::initializer_list<const std::string*> parts) {
+    std::string key;
+    for (const std::string* part : parts) {
+        key.append(*part);
+        key.push_back('\0');
+    }
+    return key;
+}
+
+static std::string scopeKey(const NetworkScope& scope) {
+    std::string key = std::to_string(scope.interfaceIndex);
+    if (scope.family) {
+        key.append(*scope.family == IPv6 ? "/6" : "/4");
+    }
+    return key;
+}
+
+static Operation resolve(ResolveRequest request, ResolveCallback callback, const OperationOptions& options) {
+    count(&MetricsRegistry::resolves);
+    OperationPtr op = prepare(options, request.serviceName);
+    request.scope = options.scope;
+    callback = dispatched(op, options.executor, measured(timed(std::move(callback)), &MetricsRegistry::resolveLatency));
+    arm(op, options, true, [callback] { callback(std::nullopt); });
+    // a filtered lookup may end without a reply, there is nothing to share or cache
+    if (request.filter || !resolveCache().options().enabled) {
+        request.callback = [callback = std::move(callback)](const std::optional<ResolveReply>& reply, uint32_t) { callback(reply); };
+        return start(startResolve, std::move(request), op);
+    }
+    std::string scope = scopeKey(request.scope);
+    std::string key = cacheKey({&request.serviceName, &request.regType, &request.domain, &scope});
+    return resolveCache().lookup(op, key, std::move(callback), [request = std::move(request)](const OperationPtr& op, ResultCache<ResolveReply>::Done done) {
+        ResolveRequest copy = request;
+        copy.callback = std::move(done);
+        startResolve(op, std::move(copy));
+    });
+}
+
+static Operation query(QueryRequest request, QueryCallback callback, const OperationOptions& options) {
+    count(&MetricsRegistry::queries);
+    OperationPtr op = prepare(options, request.hostName);
+    callback = dispatched(op, options.executor, measured(timed(std::move(callback)), &MetricsRegistry::queryLatency));
+    arm(op, options, true, [callback] { callback(std::nullopt); });
+    if (!queryCache().options().enabled) {
+        request.callback = [callback = std::move(callback)](const std::optional<IPAddress>& address, uint32_t) { callback(address); };
+        return start(startQuery, std::move(request), op);
+    }
+    std::string rrtype = request.family == IPv6 ? "AAAA" : "A";
+    std::string key = cacheKey({&request.hostName, &rrtype});
+    return queryCache().lookup(op, key, std::move(callback), [request = std::move(request)](const OperationPtr& op, ResultCache<IPAddress>::Done done) {
+        QueryRequest copy = request;
+        copy.callback = std::move(done);
+        startQuery(op, std::move(copy));
+    });
+}
+
+/// Happy Eyeballs selection of the first address on top of the streamed
+/// answers; reactor thread only.
+class AddressRace {
+public:
+    AddressRace(OperationPtr op, AddressHandlers handlers) : op_(std::move(op)), handlers_(std::move(handlers)) {}
+
+    void onAddress(const IPAddress& address) {
+        if (!op_->active()) {
+            return;
+        }
+        if (handlers_.onAddress) {
+            handlers_.onAddress(address);
+        }
+        if (first_ || !op_->active()) {
+            return;
+        }
+        if (address.family == IPv6) {
+            deliverFirst(address);
+        } else if (!pending_) {
+            pending_ = address;
+            if (done_[IPv6]) {
+                deliverFirst(address);
+            } else {
+                delay_ = op_->reactor().addTimer(Reactor::Clock::now() + handlers_.resolutionDelay, [this] {
+                    delay_ = 0;
+                    deliverFirst(*pending_);
+                });
+            }
+        }
+    }
+
+    void familyDone(IPFamily family) {
+        if (!op_->active() || done_[family]) {
+            return;
+        }
+        done_[family] = true;
+        // no IPv6 answer is coming, there is no reason to wait any longer
+        if (family == IPv6 && pending_ && !first_) {
+            deliverFirst(*pending_);
+        }
+        if (done_[IPv4] && done_[IPv6] && op_->active()) {
+            if (handlers_.onComplete) {
+                handlers_.onComplete();
+            }
+            op_->complete(Status::Ok);
+        }
+    }
+
+    /// called by the operation teardown
+    void stop() {
+        if (delay_) {
+            op_->reactor().removeTimer(delay_);
+            delay_ = 0;
+        }
+    }
+
+private:
+    void deliverFirst(const IPAddress& address) {
+        first_ = true;
+        stop();
+        if (handlers_.onFirstUsable && op_->active()) {
+            handlers_.onFirstUsable(address);
+        }
+    }
+
+    OperationPtr op_;
+    AddressHandlers handlers_;
+    std::optional<IPAddress> pending_;
+    Reactor::Id delay_ = 0;
+    bool first_ = false;
+    bool done_[2] = {false, false};
+};
+
+static Operation resolveAddresses(std::string hostName, AddressHandlers handlers, const OperationOptions& options) {
+    OperationPtr op = create(options, hostName, true);
+    handlers.onAddress = dispatched(op, options.executor, timed(std::move(handlers.onAddress)));
+    handlers.onFirstUsable = dispatched(op, options.executor, timed(std::move(handlers.onFirstUsable)));
+    handlers.onComplete = dispatched(op, options.executor, timed(std::move(handlers.onComplete)));
+    op->reactor().post([op, hostName = std::move(hostName), handlers = std::move(handlers)]() mutable {
+        if (!op->active()) {
+            return;
+        }
+        auto race = std::make_shared<AddressRace>(op, std::move(handlers));
+        // the race refers back to the operation, the finish hook breaks that cycle
+        op->onFinish([race] { race->stop(); });
+        startAddresses(op, AddressRequest{
+            std::move(hostName),
+            [race](const IPAddress& address) { race->onAddress(address); },
+            [race](IPFamily family) { race->familyDone(family); }
+        });
+    });
+    return Operation(op);
+}
+
+/// the entry of key; keys are compared case-insensitively, like TxtRecord::get does
+static std::optional<TxtRecord::Entry> txtEntry(const TxtRecord& txt, std::string_view key) {
+    for (const TxtRecord::Entry& entry : txt) {
+        if (std::equal(entry.key.begin(), entry.key.end(), key.begin(), key.end(), [](char a, char b) {
+                return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+            })) {
+            return entry;
+        }
+    }
+    return std::nullopt;
+}
+
+/// Turns the full replies of a watching resolve into updates that carry
+/// only what changed since the previous one; reactor thread only.
+class ServiceWatch {
+public:
+    explicit ServiceWatch(ServiceUpdateCallback callback) : callback_(std::move(callback)) {}
+
+    void apply(const ResolveReply& reply) {
+        ServiceUpdate update;
+        if (reply.hostName && (!last_ || last_->hostName != reply.hostName)) {
+            update.hostName = reply.hostName;
+        }
+        if (reply.ip && (!last_ || last_->ip != reply.ip)) {
+            update.ip = reply.ip;
+        } else if (!reply.ip && last_ && last_->ip) {
+            update.ipRemoved = true;
+        }
+        if (!last_ || last_->port != reply.port) {
+            update.port = reply.port;
+        }
+        if (!last_ || last_->txt != reply.txt) {
+            for (const TxtRecord::Entry& entry : reply.txt) {
+                std::optional<TxtRecord::Entry> previous = last_ ? txtEntry(last_->txt, entry.key) : std::nullopt;
+                if (previous && previous->value == entry.value) {
+                    continue;
+                }
+                if (entry.value) {
+                    update.txt.set(entry.key, *entry.value);
+                } else {
+                    update.txt.set(entry.key);
+                }
+            }
+            if (last_) {
+                for (const TxtRecord::Entry& entry : last_->txt) {
+                    if (!txtEntry(reply.txt, entry.key)) {
+                        update.txtRemoved.emplace_back(entry.key);
+                    }
+                }
+            }
+        }
+        bool first = !last_;
+        last_ = reply;
+        // daemons may repeat an unchanged answer, on another interface for example
+        if (first || update.hostName || update.ip || update.ipRemoved || update.port || !update.txt.empty() || !update.txtRemoved.empty()) {
+            callback_(update);
+        }
+    }
+
+private:
+    ServiceUpdateCallback callback_;
+    std::optional<ResolveReply> last_;
+};
+
+static Operation watchService(ResolveRequest request, ServiceUpdateCallback callback, const OperationOptions& options) {
+    OperationPtr op = create(options, request.serviceName);
+    request.scope = options.scope;
+    request.watch = true;
+    auto watch = std::make_shared<ServiceWatch>(dispatched(op, options.executor, timed(std::move(callback))));
+    request.callback = [watch](const std::optional<ResolveReply>& reply, uint32_t) {
+        // std::nullopt comes with the failure that completes the operation
+        if (reply) {
+            watch->apply(*reply);
+        }
+    };
+    return start(startResolve, std::move(request), op);
+}
+
+static Operation browse(BrowseRequest request, BrowseCallback callback, const OperationOptions& options) {
+    OperationPtr op = create(options, request.regType);
+    callback = dispatched(op, options.executor, timed(std::move(callback)));
+    request.scope = options.scope;
+    if (options.deduplicate) {
+        auto dedup = std::make_shared<BrowseDedup>(op, std::move(callback));
+        callback = [dedup](const BrowseReply& reply) { dedup->apply(reply); };
+        request.allForNow = [dedup] { dedup->allForNow(); };
+        request.reset = [dedup] { dedup->reset(); };
+    }
+    request.callback = counted(std::move(callback));
+    return start(startBrowse, std::move(request), op);
+}
+
+static BrowseCallback addedOnly(BrowseCallbackRef callback) {
+    return [callback](const BrowseReply& reply) {
+        if (reply.event == ServiceAdded) {
+            callback(reply);
+        }
+    };
+}
+
+/// std::function around a FunctionRef, small enough to be stored without
+/// allocating; only for operations that finish before the referenced callable
+template<typename R, typename... Args>
+static Fn<R(Args...)> borrowed(FunctionRef<R(Args...)> callback) {
+    return [callback](Args... args) -> R { return callback(std::forward<Args>(args)...); };
+}
+
+/// The blocking functions wait for the event loops; on one of their threads,
+/// from inside a callback, they would wait for work only that thread can do.
+static bool onLoopThread(const char* function) {
+    for (const auto& shard : shards()) {
+        if (shard->reactor.isLoopThread()) {
+            KNOTDNSSD_LOG_ERROR("%s called from a library callback, use the asynchronous variant there", function);
+            return true;
+        }
+    }
+    return false;
+}
+
+static Status waitUntilDone(const Operation& op) {
+    op.wait();
+    return op.status().value_or(Status::Cancelled);
+}
+
+static Status waitUntilCancelled(Operation& op, const CancellationToken& token) {
+    op.bind(token);
+    return waitUntilDone(op);
+}
+
+static void waitUntilStopped(Operation& op, const Fn<bool()>& isStopped) {
+    while (!isStopped()) {
+        if (op.waitFor(std::chrono::milliseconds(100))) {
+            return;
+        }
+    }
+    op.cancel();
+    op.wait();
+}
+
+}
+
+CancellationToken::CancellationToken() : state_(std::make_shared<detail::CancellationState>()) {
+}
+
+void CancellationToken::cancel() {
+    state_->cancel();
+}
+
+bool CancellationToken::cancelled() const {
+    return state_->cancelled();
+}
+
+std::chrono::steady_clock::duration CancellationToken::teardownLatency() const {
+    return state_->teardownLatency();
+}
+
+Operation::Operation(std::shared_ptr<detail::OperationState> state) noexcept : state_(std::move(state)) {
+}
+
+Operation& Operation::operator=(Operation&& other) noexcept {
+    if (this != &other) {
+        cancel();
+        state_ = std::move(other.state_);
+    }
+    return *this;
+}
+
+Operation::~Operation() {
+    cancel();
+}
+
+void Operation::cancel() {
+    if (state_) {
+        state_->abandon();
+    }
+}
+
+void Operation::bind(const CancellationToken& token) {
+    if (state_) {
+        detail::bindCancellation(state_, token.state_);
+    }
+}
+
+void Operation::detach() noexcept {
+    state_.reset();
+}
+
+bool Operation::done() const {
+    return !state_ || state_->finished();
+}
+
+void Operation::wait() const {
+    if (state_) {
+        state_->wait();
+    }
+}
+
+bool Operation::waitFor(std::chrono::milliseconds timeout) const {
+    return !state_ || state_->waitFor(timeout);
+}
+
+std::optional<Status> Operation::status() const {
+    if (!state_ || !state_->finished()) {
+        return std::nullopt;
+    }
+    return state_->status();
+}
+
+void setCacheOptions(const CacheOptions& options) {
+    detail::resolveCache().setOptions(options);
+    detail::queryCache().setOptions(options);
+}
+
+void clearCache() {
+    detail::resolveCache().clear();
+    detail::queryCache().clear();
+}
+
+void setDefaultTimeout(std::chrono::milliseconds timeout) {
+    detail::defaultTimeoutMs.store(timeout.count(), std::memory_order_relaxed);
+}
+
+void setShardCount(unsigned count) {
+    detail::shardCount.store(count, std::memory_order_relaxed);
+}
+
+std::vector<ShardStats> shardStats() {
+    std::vector<ShardStats> stats;
+    for (const auto& shard : detail::shards()) {
+        ShardStats shardStats;
+        shardStats.operations = shard->operations.load(std::memory_order_relaxed);
+        shardStats.dispatches = shard->reactor.dispatches();
+        shardStats.busy = std::chrono::duration_cast<std::chrono::microseconds>(shard->reactor.busy());
+        shardStats.queued = shard->reactor.queued();
+        stats.push_back(shardStats);
+    }
+    return stats;
+}
+
+Registration::Registration(std::shared_ptr<detail::OperationState> state, std::shared_ptr<detail::RegistrationState> registration) noexcept
+        : Operation(std::move(state)), registration_(std::move(registration)) {
+}
+
+void Registration::updateTxt(const TxtRecord& txt, size_t index) {
+    if (!state_) {
+        return;
+    }
+    // posted after the start of the registration, so the backend has installed its updater
+    state_->reactor().post([op = state_, registration = registration_, txt, index] {
+        if (op->active() && registration->updateTxt) {
+            registration->updateTxt(index, txt);
+        }
+    });
+}
+
+Registration registerServiceAsync(const char* serviceName, const char* regType, const char* domain, uint16_t port, const TxtRecord& txt, const OperationOptions& options) {
+    ServiceRegistration service;
+    service.serviceName = detail::toString(serviceName);
+    service.regType = detail::toString(regType);
+    service.domain = detail::toString(domain);
+    service.port = port;
+    service.txt = txt;
+    std::vector<ServiceRegistration> services;
+    services.push_back(std::move(service));
+    return registerServicesAsync(std::move(services), options);
+}
+
+Registration registerServicesAsync(std::vector<ServiceRegistration> services, const OperationOptions& options) {
+    auto registration = std::make_shared<detail::RegistrationState>();
+    detail::OperationPtr op = detail::create(options, services.empty() ? std::string_view() : std::string_view(services.front().regType));
+    op->reactor().post([op, request = detail::RegisterRequest{std::move(services), registration, options.scope}]() mutable {
+        if (op->active()) {
+            detail::startRegister(op, std::move(request));
+        }
+    });
+    return Registration(std::move(op), std::move(registration));
+}
+
+Operation browseServicesAsync(const char* regType, const char* domain, BrowseCallback callback, const OperationOptions& options) {
+    detail::BrowseRequest request;
+    request.regType = detail::toString(regType);
+    request.domain = detail::toString(domain);
+    return detail::browse(std::move(request), std::move(callback), options);
+}
+
+Operation browseSubtypeAsync(const char* regType, const char* subtype, const char* domain, BrowseCallback callback, const OperationOptions& options) {
+    detail::BrowseRequest request;
+    request.regType = detail::toString(regType);
+    request.domain = detail::toString(domain);
+    request.subtype = detail::toString(subtype);
+    return detail::browse(std::move(request), std::move(callback), options);
+}
+
+Operation resolveServiceAsync(const char* serviceName, const char* regType, const char* domain, ResolveCallback callback, const OperationOptions& options) {
+    detail::ResolveRequest request;
+    request.serviceName = detail::toString(serviceName);
+    request.regType = detail::toString(regType);
+    request.domain = detail::toString(domain);
+    return detail::resolve(std::move(request), std::move(callback), options);
+}
+
+Operation resolveServiceAsync(const char* serviceName, const char* regType, const char* domain, TxtPredicate match, ResolveCallback callback, const OperationOptions& options) {
+    detail::ResolveRequest request;
+    request.serviceName = detail::toString(serviceName);
+    request.regType = detail::toString(regType);
+    request.domain = detail::toString(domain);
+    request.filter = std::move(match);
+    return detail::resolve(std::move(request), std::move(callback), options);
+}
+
+Operation watchServiceAsync(const char* serviceName, const char* regType, const char* domain, ServiceUpdateCallback callback, const OperationOptions& options) {
+    detail::ResolveRequest request;
+    request.serviceName = detail::toString(serviceName);
+    request.regType = detail::toString(regType);
+    request.domain = detail::toString(domain);
+    return detail::watchService(std::move(request), std::move(callback), options);
+}
+
+Operation queryIPv6AddressAsync(const char* hostName, QueryCallback callback, const OperationOptions& options) {
+    return detail::query(detail::QueryRequest{detail::toString(hostName), IPv6, nullptr}, std::move(callback), options);
+}
+
+Operation queryIPv4AddressAsync(const char* hostName, QueryCallback callback, const OperationOptions& options) {
+    return detail::query(detail::QueryRequest{detail::toString(hostName), IPv4, nullptr}, std::move(callback), options);
+}
+
+Operation resolveAddressesAsync(const char* hostName, AddressHandlers handlers, const OperationOptions& options) {
+    return detail::resolveAddresses(detail::toString(hostName), std::move(handlers), options);
+}
+
+void registerService(const char* serviceName, const char* regType, const char* domain, uint16_t port, const TxtRecord& txt, const Fn<bool()>& isStopped) {
+    if (detail::onLoopThread("registerService")) {
+        return;
+    }
+    Operation op = registerServiceAsync(serviceName, regType, domain, port, txt);
+    detail::waitUntilStopped(op, isStopped);
+}
+
+void registerService(const char* serviceName, const char* regType, const char* domain, uint16_t port, const TxtRecord& txt, const CancellationToken& token) {
+    if (detail::onLoopThread("registerService")) {
+        return;
+    }
+    Operation op = registerServiceAsync(serviceName, regType, domain, port, txt);
+    detail::waitUntilCancelled(op, token);
+}
+
+void browseServices(const char* regType, const char* domain, BrowseCallbackRef callback, const Fn<bool()>& isStopped) {
+    if (detail::onLoopThread("browseServices")) {
+        return;
+    }
+    Operation op = browseServicesAsync(regType, domain, detail::addedOnly(callback));
+    detail::waitUntilStopped(op, isStopped);
+}
+
+void browseServices(const char* regType, const char* domain, BrowseCallbackRef callback, const CancellationToken& token) {
+    if (detail::onLoopThread("browseServices")) {
+        return;
+    }
+    Operation op = browseServicesAsync(regType, domain, detail::addedOnly(callback));
+    detail::waitUntilCancelled(op, token);
+}
+
+Status resolveService(const char* serviceName, const char* regType, const char* domain, ResolveCallbackRef callback) {
+    if (detail::onLoopThread("resolveService")) {
+        return Status::Failed;
+    }
+    return detail::waitUntilDone(resolveServiceAsync(serviceName, regType, domain, detail::borrowed(callback)));
+}
+
+Status resolveService(const char* serviceName, const char* regType, const char* domain, ResolveCallbackRef callback, const CancellationToken& token) {
+    if (detail::onLoopThread("resolveService")) {
+        return Status::Failed;
+    }
+    Operation op = resolveServiceAsync(serviceName, regType, domain, detail::borrowed(callback));
+    return detail::waitUntilCancelled(op, token);
+}
+
+Status queryIPv6Address(const char* hostName, QueryCallbackRef callback) {
+    if (detail::onLoopThread("queryIPv6Address")) {
+        return Status::Failed;
+    }
+    return detail::waitUntilDone(queryIPv6AddressAsync(hostName, detail::borrowed(callback)));
+}
+
+Status queryIPv6Address(const char* hostName, QueryCallbackRef callback, const CancellationToken& token) {
+    if (detail::onLoopThread("queryIPv6Address")) {
+        return Status::Failed;
+    }
+    Operation op = queryIPv6AddressAsync(hostName, detail::borrowed(callback));
+    return detail::waitUntilCancelled(op, token);
+}
+
+Status queryIPv4Address(const char* hostName, QueryCallbackRef callback) {
+    if (detail::onLoopThread("queryIPv4Address")) {
+        return Status::Failed;
+    }
+    return detail::waitUntilDone(queryIPv4AddressAsync(hostName, detail::borrowed(callback)));
+}
+
+Status queryIPv4Address(const char* hostName, QueryCallbackRef callback, const CancellationToken& token) {
+    if (detail::onLoopThread("queryIPv4Address")) {
+        return Status::Failed;
+    }
+    Operation op = queryIPv4AddressAsync(hostName, detail::borrowed(callback));
+    return detail::waitUntilCancelled(op, token);
+}
+
+Status resolveAddresses(const char* hostName, const AddressHandlers& handlers) {
+    if (detail::onLoopThread("resolveAddresses")) {
+        return Status::Failed;
+    }
+    return detail::waitUntilDone(resolveAddressesAsync(hostName, handlers));
+}
+
+Status resolveAddresses(const char* hostName, const AddressHandlers& handlers, const CancellationToken& token) {
+    if (detail::onLoopThread("resolveAddresses")) {
+        return Status::Failed;
+    }
+    Operation op = resolveAddressesAsync(hostName, handlers);
+    return detail::waitUntilCancelled(op, token);
+}
+
+}
@@ -0,0 +1,217 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#include "knot/dnssd.h"
+#include "executor.h"
+
+#include <chrono>
+
+namespace knot {
+
+namespace detail {
+
+void ExecutorState::start() {
+    if (options_.schedule) {
+        return;
+    }
+    // the thread keeps the state alive in case it gets detached by close()
+    thread_ = std::thread([self = shared_from_this()] {
+        std::unique_lock<std::mutex> lock(self->mutex_);
+        for (;;) {
+            self->wake_.wait(lock, [&self] { return self->woken_ || self->stopping_; });
+            bool stopping = self->stopping_;
+            self->woken_ = false;
+            lock.unlock();
+            self->drain();
+            lock.lock();
+            if (stopping && !self->woken_) {
+                return;
+            }
+        }
+    });
+}
+
+void ExecutorState::close() {
+    closed_.store(true, std::memory_order_seq_cst);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    room_.notify_all();
+    if (!thread_.joinable()) {
+        return;
+    }
+    // destroyed from one of its own callbacks: the thread finishes on its own
+    if (thread_.get_id() == std::this_thread::get_id()) {
+        thread_.detach();
+    } else {
+        thread_.join();
+    }
+}
+
+void ExecutorState::dispatch(ExecutorTask task) {
+    if (closed_.load(std::memory_order_acquire)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // once callbacks overflow, later ones queue up behind them to keep the order
+    if (overflowCount_.load(std::memory_order_seq_cst) == 0 && queue_.tryPush(task)) {
+        requestDrain();
+        return;
+    }
+    if (options_.overflow == OverflowPolicy::Drop) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (options_.overflow == OverflowPolicy::Block) {
+        waitForRoom(lock, task);
+        return;
+    }
+    if (overflow_.empty() && queue_.tryPush(task)) {
+        lock.unlock();
+        requestDrain();
+        return;
+    }
+    if (coalesce(task)) {
+        dropped_.fetch_add(2, std::memory_order_relaxed);
+        return;
+    }
+    waiters_.fetch_add(1, std::memory_order_seq_cst);
+    while (overflow_.size() >= queue_.capacity() && !closed_.load(std::memory_order_acquire)) {
+        lock.unlock();
+        requestDrain();
+        lock.lock();
+        room_.wait_for(lock, std::chrono::milliseconds(1));
+    }
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+    if (closed_.load(std::memory_order_acquire)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    overflow_.push_back(std::move(task));
+    overflowCount_.store(overflow_.size(), std::memory_order_seq_cst);
+    lock.unlock();
+    requestDrain();
+}
+
+void ExecutorState::waitForRoom(std::unique_lock<std::mutex>& lock, ExecutorTask& task) {
+    waiters_.fetch_add(1, std::memory_order_seq_cst);
+    bool pushed = false;
+    while (!closed_.load(std::memory_order_acquire)) {
+        if (queue_.tryPush(task)) {
+            pushed = true;
+            break;
+        }
+        lock.unlock();
+        requestDrain();
+        lock.lock();
+        // a missed notification costs a millisecond at most
+        room_.wait_for(lock, std::chrono::milliseconds(1));
+    }
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+    lock.unlock();
+    if (pushed) {
+        requestDrain();
+    } else {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool ExecutorState::coalesce(const ExecutorTask& task) {
+    if (task.event < 0) {
+        return false;
+    }
+    for (auto it = overflow_.rbegin(); it != overflow_.rend(); ++it) {
+        if (it->key != task.key) {
+            continue;
+        }
+        // the instance appeared and vanished before anyone saw it
+        if (it->event == ServiceAdded && task.event == ServiceRemoved) {
+            overflow_.erase(std::next(it).base());
+            overflowCount_.store(overflow_.size(), std::memory_order_seq_cst);
+            return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+void ExecutorState::requestDrain() {
+    if (scheduled_.exchange(true, std::memory_order_seq_cst)) {
+        return;
+    }
+    if (options_.schedule) {
+        options_.schedule([self = shared_from_this()] { self->drain(); });
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        woken_ = true;
+    }
+    wake_.notify_one();
+}
+
+bool ExecutorState::pop(ExecutorTask& task) {
+    if (!queue_.tryPop(task)) {
+        return false;
+    }
+    if (overflowCount_.load(std::memory_order_seq_cst) > 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (!overflow_.empty() && queue_.tryPush(overflow_.front())) {
+            overflow_.pop_front();
+        }
+        overflowCount_.store(overflow_.size(), std::memory_order_seq_cst);
+    }
+    if (waiters_.load(std::memory_order_seq_cst) > 0) {
+        room_.notify_all();
+    }
+    return true;
+}
+
+void ExecutorState::drain() {
+    for (;;) {
+        // bounded, so a caller supplied executor gets its thread back now and then
+        ExecutorTask task;
+        for (size_t i = 0; i < queue_.capacity() && pop(task); ++i) {
+            task.run();
+            task = ExecutorTask();
+        }
+        scheduled_.store(false, std::memory_order_seq_cst);
+        if (pending() == 0 || scheduled_.exchange(true, std::memory_order_seq_cst)) {
+            return;
+        }
+        if (options_.schedule) {
+            options_.schedule([self = shared_from_this()] { self->drain(); });
+            return;
+        }
+    }
+}
+
+}
+
+CallbackExecutor::CallbackExecutor() : CallbackExecutor(ExecutorOptions()) {
+}
+
+CallbackExecutor::CallbackExecutor(ExecutorOptions options) : state_(std::make_shared<detail::ExecutorState>(std::move(options))) {
+    state_->start();
+}
+
+CallbackExecutor::~CallbackExecutor() {
+    state_->close();
+}
+
+uint64_t CallbackExecutor::dropped() const {
+    return state_->dropped();
+}
+
+size_t CallbackExecutor::pending() const {
+    return state_->pending();
+}
+
+}
@@ -0,0 +1,167 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_EXECUTOR_H
+#define KNOTDNSSD_EXECUTOR_H
+
+#include "knot/dnssd.h"
+#include "operation.h"
+#include "queue.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace knot::detail {
+
+struct ExecutorTask {
+    Fn<void()> run;
+    /// browse events only, and only under the Coalesce policy: operation and instance
+    std::string key;
+    int event = -1;
+};
+
+/// Shared state behind knot::CallbackExecutor. Producers are event loop
+/// threads; the drain that consumes the queue runs on the library thread or
+/// wherever ExecutorOptions::schedule puts it, never twice at once.
+class ExecutorState : public std::enable_shared_from_this<ExecutorState> {
+public:
+    explicit ExecutorState(ExecutorOptions options) : options_(std::move(options)), queue_(options_.capacity) {}
+
+    static std::shared_ptr<ExecutorState> of(const CallbackExecutor& executor) { return executor.state_; }
+
+    bool coalescing() const { return options_.overflow == OverflowPolicy::Coalesce; }
+
+    /// starts the library thread unless the caller schedules drains
+    void start();
+    /// runs what is queued, then drops everything dispatched afterwards
+    void close();
+
+    void dispatch(ExecutorTask task);
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+    size_t pending() const { return queue_.size() + overflowCount_.load(std::memory_order_relaxed); }
+
+private:
+    void requestDrain();
+    void drain();
+    /// consumer side; refills the queue from the overflow list as room frees up
+    bool pop(ExecutorTask& task);
+    /// mutex_ held; whether task cancelled out against a waiting one
+    bool coalesce(const ExecutorTask& task);
+    void waitForRoom(std::unique_lock<std::mutex>& lock, ExecutorTask& task);
+
+    ExecutorOptions options_;
+    BoundedQueue<ExecutorTask> queue_;
+    std::atomic<bool> scheduled_{false};
+    std::atomic<bool> closed_{false};
+    std::atomic<uint64_t> dropped_{0};
+
+    // slow path: producers waiting for room and the Coalesce overflow list
+    std::mutex mutex_;
+    std::condition_variable room_;
+    std::deque<ExecutorTask> overflow_;
+    std::atomic<size_t> overflowCount_{0};
+    std::atomic<unsigned> waiters_{0};
+
+    // the library thread, if any
+    std::thread thread_;
+    std::condition_variable wake_;
+    bool woken_ = false;
+    bool stopping_ = false;
+};
+
+/// Copy of a callback argument that outlives the event loop frame it came from.
+template<typename T>
+class Stored {
+public:
+    explicit Stored(const T& value) : value_(value) {}
+    const T& get() const { return value_; }
+
+private:
+    T value_;
+};
+
+/// BrowseReply points into backend buffers, so its strings and interfaces are copied.
+template<>
+class Stored<BrowseReply> {
+public:
+    explicit Stored(const BrowseReply& reply)
+            : serviceName_(reply.serviceName), regType_(reply.regType), replyDomain_(reply.replyDomain),
+              interfaces_(reply.interfaces, reply.interfaces + reply.interfaceCount),
+              event_(reply.event), moreComing_(reply.moreComing), interfaceIndex_(reply.interfaceIndex) {}
+
+    BrowseReply get() const {
+        BrowseReply reply{serviceName_.c_str(), regType_.c_str(), replyDomain_.c_str()};
+        reply.event = event_;
+        reply.moreComing = moreComing_;
+        reply.interfaceIndex = interfaceIndex_;
+        reply.interfaces = interfaces_.data();
+        reply.interfaceCount = interfaces_.size();
+        return reply;
+    }
+
+private:
+    std::string serviceName_;
+    std::string regType_;
+    std::string replyDomain_;
+    std::vector<uint32_t> interfaces_;
+    BrowseEvent event_;
+    bool moreComing_;
+    uint32_t interfaceIndex_;
+};
+
+template<typename... Args>
+void describe(ExecutorTask&, const OperationState*, const Args&...) {
+}
+
+inline void describe(ExecutorTask& task, const OperationState* op, const BrowseReply& reply) {
+    auto id = reinterpret_cast<uintptr_t>(op);
+    task.key.assign(reinterpret_cast<const char*>(&id), sizeof(id));
+    for (const char* part : {reply.serviceName, reply.regType, reply.replyDomain}) {
+        task.key.append(part);
+        task.key.push_back('\0');
+    }
+    task.event = reply.event;
+}
+
+/// Wraps callback so every invocation is queued on executor instead of
+/// running on the event loop thread. Unless unconditional, queued calls are
+/// skipped once the caller cancelled the operation.
+template<typename... Args>
+Fn<void(Args...)> dispatched(const OperationPtr& op, const std::shared_ptr<CallbackExecutor>& executor, Fn<void(Args...)> callback, bool unconditional = false) {
+    if (!executor || !callback) {
+        return callback;
+    }
+    auto state = ExecutorState::of(*executor);
+    auto target = std::make_shared<Fn<void(Args...)>>(std::move(callback));
+    return [op, state, target, unconditional](Args... args) {
+        ExecutorTask task;
+        if (state->coalescing()) {
+            describe(task, op.get(), args...);
+        }
+        task.run = [op, target, unconditional, stored = std::make_tuple(Stored<std::decay_t<Args>>(args)...)] {
+            if (unconditional || !op->abandoned()) {
+                std::apply([&target](const auto&... values) { (*target)(values.get()...); }, stored);
+            }
+        };
+        state->dispatch(std::move(task));
+    };
+}
+
+}
+
+#endif //KNOTDNSSD_EXECUTOR_H
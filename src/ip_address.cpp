@@ -0,0 +1,80 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#include "knot/dnssd.h"
+#include "util.h"
+
+#include <cstring>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2ipdef.h>
+#else
+#include <netinet/in.h>
+#endif
+
+namespace knot {
+
+std::optional<IPAddress> IPAddress::fromBytes(const void* data, size_t size, uint32_t interfaceIndex) {
+    if (size != 4 && size != 16) {
+        return std::nullopt;
+    }
+    IPAddress address;
+    address.family = size == 16 ? IPv6 : IPv4;
+    std::memcpy(address.bytes.data(), data, size);
+    address.interfaceIndex = interfaceIndex;
+    if (address.isLinkLocal()) {
+        address.scopeId = interfaceIndex;
+    }
+    return address;
+}
+
+bool IPAddress::isLinkLocal() const {
+    if (family == IPv6) {
+        return bytes[0] == 0xfe && (bytes[1] & 0xc0) == 0x80;
+    }
+    return bytes[0] == 169 && bytes[1] == 254;
+}
+
+size_t IPAddress::toSockaddr(uint16_t port, void* storage, size_t storageSize) const {
+    if (family == IPv6) {
+        if (storageSize < sizeof(sockaddr_in6)) {
+            return 0;
+        }
+        sockaddr_in6 sa{};
+        sa.sin6_family = AF_INET6;
+        sa.sin6_port = htons(port);
+        std::memcpy(&sa.sin6_addr, bytes.data(), 16);
+        sa.sin6_scope_id = scopeId;
+        std::memcpy(storage, &sa, sizeof(sa));
+        return sizeof(sa);
+    }
+    if (storageSize < sizeof(sockaddr_in)) {
+        return 0;
+    }
+    sockaddr_in sa{};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    std::memcpy(&sa.sin_addr, bytes.data(), 4);
+    std::memcpy(storage, &sa, sizeof(sa));
+    return sizeof(sa);
+}
+
+std::string IPAddress::toString() const {
+    char buffer[KNOTDNSSD_INET_ADDRSTRLEN];
+    if (!knotdnssd_format_inet_addr(static_cast<uint16_t>(length()), bytes.data(), buffer, sizeof(buffer))) {
+        return std::string();
+    }
+    std::string result(buffer);
+    if (family == IPv6 && scopeId != 0) {
+        result.push_back('%');
+        result.append(std::to_string(scopeId));
+    }
+    return result;
+}
+
+}
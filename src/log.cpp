@@ -0,0 +1,210 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#include "knot/dnssd.h"
+#include "log.h"
+#include "metrics.h"
+#include "queue.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace knot::detail {
+
+namespace {
+
+struct LogEntry {
+    LogLevel level = LogLevel::Info;
+    uint64_t suppressed = 0;
+    /// longer messages are cut off
+    char text[480];
+};
+
+const char* levelName(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug:
+            return "debug";
+        case LogLevel::Info:
+            return "info";
+        case LogLevel::Warning:
+            return "warning";
+        case LogLevel::Error:
+            return "error";
+    }
+    return "";
+}
+
+void writeToStderr(LogLevel level, std::string_view message, uint64_t suppressed) {
+    if (suppressed > 0) {
+        fprintf(stderr, "knotdnssd: %s: %.*s (%llu similar messages suppressed)\n", levelName(level),
+                static_cast<int>(message.size()), message.data(), static_cast<unsigned long long>(suppressed));
+    } else {
+        fprintf(stderr, "knotdnssd: %s: %.*s\n", levelName(level), static_cast<int>(message.size()), message.data());
+    }
+}
+
+/// Producers are whatever thread logs; the sink runs on a thread of its own
+/// that is started by the first message, so formatting into a queue cell is
+/// all the event loop ever pays for.
+class LogState {
+public:
+    LogState() : queue_(256), sink_(std::make_shared<LogSink>(writeToStderr)) {}
+
+    bool enabled(LogLevel level) const {
+        return static_cast<uint8_t>(level) >= level_.load(std::memory_order_relaxed);
+    }
+
+    unsigned burst() const { return burst_.load(std::memory_order_relaxed); }
+    int64_t intervalMillis() const { return interval_.load(std::memory_order_relaxed); }
+
+    void configure(LogSink sink, const LogOptions& options) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sink_ = std::make_shared<LogSink>(sink ? std::move(sink) : LogSink(writeToStderr));
+        }
+        level_.store(static_cast<uint8_t>(options.level), std::memory_order_relaxed);
+        burst_.store(options.burst, std::memory_order_relaxed);
+        interval_.store(options.interval.count(), std::memory_order_relaxed);
+    }
+
+    /// false if the queue is full and the entry was dropped
+    bool push(LogEntry& entry) {
+        std::call_once(started_, [this] {
+            std::thread([this] { run(); }).detach();
+            // whatever is still queued at exit is written out by the exiting thread
+            std::atexit([] { logState().drain(); });
+        });
+        if (!queue_.tryPush(entry)) {
+            count(&MetricsRegistry::logsDropped);
+            return false;
+        }
+        if (scheduled_.exchange(true, std::memory_order_seq_cst)) {
+            return true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            woken_ = true;
+        }
+        wake_.notify_one();
+        return true;
+    }
+
+    static LogState& logState() {
+        // never destroyed, the logging thread outlives static destruction
+        static auto* instance = new LogState();
+        return *instance;
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            wake_.wait(lock, [this] { return woken_; });
+            woken_ = false;
+            lock.unlock();
+            // cleared before popping, a push after the last pop wakes the thread again
+            scheduled_.store(false, std::memory_order_seq_cst);
+            drain();
+            lock.lock();
+        }
+    }
+
+    void drain() {
+        // the queue has a single consumer, the exit handler takes turns with the thread
+        std::lock_guard<std::mutex> consumer(drainMutex_);
+        std::shared_ptr<LogSink> sink;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sink = sink_;
+        }
+        LogEntry entry;
+        while (queue_.tryPop(entry)) {
+            try {
+                (*sink)(entry.level, entry.text, entry.suppressed);
+            } catch (...) {
+                // a throwing sink must not take the logging thread down
+            }
+        }
+    }
+
+    BoundedQueue<LogEntry> queue_;
+    std::atomic<uint8_t> level_{static_cast<uint8_t>(LogLevel::Info)};
+    std::atomic<unsigned> burst_{10};
+    std::atomic<int64_t> interval_{1000};
+    std::atomic<bool> scheduled_{false};
+    std::once_flag started_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool woken_ = false;
+    std::shared_ptr<LogSink> sink_;
+
+    std::mutex drainMutex_;
+};
+
+}
+
+bool LogSite::admit(uint64_t& suppressed) {
+    const LogState& state = LogState::logState();
+    unsigned burst = state.burst();
+    if (burst > 0) {
+        int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t start = windowStart_.load(std::memory_order_relaxed);
+        // one thread wins the race to open the next interval and resets the count
+        if (now - start >= state.intervalMillis() && windowStart_.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+            inWindow_.store(0, std::memory_order_relaxed);
+        }
+        if (inWindow_.fetch_add(1, std::memory_order_relaxed) >= burst) {
+            suppressed_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    return true;
+}
+
+void LogSite::dropped(uint64_t suppressed) {
+    suppressed_.fetch_add(suppressed + 1, std::memory_order_relaxed);
+}
+
+bool logEnabled(LogLevel level) {
+    return LogState::logState().enabled(level);
+}
+
+void logMessage(LogLevel level, LogSite& site, const char* format, ...) {
+    uint64_t suppressed = 0;
+    if (!site.admit(suppressed)) {
+        count(&MetricsRegistry::logsDropped);
+        return;
+    }
+    LogEntry entry;
+    entry.level = level;
+    entry.suppressed = suppressed;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(entry.text, sizeof(entry.text), format, args);
+    va_end(args);
+    if (!LogState::logState().push(entry)) {
+        site.dropped(suppressed);
+    }
+}
+
+}
+
+namespace knot {
+
+void setLogSink(LogSink sink, const LogOptions& options) {
+    detail::LogState::logState().configure(std::move(sink), options);
+}
+
+}
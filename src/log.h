@@ -0,0 +1,69 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_LOG_H
+#define KNOTDNSSD_LOG_H
+
+#include "knot/dnssd.h"
+
+#include <atomic>
+#include <cstdint>
+
+#if defined(__GNUC__)
+#  define KNOTDNSSD_PRINTF(formatIndex, firstArg) __attribute__((format(printf, formatIndex, firstArg)))
+#else
+#  define KNOTDNSSD_PRINTF(formatIndex, firstArg)
+#endif
+
+namespace knot::detail {
+
+/// Rate limit of one place that logs, see KNOTDNSSD_LOG. Lock-free, any
+/// thread may log through it.
+class LogSite {
+public:
+    /// whether another message fits into the current interval; if so,
+    /// suppressed takes the count of the ones dropped before it
+    bool admit(uint64_t& suppressed);
+    /// an admitted message was lost after all; the count admit handed out and
+    /// the message itself are reported with the next one instead
+    void dropped(uint64_t suppressed);
+
+private:
+    std::atomic<int64_t> windowStart_{INT64_MIN / 2};
+    std::atomic<unsigned> inWindow_{0};
+    std::atomic<uint64_t> suppressed_{0};
+};
+
+/// one relaxed load, checked before any argument is evaluated
+bool logEnabled(LogLevel level);
+
+/// formats the message and queues it for the logging thread; never blocks
+void logMessage(LogLevel level, LogSite& site, const char* format, ...) KNOTDNSSD_PRINTF(3, 4);
+
+}
+
+/// printf-style; every expansion has its own rate limit
+#define KNOTDNSSD_LOG(level, ...) \
+    do { \
+        static ::knot::detail::LogSite knotdnssd_log_site; \
+        if (::knot::detail::logEnabled(::knot::LogLevel::level)) { \
+            ::knot::detail::logMessage(::knot::LogLevel::level, knotdnssd_log_site, __VA_ARGS__); \
+        } \
+    } while (false)
+
+#define KNOTDNSSD_LOG_ERROR(...) KNOTDNSSD_LOG(Error, __VA_ARGS__)
+#define KNOTDNSSD_LOG_WARNING(...) KNOTDNSSD_LOG(Warning, __VA_ARGS__)
+#define KNOTDNSSD_LOG_INFO(...) KNOTDNSSD_LOG(Info, __VA_ARGS__)
+
+// per-event tracing; without the build option the arguments are not even compiled
+#if defined(KNOTDNSSD_DEBUG_LOG)
+#  define KNOTDNSSD_LOG_DEBUG(...) KNOTDNSSD_LOG(Debug, __VA_ARGS__)
+#else
+#  define KNOTDNSSD_LOG_DEBUG(...) do {} while (false)
+#endif
+
+#endif //KNOTDNSSD_LOG_H
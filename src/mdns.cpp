@@ -0,0 +1,1786 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#if defined(USE_MDNS)
+
+#if defined(__APPLE__)
+// IPV6_RECVPKTINFO and in6_pktinfo
+#define __APPLE_USE_RFC_3542
+#endif
+
+#include "knot/dnssd.h"
+#include "backend.h"
+#include "log.h"
+#include "mdns_message.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using knot::detail::Reactor;
+
+// Built-in mDNS responder and querier, RFC 6762 and RFC 6763, speaking UDP
+// multicast directly instead of going through a system daemon.
+//
+// The responder probes and announces the names it owns, answers queries with
+// known-answer suppression and sends goodbyes on withdrawal. The querier keeps
+// a record cache that operations subscribe to; questions are repeated with
+// exponential backoff and carry the cached answers, and cached records are
+// refreshed before they expire. Everything runs on the reactor thread.
+
+namespace knot {
+
+using namespace detail::mdns;
+using Clock = Reactor::Clock;
+
+static const char* const kDefaultDomain = "local.";
+static const char* const kServicesName = "_services._dns-sd._udp";
+/// comma separated interface names; unset uses every multicast capable interface
+static const char* const kInterfacesVariable = "KNOTDNSSD_MDNS_INTERFACES";
+
+constexpr uint16_t kMdnsPort = 5353;
+/// TTL of records that do not carry a host name, see RFC 6762, section 10
+constexpr uint32_t kServiceRecordTtl = 4500;
+/// cap for answers to legacy unicast queries, see RFC 6762, section 6.7
+constexpr uint32_t kLegacyUnicastTtl = 10;
+
+constexpr int kProbeCount = 3;
+constexpr std::chrono::milliseconds kProbeInterval(250);
+constexpr int kAnnounceCount = 2;
+constexpr std::chrono::seconds kAnnounceInterval(1);
+/// a lost simultaneous probe tie-break waits this long before probing again
+constexpr std::chrono::seconds kProbeDefer(1);
+constexpr std::chrono::seconds kFirstQueryInterval(1);
+constexpr std::chrono::minutes kMaxQueryInterval(60);
+/// goodbyes and flushed records linger this long, see RFC 6762, section 10.1
+constexpr std::chrono::seconds kGraceTime(1);
+/// how long a browse waits for answers to its first query before reporting all for now
+constexpr std::chrono::seconds kAllForNowDelay(1);
+
+struct Interface {
+    uint32_t index = 0;
+    std::string name;
+    std::vector<IPAddress> addresses;
+    /// indexed by IPFamily, false once the family failed to join or to send
+    bool enabled[2] = {false, false};
+    /// shared answers wait 20-120 ms so they can be aggregated, see RFC 6762, section 6
+    std::vector<Record> pending[2];
+    std::unordered_set<std::string> pendingKeys[2];
+    Reactor::Id pendingTimer[2] = {0, 0};
+};
+
+/// A name the responder owns: the host name or a service instance.
+struct Claim {
+    enum State { Probing, Announcing, Established };
+
+    bool host = false;
+    Name name;
+    State state = Probing;
+    /// probes or announcements sent in the current state
+    int sent = 0;
+    Clock::time_point due;
+
+    /// label asked for and the one in use after conflicts
+    std::string requested;
+    std::string label;
+    unsigned suffix = 1;
+
+    // services only
+    Name type;
+    Name domain;
+    uint16_t port = 0;
+    TxtRecord txt;
+    /// "_printer._sub._http._tcp.local." and so on, each listing the instance
+    std::vector<Name> subtypes;
+    /// the only interface the service is announced on, 0 for all of them
+    uint32_t interfaceIndex = 0;
+};
+
+/// Subscription of an operation to the cached records of one name and type.
+struct CachedRecord;
+struct Interest {
+    Name name;
+    uint16_t type = 0;
+    Fn<void(const CachedRecord& cached, bool added)> onRecord;
+};
+
+struct CachedRecord {
+    Record record;
+    uint32_t interfaceIndex = 0;
+    Clock::time_point received;
+    Clock::time_point expires;
+    /// refresh queries go out at 80, 85, 90 and 95 % of the TTL, see RFC 6762, section 5.2
+    int refreshes = 0;
+
+    uint32_t remainingTtl(Clock::time_point now) const {
+        return expires > now ? static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(expires - now).count()) : 0;
+    }
+};
+
+struct OutgoingQuestion {
+    Question question;
+    Clock::time_point due;
+    Clock::duration interval = kFirstQueryInterval;
+    size_t users = 0;
+};
+
+/// Known answers of a truncated query, collected until the querier has sent all of them.
+struct DeferredQuery {
+    Interface* interface = nullptr;
+    sockaddr_storage source{};
+    socklen_t sourceLength = 0;
+    Message message;
+    Reactor::Id timer = 0;
+};
+
+static std::string label_of(const char* hostName) {
+    std::string label = hostName;
+    label = label.substr(0, label.find('.'));
+    if (label.size() > 63) {
+        label.resize(63);
+    }
+    return label.empty() ? std::string("knotdnssd") : label;
+}
+
+static uint16_t port_of(const sockaddr_storage& address) {
+    if (address.ss_family == AF_INET6) {
+        return ntohs(reinterpret_cast<const sockaddr_in6&>(address).sin6_port);
+    }
+    return ntohs(reinterpret_cast<const sockaddr_in&>(address).sin_port);
+}
+
+static std::string source_key(const sockaddr_storage& address, socklen_t length) {
+    return std::string(reinterpret_cast<const char*>(&address), length);
+}
+
+static bool type_matches(uint16_t queried, uint16_t type) {
+    return queried == TypeANY || queried == type;
+}
+
+/// lists the service types of a domain, see RFC 6763, section 9
+static Name enumeration_name(const Name& domain) {
+    return *Name::parse(kServicesName)->append(domain);
+}
+
+static std::string data_key(const Record& record) {
+    return record.key() + record.rdata;
+}
+
+static std::vector<std::string> configured_interfaces() {
+    std::vector<std::string> names;
+    const char* value = std::getenv(kInterfacesVariable);
+    if (!value) {
+        return names;
+    }
+    std::string list = value;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t comma = std::min(list.find(',', start), list.size());
+        if (comma > start) {
+            names.push_back(list.substr(start, comma - start));
+        }
+        start = comma + 1;
+    }
+    return names;
+}
+
+/// Interfaces are enumerated once, when the engine starts. The loopback
+/// interface is only used when named explicitly or when nothing else is up.
+static std::vector<Interface> enumerate_interfaces() {
+    std::vector<std::string> wanted = configured_interfaces();
+    std::vector<Interface> interfaces;
+    std::vector<Interface> loopbacks;
+
+    ifaddrs* list = nullptr;
+    if (getifaddrs(&list) != 0) {
+        KNOTDNSSD_LOG_ERROR("Failed to enumerate network interfaces: %s", std::strerror(errno));
+        return interfaces;
+    }
+    for (ifaddrs* entry = list; entry; entry = entry->ifa_next) {
+        if (!entry->ifa_addr || !(entry->ifa_flags & IFF_UP)) {
+            continue;
+        }
+        bool loopback = (entry->ifa_flags & IFF_LOOPBACK) != 0;
+        if (wanted.empty() ? !loopback && !(entry->ifa_flags & IFF_MULTICAST) : std::find(wanted.begin(), wanted.end(), entry->ifa_name) == wanted.end()) {
+            continue;
+        }
+        uint32_t index = if_nametoindex(entry->ifa_name);
+        if (index == 0) {
+            continue;
+        }
+        std::vector<Interface>& target = loopback && wanted.empty() ? loopbacks : interfaces;
+        auto it = std::find_if(target.begin(), target.end(), [index](const Interface& interface) { return interface.index == index; });
+        if (it == target.end()) {
+            target.push_back(Interface{});
+            it = target.end() - 1;
+            it->index = index;
+            it->name = entry->ifa_name;
+        }
+
+        std::optional<IPAddress> address;
+        if (entry->ifa_addr->sa_family == AF_INET) {
+            address = IPAddress::fromBytes(&reinterpret_cast<sockaddr_in*>(entry->ifa_addr)->sin_addr, 4, index);
+        } else if (entry->ifa_addr->sa_family == AF_INET6) {
+            address = IPAddress::fromBytes(&reinterpret_cast<sockaddr_in6*>(entry->ifa_addr)->sin6_addr, 16, index);
+            // KAME stacks embed the scope of link-local addresses in bytes 2 and 3
+            if (address && address->isLinkLocal()) {
+                address->bytes[2] = 0;
+                address->bytes[3] = 0;
+            }
+        }
+        if (address) {
+            it->addresses.push_back(*address);
+        }
+    }
+    freeifaddrs(list);
+    return interfaces.empty() ? loopbacks : interfaces;
+}
+
+static int open_socket(int family) {
+    int fd = socket(family, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    int on = 1;
+    unsigned char ttl = 255;
+    unsigned char loop = 1;
+    // large enough to absorb the announcement burst of a big batch registration
+    int buffer = 1 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#if defined(SO_REUSEPORT) && !defined(__linux__)
+    // BSD derived stacks only share multicast ports between SO_REUSEPORT sockets
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+    sockaddr_storage storage{};
+    socklen_t length;
+    if (family == AF_INET6) {
+        int hops = 255;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &hops, sizeof(hops));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &on, sizeof(on));
+        auto& address = reinterpret_cast<sockaddr_in6&>(storage);
+        address.sin6_family = AF_INET6;
+        address.sin6_port = htons(kMdnsPort);
+        address.sin6_addr = in6addr_any;
+        length = sizeof(address);
+    } else {
+        int unicastTtl = 255;
+        setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        setsockopt(fd, IPPROTO_IP, IP_TTL, &unicastTtl, sizeof(unicastTtl));
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        auto& address = reinterpret_cast<sockaddr_in&>(storage);
+        address.sin_family = AF_INET;
+        address.sin_port = htons(kMdnsPort);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        length = sizeof(address);
+    }
+    if (bind(fd, reinterpret_cast<sockaddr*>(&storage), length) != 0) {
+        KNOTDNSSD_LOG_ERROR("Failed to bind mDNS socket: %s", std::strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static sockaddr_storage multicast_group(IPFamily family, uint32_t interfaceIndex, socklen_t& length) {
+    sockaddr_storage storage{};
+    if (family == IPv6) {
+        auto& address = reinterpret_cast<sockaddr_in6&>(storage);
+        address.sin6_family = AF_INET6;
+        address.sin6_port = htons(kMdnsPort);
+        inet_pton(AF_INET6, "ff02::fb", &address.sin6_addr);
+        address.sin6_scope_id = interfaceIndex;
+        length = sizeof(address);
+    } else {
+        auto& address = reinterpret_cast<sockaddr_in&>(storage);
+        address.sin_family = AF_INET;
+        address.sin_port = htons(kMdnsPort);
+        inet_pton(AF_INET, "224.0.0.251", &address.sin_addr);
+        length = sizeof(address);
+    }
+    return storage;
+}
+
+class Engine {
+public:
+    explicit Engine(Reactor& reactor) : reactor_(reactor), random_(std::random_device{}()) {}
+
+    /// opens the sockets on first use; false if no socket could be opened
+    bool start();
+
+    /// claims are owned by the caller until withdrawn
+    void publish(Claim* claim);
+    void withdraw(const std::vector<Claim*>& claims);
+    void updateTxt(Claim* claim, const TxtRecord& txt);
+
+    /// replays matching cached records right away
+    void addInterest(Interest* interest);
+    void removeInterest(Interest* interest);
+
+    std::string hostLabel() const { return host_.label; }
+    const Name& defaultDomain() const { return domain_; }
+
+private:
+    Clock::duration randomDelay(int minMs, int maxMs) {
+        return std::chrono::milliseconds(std::uniform_int_distribution<int>(minMs, maxMs)(random_));
+    }
+
+    // transport
+    void joinGroups();
+    void onReadable(int fd, IPFamily family);
+    void onPacket(Interface& interface, IPFamily family, const uint8_t* data, size_t size, const sockaddr_storage& source, socklen_t sourceLength);
+    void sendMulticast(Interface& interface, IPFamily family, const std::string& packet);
+    void sendMulticast(Interface& interface, const std::string& packet);
+    void sendUnicast(const std::string& packet, const sockaddr_storage& destination, socklen_t length);
+    Interface* findInterface(uint32_t index);
+
+    // responder
+    void uniqueRecords(const Claim& claim, const Interface& interface, std::vector<Record>& out) const;
+    void allRecords(const Claim& claim, const Interface& interface, std::vector<Record>& out) const;
+    void hostAddresses(const Interface& interface, uint16_t type, std::vector<Record>& out) const;
+    Record hostNsec(const Interface& interface) const;
+    Claim* findClaim(const Name& name);
+    static bool answerable(const Claim& claim) { return claim.state != Claim::Probing; }
+    static bool serves(const Claim& claim, const Interface& interface) { return claim.interfaceIndex == 0 || claim.interfaceIndex == interface.index; }
+    void indexClaim(Claim* claim);
+    void unindexClaim(Claim* claim);
+    void rename(Claim* claim);
+    void restartProbing(Claim* claim, Clock::duration delay);
+    void scheduleClaims();
+    void runClaims();
+    void sendProbes(const std::vector<Claim*>& claims);
+    void sendRecords(Interface& interface, IPFamily family, std::vector<Record> answers, bool additionals, const sockaddr_storage* destination = nullptr, socklen_t destinationLength = 0, const Message* legacy = nullptr);
+    void checkConflicts(const Message& message);
+    void checkProbeTieBreak(const Interface& interface, const Message& message);
+    void handleQuery(Interface& interface, IPFamily family, const Message& message, const sockaddr_storage& source, socklen_t sourceLength);
+    void answerQuery(Interface& interface, IPFamily family, const Message& message, const sockaddr_storage& source, socklen_t sourceLength);
+    void collectAnswers(const Interface& interface, const Question& question, std::vector<Record>& answers, bool& shared);
+    void collectAdditionals(const Interface& interface, const Record& answer, std::vector<Record>& out);
+    void queueMulticast(Interface& interface, IPFamily family, const std::vector<Record>& answers, Clock::duration delay);
+
+    // querier
+    void ingest(const Record& record, uint32_t interfaceIndex, Clock::time_point now);
+    void notify(const CachedRecord& cached, bool added);
+    void scheduleQueries();
+    void runQueries();
+    void scheduleSweep();
+    void sweep();
+
+    Reactor& reactor_;
+    std::mt19937 random_;
+    bool started_ = false;
+    bool failed_ = false;
+    int sockets_[2] = {-1, -1};
+    Reactor::Id watches_[2] = {0, 0};
+    std::vector<Interface> interfaces_;
+    Name domain_;
+
+    Claim host_;
+    /// claims still probing or announcing, driven by claimTimer_
+    std::unordered_set<Claim*> active_;
+    Reactor::Id claimTimer_ = 0;
+    Clock::time_point claimDue_;
+    /// services by instance name key and by service type key
+    std::unordered_map<std::string, Claim*> services_;
+    std::unordered_map<std::string, std::unordered_set<Claim*>> byType_;
+    /// services by subtype name key
+    std::unordered_map<std::string, std::unordered_set<Claim*>> bySubtype_;
+    std::map<std::string, DeferredQuery> deferred_;
+
+    std::unordered_map<std::string, std::vector<CachedRecord>> cache_;
+    std::unordered_map<std::string, std::vector<Interest*>> interests_;
+    std::unordered_map<std::string, OutgoingQuestion> questions_;
+    Reactor::Id queryTimer_ = 0;
+    Clock::time_point queryDue_;
+    Reactor::Id sweepTimer_ = 0;
+};
+
+bool Engine::start() {
+    if (started_) {
+        return !failed_;
+    }
+    started_ = true;
+    domain_ = *Name::parse(kDefaultDomain);
+    interfaces_ = enumerate_interfaces();
+    if (interfaces_.empty()) {
+        KNOTDNSSD_LOG_WARNING("No multicast capable network interface for mDNS");
+    }
+    sockets_[IPv4] = open_socket(AF_INET);
+    sockets_[IPv6] = open_socket(AF_INET6);
+    if (sockets_[IPv4] == -1 && sockets_[IPv6] == -1) {
+        failed_ = true;
+        return false;
+    }
+    joinGroups();
+    for (IPFamily family : {IPv4, IPv6}) {
+        int fd = sockets_[family];
+        if (fd != -1) {
+            watches_[family] = reactor_.addWatch(fd, Reactor::Readable, [this, fd, family](unsigned) { onReadable(fd, family); });
+        }
+    }
+
+    char hostName[256] = {};
+    gethostname(hostName, sizeof(hostName) - 1);
+    host_.host = true;
+    host_.requested = label_of(hostName);
+    host_.label = host_.requested;
+    host_.name = *domain_.prepend(host_.label);
+    publish(&host_);
+    return true;
+}
+
+void Engine::joinGroups() {
+    for (Interface& interface : interfaces_) {
+        if (sockets_[IPv4] != -1) {
+#if defined(__linux__)
+            ip_mreqn request{};
+            request.imr_ifindex = static_cast<int>(interface.index);
+#else
+            ip_mreq request{};
+            auto v4 = std::find_if(interface.addresses.begin(), interface.addresses.end(), [](const IPAddress& address) { return address.family == IPv4; });
+            if (v4 != interface.addresses.end()) {
+                std::memcpy(&request.imr_interface, v4->bytes.data(), 4);
+            }
+#endif
+            inet_pton(AF_INET, "224.0.0.251", &request.imr_multiaddr);
+            interface.enabled[IPv4] = setsockopt(sockets_[IPv4], IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) == 0 || errno == EADDRINUSE;
+        }
+        if (sockets_[IPv6] != -1) {
+            ipv6_mreq request{};
+            inet_pton(AF_INET6, "ff02::fb", &request.ipv6mr_multiaddr);
+            request.ipv6mr_interface = interface.index;
+            interface.enabled[IPv6] = setsockopt(sockets_[IPv6], IPPROTO_IPV6, IPV6_JOIN_GROUP, &request, sizeof(request)) == 0 || errno == EADDRINUSE;
+        }
+    }
+}
+
+Interface* Engine::findInterface(uint32_t index) {
+    for (Interface& interface : interfaces_) {
+        if (interface.index == index) {
+            return &interface;
+        }
+    }
+    return nullptr;
+}
+
+void Engine::onReadable(int fd, IPFamily family) {
+    uint8_t buffer[9000];
+    alignas(cmsghdr) char control[256];
+    while (true) {
+        sockaddr_storage source{};
+        iovec vector{buffer, sizeof(buffer)};
+        msghdr message{};
+        message.msg_name = &source;
+        message.msg_namelen = sizeof(source);
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t size = recvmsg(fd, &message, 0);
+        if (size < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                KNOTDNSSD_LOG_ERROR("Failed to receive mDNS packet: %s", std::strerror(errno));
+            }
+            return;
+        }
+
+        uint32_t index = 0;
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level == IPPROTO_IP && header->cmsg_type == IP_PKTINFO) {
+                in_pktinfo info{};
+                std::memcpy(&info, CMSG_DATA(header), sizeof(info));
+                index = static_cast<uint32_t>(info.ipi_ifindex);
+            } else if (header->cmsg_level == IPPROTO_IPV6 && header->cmsg_type == IPV6_PKTINFO) {
+                in6_pktinfo info{};
+                std::memcpy(&info, CMSG_DATA(header), sizeof(info));
+                index = info.ipi6_ifindex;
+            }
+        }
+        // packets of interfaces we do not serve still reach the wildcard socket
+        Interface* interface = findInterface(index);
+        if (interface && interface->enabled[family]) {
+            onPacket(*interface, family, buffer, static_cast<size_t>(size), source, message.msg_namelen);
+        }
+    }
+}
+
+void Engine::sendMulticast(Interface& interface, IPFamily family, const std::string& packet) {
+    int fd = sockets_[family];
+    if (fd == -1 || !interface.enabled[family]) {
+        return;
+    }
+    if (family == IPv6) {
+        unsigned index = interface.index;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &index, sizeof(index));
+    } else {
+#if defined(__linux__)
+        ip_mreqn request{};
+        request.imr_ifindex = static_cast<int>(interface.index);
+#else
+        in_addr request{};
+        for (const IPAddress& address : interface.addresses) {
+            if (address.family == IPv4) {
+                std::memcpy(&request, address.bytes.data(), 4);
+                break;
+            }
+        }
+#endif
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &request, sizeof(request));
+    }
+    socklen_t length;
+    sockaddr_storage group = multicast_group(family, interface.index, length);
+    if (sendto(fd, packet.data(), packet.size(), 0, reinterpret_cast<sockaddr*>(&group), length) < 0) {
+        if (errno == ENETUNREACH || errno == EADDRNOTAVAIL || errno == EHOSTUNREACH) {
+            // e.g. IPv6 on a loopback interface without a multicast route
+            interface.enabled[family] = false;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+            KNOTDNSSD_LOG_ERROR("Failed to send mDNS packet on %s: %s", interface.name.c_str(), std::strerror(errno));
+        }
+    }
+}
+
+void Engine::sendMulticast(Interface& interface, const std::string& packet) {
+    sendMulticast(interface, IPv4, packet);
+    sendMulticast(interface, IPv6, packet);
+}
+
+void Engine::sendUnicast(const std::string& packet, const sockaddr_storage& destination, socklen_t length) {
+    int fd = sockets_[destination.ss_family == AF_INET6 ? IPv6 : IPv4];
+    if (fd != -1) {
+        sendto(fd, packet.data(), packet.size(), 0, reinterpret_cast<const sockaddr*>(&destination), length);
+    }
+}
+
+void Engine::onPacket(Interface& interface, IPFamily family, const uint8_t* data, size_t size, const sockaddr_storage& source, socklen_t sourceLength) {
+    std::optional<Message> message = parseMessage(data, size);
+    if (!message) {
+        return;
+    }
+    if (message->isResponse()) {
+        // responses must come from the mDNS port, see RFC 6762, section 11
+        if (port_of(source) != kMdnsPort) {
+            return;
+        }
+        checkConflicts(*message);
+        auto now = Clock::now();
+        for (const std::vector<Record>* section : {&message->answers, &message->additionals}) {
+            for (const Record& record : *section) {
+                ingest(record, interface.index, now);
+            }
+        }
+        return;
+    }
+    if (!message->authorities.empty()) {
+        checkProbeTieBreak(interface, *message);
+    }
+    handleQuery(interface, family, *message, source, sourceLength);
+}
+
+void Engine::hostAddresses(const Interface& interface, uint16_t type, std::vector<Record>& out) const {
+    for (const IPAddress& address : interface.addresses) {
+        if (type_matches(type, address.family == IPv6 ? TypeAAAA : TypeA)) {
+            out.push_back(Record::address(host_.name, address, detail::kHostRecordTtl));
+        }
+    }
+}
+
+Record Engine::hostNsec(const Interface& interface) const {
+    bool v4 = false;
+    bool v6 = false;
+    for (const IPAddress& address : interface.addresses) {
+        (address.family == IPv6 ? v6 : v4) = true;
+    }
+    if (v4 && v6) {
+        return Record::nsec(host_.name, {TypeA, TypeAAAA}, detail::kHostRecordTtl);
+    }
+    return Record::nsec(host_.name, {v6 ? TypeAAAA : TypeA}, detail::kHostRecordTtl);
+}
+
+void Engine::uniqueRecords(const Claim& claim, const Interface& interface, std::vector<Record>& out) const {
+    if (!serves(claim, interface)) {
+        return;
+    }
+    if (claim.host) {
+        hostAddresses(interface, TypeANY, out);
+        return;
+    }
+    out.push_back(Record::srv(claim.name, claim.port, host_.name, detail::kHostRecordTtl));
+    out.push_back(Record::txt(claim.name, claim.txt, kServiceRecordTtl));
+}
+
+void Engine::allRecords(const Claim& claim, const Interface& interface, std::vector<Record>& out) const {
+    if (!serves(claim, interface)) {
+        return;
+    }
+    uniqueRecords(claim, interface, out);
+    if (claim.host) {
+        out.push_back(hostNsec(interface));
+        return;
+    }
+    for (const Name& subtype : claim.subtypes) {
+        out.push_back(Record::ptr(subtype, claim.name, kServiceRecordTtl));
+    }
+    // the enumeration record goes last, withdraw() relies on it
+    out.push_back(Record::ptr(claim.type, claim.name, kServiceRecordTtl));
+    out.push_back(Record::ptr(enumeration_name(claim.domain), claim.type, kServiceRecordTtl));
+}
+
+Claim* Engine::findClaim(const Name& name) {
+    if (name == host_.name) {
+        return &host_;
+    }
+    auto it = services_.find(name.key());
+    return it != services_.end() ? it->second : nullptr;
+}
+
+void Engine::indexClaim(Claim* claim) {
+    if (!claim->host) {
+        services_[claim->name.key()] = claim;
+        byType_[claim->type.key()].insert(claim);
+        for (const Name& subtype : claim->subtypes) {
+            bySubtype_[subtype.key()].insert(claim);
+        }
+    }
+}
+
+void Engine::unindexClaim(Claim* claim) {
+    if (claim->host) {
+        return;
+    }
+    auto it = services_.find(claim->name.key());
+    if (it != services_.end() && it->second == claim) {
+        services_.erase(it);
+    }
+    auto type = byType_.find(claim->type.key());
+    if (type != byType_.end()) {
+        type->second.erase(claim);
+        if (type->second.empty()) {
+            byType_.erase(type);
+        }
+    }
+    for (const Name& subtype : claim->subtypes) {
+        auto it = bySubtype_.find(subtype.key());
+        if (it != bySubtype_.end()) {
+            it->second.erase(claim);
+            if (it->second.empty()) {
+                bySubtype_.erase(it);
+            }
+        }
+    }
+}
+
+void Engine::publish(Claim* claim) {
+    if (!claim->host) {
+        // a name taken inside this process is renamed before anyone sees it
+        claim->name = *claim->type.prepend(claim->label);
+        while (services_.count(claim->name.key())) {
+            claim->label = claim->requested + " (" + std::to_string(++claim->suffix) + ")";
+            claim->name = *claim->type.prepend(claim->label);
+        }
+        indexClaim(claim);
+    }
+    // the first probe waits 0-250 ms so hosts booting together do not collide, see RFC 6762, section 8.1
+    restartProbing(claim, randomDelay(0, 250));
+}
+
+void Engine::rename(Claim* claim) {
+    unindexClaim(claim);
+    do {
+        ++claim->suffix;
+        std::string suffix = claim->host ? "-" + std::to_string(claim->suffix) : " (" + std::to_string(claim->suffix) + ")";
+        claim->label = claim->requested.substr(0, 63 - suffix.size()) + suffix;
+        claim->name = *(claim->host ? domain_ : claim->type).prepend(claim->label);
+    } while (!claim->host && services_.count(claim->name.key()));
+    indexClaim(claim);
+    if (claim->host) {
+        // every SRV record points at the host name
+        for (auto& [key, service] : services_) {
+            if (answerable(*service)) {
+                service->state = Claim::Announcing;
+                service->sent = 0;
+                service->due = Clock::now();
+                active_.insert(service);
+            }
+        }
+    }
+    restartProbing(claim, Clock::duration::zero());
+}
+
+void Engine::restartProbing(Claim* claim, Clock::duration delay) {
+    claim->state = Claim::Probing;
+    claim->sent = 0;
+    claim->due = Clock::now() + delay;
+    active_.insert(claim);
+    scheduleClaims();
+}
+
+void Engine::withdraw(const std::vector<Claim*>& claims) {
+    std::vector<Claim*> announced;
+    for (Claim* claim : claims) {
+        active_.erase(claim);
+        unindexClaim(claim);
+        if (answerable(*claim)) {
+            announced.push_back(claim);
+        }
+    }
+    if (announced.empty()) {
+        return;
+    }
+    for (Interface& interface : interfaces_) {
+        std::vector<Record> goodbyes;
+        std::unordered_set<std::string> types;
+        for (Claim* claim : announced) {
+            if (!serves(*claim, interface)) {
+                continue;
+            }
+            allRecords(*claim, interface, goodbyes);
+            // the enumeration record goes once, and only with the last instance of its type
+            if (byType_.count(claim->type.key()) || !types.insert(claim->type.key()).second) {
+                goodbyes.pop_back();
+            }
+        }
+        for (Record& record : goodbyes) {
+            record.ttl = 0;
+        }
+        for (IPFamily family : {IPv4, IPv6}) {
+            sendRecords(interface, family, goodbyes, false);
+        }
+    }
+}
+
+void Engine::updateTxt(Claim* claim, const TxtRecord& txt) {
+    claim->txt = txt;
+    // a probing claim announces the new record once it is established
+    if (answerable(*claim)) {
+        claim->state = Claim::Announcing;
+        claim->sent = 0;
+        claim->due = Clock::now();
+        active_.insert(claim);
+        scheduleClaims();
+    }
+}
+
+void Engine::scheduleClaims() {
+    if (active_.empty()) {
+        return;
+    }
+    Clock::time_point due = Clock::time_point::max();
+    for (Claim* claim : active_) {
+        due = std::min(due, claim->due);
+    }
+    if (claimTimer_ && due >= claimDue_) {
+        return;
+    }
+    if (claimTimer_) {
+        reactor_.removeTimer(claimTimer_);
+    }
+    claimDue_ = due;
+    claimTimer_ = reactor_.addTimer(due, [this] {
+        claimTimer_ = 0;
+        runClaims();
+    });
+}
+
+void Engine::runClaims() {
+    auto now = Clock::now();
+    std::vector<Claim*> probes;
+    std::vector<Claim*> announcements;
+    for (Claim* claim : std::vector<Claim*>(active_.begin(), active_.end())) {
+        if (claim->due > now) {
+            continue;
+        }
+        if (claim->state == Claim::Probing) {
+            if (claim->sent < kProbeCount) {
+                probes.push_back(claim);
+                ++claim->sent;
+                claim->due = now + kProbeInterval;
+                continue;
+            }
+            // no conflict within 250 ms of the last probe, the name is ours
+            claim->state = Claim::Announcing;
+            claim->sent = 0;
+        }
+        announcements.push_back(claim);
+        if (++claim->sent < kAnnounceCount) {
+            claim->due = now + kAnnounceInterval;
+        } else {
+            claim->state = Claim::Established;
+            active_.erase(claim);
+        }
+    }
+
+    if (!probes.empty()) {
+        sendProbes(probes);
+    }
+    if (!announcements.empty()) {
+        for (Interface& interface : interfaces_) {
+            std::vector<Record> records;
+            for (Claim* claim : announcements) {
+                allRecords(*claim, interface, records);
+            }
+            for (IPFamily family : {IPv4, IPv6}) {
+                sendRecords(interface, family, records, false);
+            }
+        }
+    }
+    scheduleClaims();
+}
+
+void Engine::sendProbes(const std::vector<Claim*>& probing) {
+    for (Interface& interface : interfaces_) {
+        std::vector<Claim*> claims;
+        std::copy_if(probing.begin(), probing.end(), std::back_inserter(claims), [&interface](const Claim* claim) { return serves(*claim, interface); });
+        std::vector<Record> authorities;
+        size_t next = 0;
+        while (next < claims.size()) {
+            // questions come before the authority section, so a chunk is sized
+            // up front from the uncompressed lengths, which are an upper bound
+            size_t first = next;
+            size_t estimate = 12;
+            authorities.clear();
+            while (next < claims.size()) {
+                size_t mark = authorities.size();
+                uniqueRecords(*claims[next], interface, authorities);
+                size_t size = claims[next]->name.wire().size() + 4;
+                for (size_t i = mark; i < authorities.size(); ++i) {
+                    size += authorities[i].name.wire().size() + 10 + authorities[i].rdata.size();
+                }
+                if (next > first && estimate + size > kMaxMessageSize) {
+                    authorities.resize(mark);
+                    break;
+                }
+                estimate += size;
+                ++next;
+            }
+            MessageWriter writer(0, 0, SIZE_MAX);
+            for (size_t i = first; i < next; ++i) {
+                // the first probe asks for unicast replies, see RFC 6762, section 8.1
+                writer.add(Question{claims[i]->name, TypeANY, claims[i]->sent == 1});
+            }
+            for (const Record& record : authorities) {
+                writer.add(MessageWriter::Authority, record);
+            }
+            sendMulticast(interface, writer.finish());
+        }
+    }
+}
+
+void Engine::sendRecords(Interface& interface, IPFamily family, std::vector<Record> answers, bool additionals, const sockaddr_storage* destination, socklen_t destinationLength, const Message* legacy) {
+    if (answers.empty()) {
+        return;
+    }
+    uint16_t id = legacy ? legacy->id : 0;
+    auto flush = [&](MessageWriter& writer) {
+        if (destination) {
+            sendUnicast(writer.finish(), *destination, destinationLength);
+        } else {
+            sendMulticast(interface, family, writer.finish());
+        }
+    };
+    auto fresh = [&] {
+        MessageWriter writer(id, kFlagResponse | kFlagAuthoritative);
+        if (legacy) {
+            // legacy resolvers expect their question back, see RFC 6762, section 6.7
+            for (const Question& question : legacy->questions) {
+                writer.add(Question{question.name, question.type, false});
+            }
+        }
+        return writer;
+    };
+    std::unordered_set<std::string> sent;
+    for (const Record& answer : answers) {
+        sent.insert(data_key(answer));
+    }
+
+    size_t next = 0;
+    while (next < answers.size()) {
+        MessageWriter writer = fresh();
+        size_t first = next;
+        // answers take the first half of the message when additional records
+        // are wanted, the related additional records fill the rest
+        size_t answerLimit = additionals ? writer.limit() / 2 : writer.limit();
+        while (next < answers.size() && (next == first || writer.size() < answerLimit) && writer.add(MessageWriter::Answer, answers[next])) {
+            ++next;
+        }
+        if (next == first) {
+            ++next;
+            continue;
+        }
+        if (additionals) {
+            std::vector<Record> extra;
+            for (size_t i = first; i < next; ++i) {
+                collectAdditionals(interface, answers[i], extra);
+            }
+            for (Record& record : extra) {
+                if (legacy) {
+                    record.ttl = std::min(record.ttl, kLegacyUnicastTtl);
+                    record.cacheFlush = false;
+                }
+                if (sent.count(data_key(record)) || !writer.add(MessageWriter::Additional, record)) {
+                    continue;
+                }
+                sent.insert(data_key(record));
+            }
+        }
+        flush(writer);
+    }
+}
+
+void Engine::checkConflicts(const Message& message) {
+    std::vector<Claim*> conflicting;
+    for (const std::vector<Record>* section : {&message.answers, &message.additionals}) {
+        for (const Record& record : *section) {
+            if (record.ttl == 0) {
+                continue;
+            }
+            Claim* claim = findClaim(record.name);
+            if (!claim || std::find(conflicting.begin(), conflicting.end(), claim) != conflicting.end()) {
+                continue;
+            }
+            bool unique = claim->host ? record.type == TypeA || record.type == TypeAAAA : record.type == TypeSRV || record.type == TypeTXT;
+            if (!unique) {
+                continue;
+            }
+            // identical data is no conflict: our own packets loop back, and
+            // another process on this host shares our addresses
+            bool ours = false;
+            for (const Interface& interface : interfaces_) {
+                std::vector<Record> records;
+                uniqueRecords(*claim, interface, records);
+                ours = std::any_of(records.begin(), records.end(), [&record](const Record& own) { return own.sameData(record); });
+                if (ours) {
+                    break;
+                }
+            }
+            if (!ours) {
+                conflicting.push_back(claim);
+            }
+        }
+    }
+    for (Claim* claim : conflicting) {
+        if (claim->state == Claim::Probing) {
+            rename(claim);
+        } else {
+            // an established name is probed again, which renames it if the other side insists
+            restartProbing(claim, Clock::duration::zero());
+        }
+    }
+}
+
+void Engine::checkProbeTieBreak(const Interface& interface, const Message& message) {
+    for (const Question& question : message.questions) {
+        Claim* claim = findClaim(question.name);
+        if (!claim || claim->state != Claim::Probing) {
+            continue;
+        }
+        std::vector<Record> theirs;
+        for (const Record& record : message.authorities) {
+            if (record.name == claim->name) {
+                theirs.push_back(record);
+            }
+        }
+        if (theirs.empty()) {
+            continue;
+        }
+        std::vector<Record> ours;
+        uniqueRecords(*claim, interface, ours);
+        auto less = [](const Record& a, const Record& b) { return a.compareData(b) < 0; };
+        std::sort(theirs.begin(), theirs.end(), less);
+        std::sort(ours.begin(), ours.end(), less);
+        int order = 0;
+        for (size_t i = 0; i < std::min(ours.size(), theirs.size()) && order == 0; ++i) {
+            order = ours[i].compareData(theirs[i]);
+        }
+        if (order == 0) {
+            order = ours.size() == theirs.size() ? 0 : (ours.size() < theirs.size() ? -1 : 1);
+        }
+        // the lexicographically later data wins, see RFC 6762, section 8.2
+        if (order < 0) {
+            restartProbing(claim, kProbeDefer);
+        }
+    }
+}
+
+void Engine::handleQuery(Interface& interface, IPFamily family, const Message& message, const sockaddr_storage& source, socklen_t sourceLength) {
+    // a truncated query continues with more known answers, see RFC 6762, section 7.2
+    std::string key = source_key(source, sourceLength);
+    auto deferred = deferred_.find(key);
+    if (!message.truncated() && deferred == deferred_.end()) {
+        answerQuery(interface, family, message, source, sourceLength);
+        return;
+    }
+    if (deferred == deferred_.end()) {
+        deferred = deferred_.emplace(key, DeferredQuery{&interface, source, sourceLength, Message{}, 0}).first;
+        deferred->second.timer = reactor_.addTimer(Clock::now() + randomDelay(400, 500), [this, key, family] {
+            auto it = deferred_.find(key);
+            DeferredQuery query = std::move(it->second);
+            deferred_.erase(it);
+            answerQuery(*query.interface, family, query.message, query.source, query.sourceLength);
+        });
+    }
+    Message& merged = deferred->second.message;
+    merged.questions.insert(merged.questions.end(), message.questions.begin(), message.questions.end());
+    merged.answers.insert(merged.answers.end(), message.answers.begin(), message.answers.end());
+}
+
+void Engine::collectAnswers(const Interface& interface, const Question& question, std::vector<Record>& answers, bool& shared) {
+    const Name& name = question.name;
+    if (name == host_.name) {
+        if (answerable(host_)) {
+            hostAddresses(interface, question.type, answers);
+        }
+        return;
+    }
+    std::string key = name.key();
+    auto service = services_.find(key);
+    if (service != services_.end() && answerable(*service->second) && serves(*service->second, interface)) {
+        const Claim& claim = *service->second;
+        if (type_matches(question.type, TypeSRV)) {
+            answers.push_back(Record::srv(claim.name, claim.port, host_.name, detail::kHostRecordTtl));
+        }
+        if (type_matches(question.type, TypeTXT)) {
+            answers.push_back(Record::txt(claim.name, claim.txt, kServiceRecordTtl));
+        }
+        return;
+    }
+    if (!type_matches(question.type, TypePTR)) {
+        return;
+    }
+    auto type = byType_.find(key);
+    if (type != byType_.end()) {
+        for (const Claim* claim : type->second) {
+            if (answerable(*claim) && serves(*claim, interface)) {
+                answers.push_back(Record::ptr(claim->type, claim->name, kServiceRecordTtl));
+                shared = true;
+            }
+        }
+        return;
+    }
+    auto subtype = bySubtype_.find(key);
+    if (subtype != bySubtype_.end()) {
+        for (const Claim* claim : subtype->second) {
+            if (answerable(*claim) && serves(*claim, interface)) {
+                answers.push_back(Record::ptr(name, claim->name, kServiceRecordTtl));
+                shared = true;
+            }
+        }
+        return;
+    }
+    if (name.firstLabel() == "_services" && !byType_.empty()) {
+        for (const auto& [typeKey, claims] : byType_) {
+            const Claim* claim = *claims.begin();
+            Name enumeration = enumeration_name(claim->domain);
+            if (enumeration == name && std::any_of(claims.begin(), claims.end(), [&interface](const Claim* c) { return answerable(*c) && serves(*c, interface); })) {
+                answers.push_back(Record::ptr(enumeration, claim->type, kServiceRecordTtl));
+                shared = true;
+            }
+        }
+    }
+}
+
+void Engine::collectAdditionals(const Interface& interface, const Record& answer, std::vector<Record>& out) {
+    // see RFC 6763, section 12
+    if (answer.type == TypePTR) {
+        std::optional<Name> target = answer.ptrTarget();
+        auto service = target ? services_.find(target->key()) : services_.end();
+        if (service != services_.end()) {
+            uniqueRecords(*service->second, interface, out);
+            hostAddresses(interface, TypeANY, out);
+            out.push_back(hostNsec(interface));
+        }
+    } else if (answer.type == TypeSRV || answer.type == TypeA || answer.type == TypeAAAA) {
+        if (answer.type == TypeSRV) {
+            hostAddresses(interface, TypeANY, out);
+        }
+        // tells the querier that the other address family does not exist
+        out.push_back(hostNsec(interface));
+    }
+}
+
+void Engine::answerQuery(Interface& interface, IPFamily family, const Message& message, const sockaddr_storage& source, socklen_t sourceLength) {
+    std::vector<Record> answers;
+    bool shared = false;
+    bool unicast = !message.questions.empty();
+    bool negative = false;
+    for (const Question& question : message.questions) {
+        size_t before = answers.size();
+        collectAnswers(interface, question, answers, shared);
+        unicast = unicast && question.unicastResponse;
+        negative = negative || (answers.size() == before && question.name == host_.name && answerable(host_));
+    }
+    // known-answer suppression, see RFC 6762, section 7.1
+    answers.erase(std::remove_if(answers.begin(), answers.end(), [&message](const Record& answer) {
+        return std::any_of(message.answers.begin(), message.answers.end(), [&answer](const Record& known) {
+            return known.ttl >= answer.ttl / 2 && known.sameData(answer);
+        });
+    }), answers.end());
+    if (negative) {
+        // the host name exists but not with the asked type, see RFC 6762, section 6.1
+        answers.push_back(hostNsec(interface));
+    }
+    if (answers.empty()) {
+        return;
+    }
+
+    if (port_of(source) != kMdnsPort) {
+        for (Record& answer : answers) {
+            answer.ttl = std::min(answer.ttl, kLegacyUnicastTtl);
+            answer.cacheFlush = false;
+        }
+        sendRecords(interface, family, std::move(answers), true, &source, sourceLength, &message);
+    } else if (unicast) {
+        sendRecords(interface, family, std::move(answers), true, &source, sourceLength);
+    } else if (!shared) {
+        // unique answers go out at once, see RFC 6762, section 6
+        sendRecords(interface, family, std::move(answers), true);
+    } else {
+        queueMulticast(interface, family, answers, randomDelay(20, 120));
+    }
+}
+
+void Engine::queueMulticast(Interface& interface, IPFamily family, const std::vector<Record>& answers, Clock::duration delay) {
+    for (const Record& answer : answers) {
+        if (interface.pendingKeys[family].insert(data_key(answer)).second) {
+            interface.pending[family].push_back(answer);
+        }
+    }
+    if (interface.pendingTimer[family]) {
+        return;
+    }
+    interface.pendingTimer[family] = reactor_.addTimer(Clock::now() + delay, [this, &interface, family] {
+        interface.pendingTimer[family] = 0;
+        std::vector<Record> pending = std::move(interface.pending[family]);
+        interface.pending[family].clear();
+        interface.pendingKeys[family].clear();
+        sendRecords(interface, family, std::move(pending), true);
+    });
+}
+
+void Engine::ingest(const Record& record, uint32_t interfaceIndex, Clock::time_point now) {
+    std::vector<CachedRecord>& entries = cache_[record.key()];
+    if (record.cacheFlush) {
+        // older records of a unique set are replaced, see RFC 6762, section 10.2
+        for (CachedRecord& entry : entries) {
+            if (now - entry.received > kGraceTime && !entry.record.sameData(record)) {
+                entry.expires = std::min(entry.expires, now + kGraceTime);
+            }
+        }
+    }
+    auto it = std::find_if(entries.begin(), entries.end(), [&record](const CachedRecord& entry) { return entry.record.sameData(record); });
+    if (it != entries.end()) {
+        if (record.ttl == 0) {
+            it->expires = std::min(it->expires, now + kGraceTime);
+        } else {
+            it->record.ttl = record.ttl;
+            it->received = now;
+            it->expires = now + std::chrono::seconds(record.ttl);
+            it->refreshes = 0;
+        }
+    } else if (record.ttl > 0) {
+        entries.push_back(CachedRecord{record, interfaceIndex, now, now + std::chrono::seconds(record.ttl), 0});
+        // copied, the callbacks may add records of their own
+        CachedRecord added = entries.back();
+        notify(added, true);
+    }
+    if (entries.empty()) {
+        cache_.erase(record.key());
+    }
+    scheduleSweep();
+}
+
+void Engine::notify(const CachedRecord& cached, bool added) {
+    auto it = interests_.find(cached.record.key());
+    if (it == interests_.end()) {
+        return;
+    }
+    // operations are torn down from posted tasks, never from inside a callback
+    for (Interest* interest : std::vector<Interest*>(it->second)) {
+        interest->onRecord(cached, added);
+    }
+}
+
+void Engine::addInterest(Interest* interest) {
+    std::string key = recordKey(interest->name, interest->type);
+    interests_[key].push_back(interest);
+    OutgoingQuestion& question = questions_[key];
+    if (question.users++ == 0) {
+        question.question = Question{interest->name, interest->type, false};
+        // the first query waits 20-120 ms so simultaneous lookups share a packet, see RFC 6762, section 5.2
+        question.due = Clock::now() + randomDelay(20, 120);
+        question.interval = kFirstQueryInterval;
+        scheduleQueries();
+    }
+    auto cached = cache_.find(key);
+    if (cached != cache_.end()) {
+        auto now = Clock::now();
+        for (const CachedRecord& entry : std::vector<CachedRecord>(cached->second)) {
+            if (entry.expires > now) {
+                interest->onRecord(entry, true);
+            }
+        }
+    }
+}
+
+void Engine::removeInterest(Interest* interest) {
+    std::string key = recordKey(interest->name, interest->type);
+    auto it = interests_.find(key);
+    if (it != interests_.end()) {
+        it->second.erase(std::remove(it->second.begin(), it->second.end(), interest), it->second.end());
+        if (it->second.empty()) {
+            interests_.erase(it);
+        }
+    }
+    auto question = questions_.find(key);
+    if (question != questions_.end() && --question->second.users == 0) {
+        questions_.erase(question);
+    }
+}
+
+void Engine::scheduleQueries() {
+    if (questions_.empty()) {
+        return;
+    }
+    Clock::time_point due = Clock::time_point::max();
+    for (const auto& [key, question] : questions_) {
+        due = std::min(due, question.due);
+    }
+    if (queryTimer_ && due >= queryDue_) {
+        return;
+    }
+    if (queryTimer_) {
+        reactor_.removeTimer(queryTimer_);
+    }
+    queryDue_ = due;
+    queryTimer_ = reactor_.addTimer(due, [this] {
+        queryTimer_ = 0;
+        runQueries();
+    });
+}
+
+void Engine::runQueries() {
+    auto now = Clock::now();
+    std::vector<std::pair<const std::string*, OutgoingQuestion*>> due;
+    for (auto& [key, question] : questions_) {
+        if (question.due <= now) {
+            due.emplace_back(&key, &question);
+            question.due = now + question.interval;
+            question.interval = std::min<Clock::duration>(question.interval * 2, kMaxQueryInterval);
+        }
+    }
+
+    size_t next = 0;
+    while (next < due.size()) {
+        MessageWriter writer;
+        size_t first = next;
+        // leave room for the known answers of the questions in this message
+        while (next < due.size() && (next == first || writer.size() < writer.limit() / 2) && writer.add(due[next].second->question)) {
+            ++next;
+        }
+        if (next == first) {
+            ++next;
+            continue;
+        }
+        std::vector<std::string> packets;
+        for (size_t i = first; i < next; ++i) {
+            auto cached = cache_.find(*due[i].first);
+            if (cached == cache_.end()) {
+                continue;
+            }
+            for (const CachedRecord& entry : cached->second) {
+                // only answers with more than half their TTL left suppress, see RFC 6762, section 7.1
+                Record known = entry.record;
+                known.ttl = entry.remainingTtl(now);
+                if (known.ttl <= entry.record.ttl / 2) {
+                    continue;
+                }
+                if (!writer.add(MessageWriter::Answer, known)) {
+                    writer.setFlags(kFlagTruncated);
+                    packets.push_back(writer.finish());
+                    writer = MessageWriter();
+                    writer.add(MessageWriter::Answer, known);
+                }
+            }
+        }
+        packets.push_back(writer.finish());
+        for (Interface& interface : interfaces_) {
+            for (const std::string& packet : packets) {
+                sendMulticast(interface, packet);
+            }
+        }
+    }
+    scheduleQueries();
+}
+
+void Engine::scheduleSweep() {
+    if (!sweepTimer_ && !cache_.empty()) {
+        sweepTimer_ = reactor_.addTimer(Clock::now() + std::chrono::seconds(1), [this] {
+            sweepTimer_ = 0;
+            sweep();
+        });
+    }
+}
+
+void Engine::sweep() {
+    auto now = Clock::now();
+    std::vector<CachedRecord> expired;
+    bool refresh = false;
+    for (auto it = cache_.begin(); it != cache_.end();) {
+        std::vector<CachedRecord>& entries = it->second;
+        auto question = questions_.find(it->first);
+        for (auto entry = entries.begin(); entry != entries.end();) {
+            if (entry->expires <= now) {
+                expired.push_back(std::move(*entry));
+                entry = entries.erase(entry);
+                continue;
+            }
+            if (question != questions_.end() && entry->refreshes < 4) {
+                auto lifetime = entry->expires - entry->received;
+                if (now - entry->received >= lifetime * (80 + 5 * entry->refreshes) / 100) {
+                    ++entry->refreshes;
+                    question->second.due = now;
+                    refresh = true;
+                }
+            }
+            ++entry;
+        }
+        it = entries.empty() ? cache_.erase(it) : std::next(it);
+    }
+    for (const CachedRecord& cached : expired) {
+        notify(cached, false);
+    }
+    if (refresh) {
+        scheduleQueries();
+    }
+    scheduleSweep();
+}
+
+/// reactor thread only; the engine lives as long as the process
+static Engine& engine_for(Reactor& reactor) {
+    static std::mutex mutex;
+    // never destroyed, the reactor thread may still run during static destruction
+    static auto* engines = new std::unordered_map<Reactor*, std::unique_ptr<Engine>>();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& engine = (*engines)[&reactor];
+    if (!engine) {
+        engine = std::make_unique<Engine>(reactor);
+    }
+    return *engine;
+}
+
+/// the engine of the operation's reactor, started; nullptr once the operation failed
+static Engine* started_engine(const detail::OperationPtr& op) {
+    Engine& engine = engine_for(op->reactor());
+    if (!engine.start()) {
+        op->complete(Status::Failed);
+        return nullptr;
+    }
+    return &engine;
+}
+
+/// "_http._tcp" and the domain, or the default domain
+static std::optional<Name> service_type(const Engine& engine, const std::string& regType, const std::string& domain) {
+    std::optional<Name> type = Name::parse(regType);
+    std::optional<Name> suffix = domain.empty() ? engine.defaultDomain() : Name::parse(domain);
+    if (!type || type->isRoot() || !suffix) {
+        return std::nullopt;
+    }
+    return type->append(*suffix);
+}
+
+void detail::startRegister(const OperationPtr& op, RegisterRequest request) {
+    Engine* engine = started_engine(op);
+    if (!engine) {
+        return;
+    }
+    auto claims = std::make_shared<std::vector<std::unique_ptr<Claim>>>();
+    // indexed like request.services, invalid services have no claim
+    auto byIndex = std::make_shared<std::vector<Claim*>>();
+    for (const ServiceRegistration& service : request.services) {
+        std::optional<Name> type = service_type(*engine, service.regType, service.domain);
+        std::string label = service.serviceName.empty() ? engine->hostLabel() : service.serviceName;
+        if (!type || !type->prepend(label)) {
+            KNOTDNSSD_LOG_ERROR("Invalid service '%s' of type '%s'", service.serviceName.c_str(), service.regType.c_str());
+            byIndex->push_back(nullptr);
+            continue;
+        }
+        auto claim = std::make_unique<Claim>();
+        claim->requested = label;
+        claim->label = label;
+        claim->type = *type;
+        claim->domain = type->parent().parent();
+        claim->port = service.port;
+        claim->txt = service.txt;
+        claim->interfaceIndex = request.scope.interfaceIndex;
+        for (const std::string& subtype : service.subtypes) {
+            if (std::optional<Name> name = service_type(*engine, subtypeName(subtype, service.regType), service.domain)) {
+                claim->subtypes.push_back(*name);
+            } else {
+                KNOTDNSSD_LOG_ERROR("Invalid subtype '%s' of service '%s'", subtype.c_str(), service.serviceName.c_str());
+            }
+        }
+        byIndex->push_back(claim.get());
+        claims->push_back(std::move(claim));
+    }
+    request.registration->updateTxt = [engine, byIndex](size_t index, const TxtRecord& txt) {
+        if (index < byIndex->size() && (*byIndex)[index]) {
+            engine->updateTxt((*byIndex)[index], txt);
+        } else {
+            KNOTDNSSD_LOG_WARNING("TXT update for unknown service index %zu", index);
+        }
+    };
+    op->setTeardown([engine, claims] {
+        std::vector<Claim*> withdrawn;
+        for (const auto& claim : *claims) {
+            withdrawn.push_back(claim.get());
+        }
+        engine->withdraw(withdrawn);
+    });
+    if (claims->empty()) {
+        op->complete(Status::Failed);
+        return;
+    }
+    for (const auto& claim : *claims) {
+        engine->publish(claim.get());
+    }
+}
+
+/// the engine knows the interface a record arrived on, but not the family
+static bool inScope(const NetworkScope& scope, const CachedRecord& cached) {
+    return scope.interfaceIndex == 0 || scope.interfaceIndex == cached.interfaceIndex;
+}
+
+struct BrowseContext {
+    detail::OperationPtr op;
+    detail::BrowseRequest request;
+    Engine* engine = nullptr;
+    Interest interest;
+    Name type;
+    std::string domain;
+    /// instances from the cache and the first answers are flagged as more coming
+    bool allForNow = false;
+    Reactor::Id allForNowTimer = 0;
+
+    void onRecord(const CachedRecord& cached, bool added) {
+        std::optional<Name> target = cached.record.ptrTarget();
+        if (!op->active() || !target || target->isRoot() || target->parent() != type || !inScope(request.scope, cached)) {
+            return;
+        }
+        std::string name(target->firstLabel());
+        request.callback({name.c_str(), request.regType.c_str(), domain.c_str(), added ? ServiceAdded : ServiceRemoved, !allForNow, cached.interfaceIndex});
+    }
+};
+
+void detail::startBrowse(const OperationPtr& op, BrowseRequest request) {
+    Engine* engine = started_engine(op);
+    if (!engine) {
+        return;
+    }
+    std::optional<Name> type = service_type(*engine, request.regType, request.domain);
+    // subtype instances are listed under their own name but still live below the base type
+    std::optional<Name> listing = request.subtype.empty() ? type : service_type(*engine, subtypeName(request.subtype, request.regType), request.domain);
+    if (!type || !listing) {
+        KNOTDNSSD_LOG_ERROR("Invalid service type '%s'", request.regType.c_str());
+        op->complete(Status::Failed);
+        return;
+    }
+    auto* context = new BrowseContext;
+    context->op = op;
+    context->request = std::move(request);
+    context->engine = engine;
+    context->type = *type;
+    context->domain = type->parent().parent().toString();
+    context->interest = Interest{*listing, TypePTR, [context](const CachedRecord& cached, bool added) { context->onRecord(cached, added); }};
+    op->setTeardown([context] {
+        context->engine->removeInterest(&context->interest);
+        if (context->allForNowTimer) {
+            context->op->reactor().removeTimer(context->allForNowTimer);
+        }
+        delete context;
+    });
+    context->engine->addInterest(&context->interest);
+    context->allForNowTimer = op->reactor().addTimer(Clock::now() + kAllForNowDelay, [context] {
+        context->allForNowTimer = 0;
+        context->allForNow = true;
+        if (context->op->active() && context->request.allForNow) {
+            context->request.allForNow();
+        }
+    });
+}
+
+/// SRV and TXT of the instance, then the addresses of the SRV target. A
+/// watching resolve follows the records that replace them and replies again
+/// each time.
+struct ResolveContext {
+    detail::OperationPtr op;
+    detail::ResolveRequest request;
+    Engine* engine = nullptr;
+    Interest srv;
+    Interest txt;
+    /// indexed by IPFamily, started once the target is known
+    Interest addresses[2];
+    bool watchingAddresses = false;
+
+    std::optional<SrvData> target;
+    std::optional<TxtRecord> txtRecord;
+    std::optional<IPAddress> address;
+    /// watches only: address has expired, the next one to arrive replaces it
+    bool replaceAddress = false;
+    uint32_t ttl = UINT32_MAX;
+
+    void onRecord(const CachedRecord& cached, bool added) {
+        if (!op->active() || !inScope(request.scope, cached)) {
+            return;
+        }
+        const Record& record = cached.record;
+        if (!added) {
+            if (request.watch && (record.type == TypeA || record.type == TypeAAAA) && address == record.addressData(cached.interfaceIndex)) {
+                replaceAddress = true;
+            }
+            return;
+        }
+        ttl = std::min(ttl, cached.remainingTtl(Clock::now()));
+        bool changed = false;
+        if (record.type == TypeSRV && (!target || request.watch)) {
+            std::optional<SrvData> srvData = record.srvData();
+            if (srvData && target && !(srvData->target == target->target)) {
+                // moved to another host, whose addresses are still to come
+                stopAddresses();
+                address.reset();
+            }
+            changed = srvData && (!target || target->port != srvData->port || !(target->target == srvData->target));
+            target = srvData;
+            if (target && !watchingAddresses) {
+                startAddresses();
+            }
+        } else if (record.type == TypeTXT && (!txtRecord || request.watch)) {
+            if (!detail::accepts(request.filter, record.rdata.data(), record.rdata.size())) {
+                // unwanted, no reason to wait for the address
+                op->complete(Status::Ok);
+                return;
+            }
+            TxtRecord txtData = record.txtData();
+            changed = txtRecord != txtData;
+            txtRecord = std::move(txtData);
+        } else if ((record.type == TypeA || record.type == TypeAAAA) && (!address || replaceAddress)) {
+            address = record.addressData(cached.interfaceIndex);
+            replaceAddress = false;
+            changed = true;
+        }
+        if (changed && target && txtRecord && address) {
+            if (!request.watch) {
+                op->complete(Status::Ok);
+            }
+            request.callback({{target->target.toString(), address, target->port, *txtRecord}}, ttl);
+        }
+    }
+
+    void startAddresses() {
+        watchingAddresses = true;
+        for (IPFamily family : {IPv4, IPv6}) {
+            if (request.scope.family && *request.scope.family != family) {
+                continue;
+            }
+            addresses[family] = Interest{target->target, family == IPv6 ? TypeAAAA : TypeA, [this](const CachedRecord& cached, bool added) { onRecord(cached, added); }};
+            engine->addInterest(&addresses[family]);
+        }
+    }
+
+    void stopAddresses() {
+        if (!watchingAddresses) {
+            return;
+        }
+        watchingAddresses = false;
+        for (IPFamily family : {IPv4, IPv6}) {
+            if (!request.scope.family || *request.scope.family == family) {
+                engine->removeInterest(&addresses[family]);
+            }
+        }
+    }
+
+    void stop() {
+        engine->removeInterest(&srv);
+        engine->removeInterest(&txt);
+        stopAddresses();
+    }
+};
+
+void detail::startResolve(const OperationPtr& op, ResolveRequest request) {
+    Engine* engine = started_engine(op);
+    if (!engine) {
+        request.callback(std::nullopt, 0);
+        return;
+    }
+    std::optional<Name> type = service_type(*engine, request.regType, request.domain);
+    std::optional<Name> instance = type ? type->prepend(request.serviceName) : std::nullopt;
+    if (!instance) {
+        KNOTDNSSD_LOG_ERROR("Invalid service '%s' of type '%s'", request.serviceName.c_str(), request.regType.c_str());
+        op->complete(Status::Failed);
+        request.callback(std::nullopt, 0);
+        return;
+    }
+    auto* context = new ResolveContext;
+    context->op = op;
+    context->request = std::move(request);
+    context->engine = engine;
+    auto onRecord = [context](const CachedRecord& cached, bool added) { context->onRecord(cached, added); };
+    context->srv = Interest{*instance, TypeSRV, onRecord};
+    context->txt = Interest{*instance, TypeTXT, onRecord};
+    op->setTeardown([context] {
+        context->stop();
+        delete context;
+    });
+    engine->addInterest(&context->srv);
+    engine->addInterest(&context->txt);
+}
+
+/// A and AAAA of a host plus its NSEC record, which tells early that a family has no address.
+struct HostContext {
+    detail::OperationPtr op;
+    Engine* engine = nullptr;
+    Interest addresses[2];
+    Interest nsec;
+    bool wanted[2] = {false, false};
+    bool done[2] = {false, false};
+    Fn<void(const IPAddress& address, uint32_t ttl)> onAddress;
+    Fn<void(IPFamily family, bool found)> onDone;
+
+    void start(const Name& host) {
+        auto onRecord = [this](const CachedRecord& cached, bool added) { this->onRecord(cached, added); };
+        nsec = Interest{host, TypeNSEC, onRecord};
+        for (IPFamily family : {IPv4, IPv6}) {
+            addresses[family] = Interest{host, family == IPv6 ? TypeAAAA : TypeA, onRecord};
+        }
+        for (IPFamily family : {IPv4, IPv6}) {
+            if (wanted[family] && op->active()) {
+                engine->addInterest(&addresses[family]);
+            }
+        }
+        if (op->active()) {
+            engine->addInterest(&nsec);
+        }
+    }
+
+    void stop() {
+        for (IPFamily family : {IPv4, IPv6}) {
+            if (wanted[family]) {
+                engine->removeInterest(&addresses[family]);
+            }
+        }
+        engine->removeInterest(&nsec);
+    }
+
+    void onRecord(const CachedRecord& cached, bool added) {
+        if (!op->active() || !added) {
+            return;
+        }
+        const Record& record = cached.record;
+        if (record.type == TypeNSEC) {
+            for (IPFamily family : {IPv4, IPv6}) {
+                if (wanted[family] && !done[family] && !record.nsecHas(family == IPv6 ? TypeAAAA : TypeA) && op->active()) {
+                    done[family] = true;
+                    onDone(family, false);
+                }
+            }
+            return;
+        }
+        std::optional<IPAddress> address = record.addressData(cached.interfaceIndex);
+        if (!address || !wanted[address->family]) {
+            return;
+        }
+        onAddress(*address, cached.remainingTtl(Clock::now()));
+        IPFamily family = address->family;
+        if (done[family]) {
+            return;
+        }
+        done[family] = true;
+        // the rest of the answer arrives in the same packet, report the family once it is processed
+        op->reactor().post([op = op, this, family] {
+            if (op->active()) {
+                onDone(family, true);
+            }
+        });
+    }
+};
+
+void detail::startQuery(const OperationPtr& op, QueryRequest request) {
+    Engine* engine = started_engine(op);
+    std::optional<Name> host = Name::parse(request.hostName);
+    if (!engine || !host || host->isRoot()) {
+        op->complete(Status::Failed);
+        request.callback(std::nullopt, 0);
+        return;
+    }
+    auto* context = new HostContext;
+    context->op = op;
+    context->engine = engine;
+    context->wanted[request.family] = true;
+    auto callback = std::make_shared<QueryReplyHandler>(std::move(request.callback));
+    context->onAddress = [op, callback](const IPAddress& address, uint32_t ttl) {
+        if (op->active()) {
+            op->complete(Status::Ok);
+            (*callback)(address, ttl);
+        }
+    };
+    context->onDone = [op, callback](IPFamily, bool found) {
+        if (!found && op->active()) {
+            op->complete(Status::Failed);
+            (*callback)(std::nullopt, 0);
+        }
+    };
+    op->setTeardown([context] {
+        context->stop();
+        delete context;
+    });
+    context->start(*host);
+}
+
+void detail::startAddresses(const OperationPtr& op, AddressRequest request) {
+    Engine* engine = started_engine(op);
+    std::optional<Name> host = Name::parse(request.hostName);
+    if (!engine || !host || host->isRoot()) {
+        op->complete(Status::Failed);
+        return;
+    }
+    auto* context = new HostContext;
+    context->op = op;
+    context->engine = engine;
+    context->wanted[IPv4] = true;
+    context->wanted[IPv6] = true;
+    auto shared = std::make_shared<AddressRequest>(std::move(request));
+    context->onAddress = [shared](const IPAddress& address, uint32_t) { shared->onAddress(address); };
+    context->onDone = [shared](IPFamily family, bool) { shared->familyDone(family); };
+    op->setTeardown([context] {
+        context->stop();
+        delete context;
+    });
+    context->start(*host);
+}
+
+}
+
+#endif  // USE_MDNS
@@ -0,0 +1,515 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#include "mdns_message.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace knot::detail::mdns {
+
+static char lower(char c) {
+    return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+}
+
+static bool equal_ignore_case(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) { return lower(x) == lower(y); });
+}
+
+static void put_u16(std::string& out, uint16_t value) {
+    out.push_back(static_cast<char>(value >> 8));
+    out.push_back(static_cast<char>(value & 0xff));
+}
+
+static uint16_t get_u16(const uint8_t* data) {
+    return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+static uint32_t get_u32(const uint8_t* data) {
+    return (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) | (static_cast<uint32_t>(data[2]) << 8) | data[3];
+}
+
+std::optional<Name> Name::parse(std::string_view text) {
+    if (!text.empty() && text.back() == '.') {
+        text.remove_suffix(1);
+    }
+    std::string wire;
+    while (!text.empty()) {
+        size_t dot = text.find('.');
+        std::string_view label = text.substr(0, dot);
+        if (label.empty() || label.size() > 63) {
+            return std::nullopt;
+        }
+        wire.push_back(static_cast<char>(label.size()));
+        wire.append(label);
+        text = dot == std::string_view::npos ? std::string_view() : text.substr(dot + 1);
+    }
+    wire.push_back('\0');
+    if (wire.size() > 255) {
+        return std::nullopt;
+    }
+    return Name(std::move(wire));
+}
+
+std::optional<Name> Name::prepend(std::string_view label) const {
+    if (label.empty() || label.size() > 63 || wire_.size() + 1 + label.size() > 255) {
+        return std::nullopt;
+    }
+    std::string wire;
+    wire.reserve(1 + label.size() + wire_.size());
+    wire.push_back(static_cast<char>(label.size()));
+    wire.append(label);
+    wire.append(wire_);
+    return Name(std::move(wire));
+}
+
+std::optional<Name> Name::append(const Name& suffix) const {
+    if (wire_.size() - 1 + suffix.wire_.size() > 255) {
+        return std::nullopt;
+    }
+    return Name(wire_.substr(0, wire_.size() - 1) + suffix.wire_);
+}
+
+std::string_view Name::firstLabel() const {
+    return std::string_view(wire_).substr(1, static_cast<uint8_t>(wire_[0]));
+}
+
+Name Name::parent() const {
+    if (isRoot()) {
+        return *this;
+    }
+    return Name(wire_.substr(1 + static_cast<uint8_t>(wire_[0])));
+}
+
+std::string Name::toString() const {
+    if (isRoot()) {
+        return ".";
+    }
+    std::string text;
+    for (size_t position = 0; wire_[position] != 0; position += 1 + static_cast<uint8_t>(wire_[position])) {
+        text.append(wire_, position + 1, static_cast<uint8_t>(wire_[position]));
+        text.push_back('.');
+    }
+    return text;
+}
+
+std::string Name::key() const {
+    std::string key = wire_;
+    // length bytes never exceed 63, lowering them is a no-op
+    std::transform(key.begin(), key.end(), key.begin(), lower);
+    return key;
+}
+
+bool Name::operator==(const Name& other) const {
+    return equal_ignore_case(wire_, other.wire_);
+}
+
+std::string recordKey(const Name& name, uint16_t type) {
+    std::string key = name.key();
+    put_u16(key, type);
+    return key;
+}
+
+Record Record::ptr(const Name& name, const Name& target, uint32_t ttl) {
+    return Record{name, TypePTR, false, ttl, target.wire()};
+}
+
+Record Record::srv(const Name& name, uint16_t port, const Name& target, uint32_t ttl) {
+    std::string rdata;
+    put_u16(rdata, 0);  // priority
+    put_u16(rdata, 0);  // weight
+    put_u16(rdata, port);
+    rdata.append(target.wire());
+    return Record{name, TypeSRV, true, ttl, std::move(rdata)};
+}
+
+Record Record::txt(const Name& name, const TxtRecord& txt, uint32_t ttl) {
+    // an empty TXT record is a single empty string, see RFC 6763, section 6.1
+    std::string rdata = txt.size() ? std::string(reinterpret_cast<const char*>(txt.data()), txt.size()) : std::string(1, '\0');
+    return Record{name, TypeTXT, true, ttl, std::move(rdata)};
+}
+
+Record Record::address(const Name& name, const IPAddress& address, uint32_t ttl) {
+    std::string rdata(reinterpret_cast<const char*>(address.bytes.data()), address.length());
+    return Record{name, address.family == IPv6 ? TypeAAAA : TypeA, true, ttl, std::move(rdata)};
+}
+
+Record Record::nsec(const Name& name, std::initializer_list<uint16_t> types, uint32_t ttl) {
+    // mDNS only uses window block 0, see RFC 6762, section 6.1
+    uint8_t bitmap[32] = {};
+    size_t length = 0;
+    for (uint16_t type : types) {
+        if (type < 256) {
+            bitmap[type / 8] |= static_cast<uint8_t>(0x80 >> (type % 8));
+            length = std::max<size_t>(length, type / 8 + 1);
+        }
+    }
+    std::string rdata = name.wire();
+    rdata.push_back('\0');
+    rdata.push_back(static_cast<char>(length));
+    rdata.append(reinterpret_cast<const char*>(bitmap), length);
+    return Record{name, TypeNSEC, true, ttl, std::move(rdata)};
+}
+
+/// length of the uncompressed name at the start of data, 0 if malformed
+static size_t name_length(std::string_view data) {
+    size_t position = 0;
+    while (position < data.size()) {
+        auto length = static_cast<uint8_t>(data[position]);
+        if (length == 0) {
+            return position + 1;
+        }
+        position += 1 + length;
+    }
+    return 0;
+}
+
+std::optional<Name> Name::fromWire(std::string_view data) {
+    size_t length = name_length(data);
+    if (length == 0 || length != data.size() || length > 255) {
+        return std::nullopt;
+    }
+    for (size_t position = 0; data[position] != 0; position += 1 + static_cast<uint8_t>(data[position])) {
+        if (static_cast<uint8_t>(data[position]) > 63) {
+            return std::nullopt;
+        }
+    }
+    return Name(std::string(data));
+}
+
+std::optional<Name> Record::ptrTarget() const {
+    return type == TypePTR ? Name::fromWire(rdata) : std::nullopt;
+}
+
+std::optional<SrvData> Record::srvData() const {
+    if (type != TypeSRV || rdata.size() < 7) {
+        return std::nullopt;
+    }
+    std::optional<Name> target = Name::fromWire(std::string_view(rdata).substr(6));
+    if (!target) {
+        return std::nullopt;
+    }
+    return SrvData{get_u16(reinterpret_cast<const uint8_t*>(rdata.data()) + 4), std::move(*target)};
+}
+
+TxtRecord Record::txtData() const {
+    return TxtRecord::fromWire(rdata.data(), rdata.size());
+}
+
+std::optional<IPAddress> Record::addressData(uint32_t interfaceIndex) const {
+    if ((type == TypeA && rdata.size() == 4) || (type == TypeAAAA && rdata.size() == 16)) {
+        return IPAddress::fromBytes(rdata.data(), rdata.size(), interfaceIndex);
+    }
+    return std::nullopt;
+}
+
+bool Record::nsecHas(uint16_t queried) const {
+    if (type != TypeNSEC) {
+        return false;
+    }
+    auto* bytes = reinterpret_cast<const uint8_t*>(rdata.data());
+    size_t position = name_length(rdata);
+    while (position != 0 && position + 2 <= rdata.size()) {
+        uint8_t window = bytes[position];
+        uint8_t length = bytes[position + 1];
+        position += 2;
+        if (position + length > rdata.size()) {
+            return false;
+        }
+        size_t bit = queried & 0xff;
+        if (window == queried >> 8 && bit / 8 < length) {
+            return (bytes[position + bit / 8] & (0x80 >> (bit % 8))) != 0;
+        }
+        position += length;
+    }
+    return false;
+}
+
+/// names inside the data compare case-insensitively, everything else byte for byte
+static bool rdata_equal(uint16_t type, std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    switch (type) {
+        case TypePTR:
+            return equal_ignore_case(a, b);
+        case TypeSRV:
+            return a.substr(0, 6) == b.substr(0, 6) && equal_ignore_case(a.substr(6), b.substr(6));
+        case TypeNSEC: {
+            size_t length = name_length(a);
+            return equal_ignore_case(a.substr(0, length), b.substr(0, length)) && a.substr(length) == b.substr(length);
+        }
+        default:
+            return a == b;
+    }
+}
+
+bool Record::sameData(const Record& other) const {
+    return type == other.type && name == other.name && rdata_equal(type, rdata, other.rdata);
+}
+
+int Record::compareData(const Record& other) const {
+    // the class is IN on both sides and does not take part
+    if (type != other.type) {
+        return type < other.type ? -1 : 1;
+    }
+    int order = std::memcmp(rdata.data(), other.rdata.data(), std::min(rdata.size(), other.rdata.size()));
+    if (order != 0) {
+        return order < 0 ? -1 : 1;
+    }
+    return rdata.size() == other.rdata.size() ? 0 : (rdata.size() < other.rdata.size() ? -1 : 1);
+}
+
+std::string Record::key() const {
+    return recordKey(name, type);
+}
+
+/// Expands the possibly compressed name at offset and moves offset past it.
+static bool read_name(const uint8_t* data, size_t size, size_t& offset, std::string& wire) {
+    wire.clear();
+    size_t position = offset;
+    bool jumped = false;
+    // every pointer has to go backwards, so a message cannot loop forever
+    size_t limit = position;
+    while (true) {
+        if (position >= size) {
+            return false;
+        }
+        uint8_t length = data[position];
+        if ((length & 0xc0) == 0xc0) {
+            if (position + 1 >= size) {
+                return false;
+            }
+            size_t target = static_cast<size_t>(((length & 0x3f) << 8) | data[position + 1]);
+            if (target >= limit) {
+                return false;
+            }
+            if (!jumped) {
+                offset = position + 2;
+                jumped = true;
+            }
+            limit = target;
+            position = target;
+            continue;
+        }
+        if (length > 63 || position + 1 + length > size) {
+            return false;
+        }
+        wire.push_back(static_cast<char>(length));
+        if (length == 0) {
+            break;
+        }
+        wire.append(reinterpret_cast<const char*>(data + position + 1), length);
+        position += 1 + length;
+        // the terminating zero still has to fit, see RFC 1035, section 3.1
+        if (wire.size() + 1 > 255) {
+            return false;
+        }
+    }
+    if (!jumped) {
+        offset = position + 1;
+    }
+    return true;
+}
+
+static bool read_record(const uint8_t* data, size_t size, size_t& offset, Record& record, bool& known) {
+    std::string wire;
+    if (!read_name(data, size, offset, wire) || offset + 10 > size) {
+        return false;
+    }
+    std::optional<Name> name = Name::fromWire(wire);
+    if (!name) {
+        return false;
+    }
+    record.name = std::move(*name);
+    record.type = get_u16(data + offset);
+    uint16_t rrclass = get_u16(data + offset + 2);
+    record.cacheFlush = (rrclass & kClassTopBit) != 0;
+    record.ttl = get_u32(data + offset + 4);
+    uint16_t length = get_u16(data + offset + 8);
+    offset += 10;
+    size_t end = offset + length;
+    if (end > size) {
+        return false;
+    }
+    known = (rrclass & ~kClassTopBit) == kClassIn;
+
+    size_t position = offset;
+    switch (record.type) {
+        case TypePTR:
+            if (!read_name(data, end, position, record.rdata) || position != end) {
+                return false;
+            }
+            break;
+        case TypeSRV:
+            if (length < 7) {
+                return false;
+            }
+            position += 6;
+            if (!read_name(data, end, position, wire) || position != end) {
+                return false;
+            }
+            record.rdata.assign(reinterpret_cast<const char*>(data + offset), 6);
+            record.rdata.append(wire);
+            break;
+        case TypeNSEC:
+            if (!read_name(data, end, position, record.rdata)) {
+                return false;
+            }
+            record.rdata.append(reinterpret_cast<const char*>(data + position), end - position);
+            break;
+        default:
+            record.rdata.assign(reinterpret_cast<const char*>(data + offset), length);
+            break;
+    }
+    offset = end;
+    return true;
+}
+
+std::optional<Message> parseMessage(const uint8_t* data, size_t size) {
+    if (size < 12) {
+        return std::nullopt;
+    }
+    Message message;
+    message.id = get_u16(data);
+    message.flags = get_u16(data + 2);
+    uint16_t counts[4] = {get_u16(data + 4), get_u16(data + 6), get_u16(data + 8), get_u16(data + 10)};
+    size_t offset = 12;
+
+    std::string wire;
+    for (uint16_t i = 0; i < counts[0]; ++i) {
+        if (!read_name(data, size, offset, wire) || offset + 4 > size) {
+            return std::nullopt;
+        }
+        std::optional<Name> name = Name::fromWire(wire);
+        if (!name) {
+            return std::nullopt;
+        }
+        uint16_t rrclass = get_u16(data + offset + 2);
+        if ((rrclass & ~kClassTopBit) == kClassIn || (rrclass & ~kClassTopBit) == TypeANY) {
+            message.questions.push_back({std::move(*name), get_u16(data + offset), (rrclass & kClassTopBit) != 0});
+        }
+        offset += 4;
+    }
+
+    std::vector<Record>* sections[3] = {&message.answers, &message.authorities, &message.additionals};
+    for (int section = 0; section < 3; ++section) {
+        for (uint16_t i = 0; i < counts[section + 1]; ++i) {
+            Record record;
+            bool known = false;
+            if (!read_record(data, size, offset, record, known)) {
+                return std::nullopt;
+            }
+            if (known) {
+                sections[section]->push_back(std::move(record));
+            }
+        }
+    }
+    return message;
+}
+
+MessageWriter::MessageWriter(uint16_t id, uint16_t flags, size_t limit) : buffer_(12, '\0'), limit_(limit), id_(id), flags_(flags) {
+}
+
+void MessageWriter::writeU16(uint16_t value) {
+    put_u16(buffer_, value);
+}
+
+void MessageWriter::writeU32(uint32_t value) {
+    writeU16(static_cast<uint16_t>(value >> 16));
+    writeU16(static_cast<uint16_t>(value & 0xffff));
+}
+
+void MessageWriter::writeName(const Name& name, std::vector<std::string>& added) {
+    const std::string& wire = name.wire();
+    size_t position = 0;
+    while (wire[position] != 0) {
+        std::string suffix = wire.substr(position);
+        std::transform(suffix.begin(), suffix.end(), suffix.begin(), lower);
+        auto it = offsets_.find(suffix);
+        if (it != offsets_.end()) {
+            writeU16(static_cast<uint16_t>(0xc000 | it->second));
+            return;
+        }
+        if (buffer_.size() < 0x3fff) {
+            offsets_.emplace(suffix, static_cast<uint16_t>(buffer_.size()));
+            added.push_back(std::move(suffix));
+        }
+        size_t length = 1 + static_cast<uint8_t>(wire[position]);
+        buffer_.append(wire, position, length);
+        position += length;
+    }
+    buffer_.push_back('\0');
+}
+
+bool MessageWriter::fits(size_t mark, std::vector<std::string>& added) {
+    // an entry too large for any message still goes out on its own
+    if (buffer_.size() <= limit_ || empty()) {
+        return true;
+    }
+    buffer_.resize(mark);
+    for (const std::string& suffix : added) {
+        offsets_.erase(suffix);
+    }
+    return false;
+}
+
+bool MessageWriter::add(const Question& question) {
+    size_t mark = buffer_.size();
+    std::vector<std::string> added;
+    writeName(question.name, added);
+    writeU16(question.type);
+    writeU16(static_cast<uint16_t>(kClassIn | (question.unicastResponse ? kClassTopBit : 0)));
+    if (!fits(mark, added)) {
+        return false;
+    }
+    ++questions_;
+    return true;
+}
+
+bool MessageWriter::add(Section section, const Record& record) {
+    size_t mark = buffer_.size();
+    std::vector<std::string> added;
+    writeName(record.name, added);
+    writeU16(record.type);
+    writeU16(static_cast<uint16_t>(kClassIn | (record.cacheFlush ? kClassTopBit : 0)));
+    writeU32(record.ttl);
+    size_t lengthAt = buffer_.size();
+    writeU16(0);
+    switch (record.type) {
+        case TypePTR:
+            writeName(*record.ptrTarget(), added);
+            break;
+        case TypeSRV:
+            buffer_.append(record.rdata, 0, 6);
+            writeName(record.srvData()->target, added);
+            break;
+        default:
+            buffer_.append(record.rdata);
+            break;
+    }
+    size_t length = buffer_.size() - lengthAt - 2;
+    buffer_[lengthAt] = static_cast<char>(length >> 8);
+    buffer_[lengthAt + 1] = static_cast<char>(length & 0xff);
+    if (!fits(mark, added)) {
+        return false;
+    }
+    ++counts_[section];
+    return true;
+}
+
+const std::string& MessageWriter::finish() {
+    uint16_t header[6] = {id_, flags_, questions_, counts_[Answer], counts_[Authority], counts_[Additional]};
+    for (size_t i = 0; i < 6; ++i) {
+        buffer_[i * 2] = static_cast<char>(header[i] >> 8);
+        buffer_[i * 2 + 1] = static_cast<char>(header[i] & 0xff);
+    }
+    return buffer_;
+}
+
+}
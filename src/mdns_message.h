@@ -0,0 +1,184 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_MDNS_MESSAGE_H
+#define KNOTDNSSD_MDNS_MESSAGE_H
+
+#include "knot/dnssd.h"
+
+#include <cstdint>
+#include <initializer_list>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// DNS message codec for the built-in mDNS engine, RFC 1035 with the
+// multicast specific bits of RFC 6762, section 18.
+
+namespace knot::detail::mdns {
+
+enum RecordType : uint16_t {
+    TypeA = 1,
+    TypePTR = 12,
+    TypeTXT = 16,
+    TypeAAAA = 28,
+    TypeSRV = 33,
+    TypeNSEC = 47,
+    TypeANY = 255,
+};
+
+constexpr uint16_t kClassIn = 1;
+/// top bit of the class: cache-flush in records, unicast-response in questions
+constexpr uint16_t kClassTopBit = 0x8000;
+
+constexpr uint16_t kFlagResponse = 0x8000;
+constexpr uint16_t kFlagAuthoritative = 0x0400;
+constexpr uint16_t kFlagTruncated = 0x0200;
+
+/// stays below the Ethernet MTU with IPv6 and UDP headers, so nothing is fragmented
+constexpr size_t kMaxMessageSize = 1440;
+
+/// Domain name in uncompressed wire format: length-prefixed labels ending with
+/// the root label. Labels are raw bytes, so instance names may contain dots.
+/// Comparisons ignore ASCII case, see RFC 6762, section 16.
+class Name {
+public:
+    Name() : wire_(1, '\0') {}
+
+    /// dotted text such as "_http._tcp.local."; std::nullopt for empty or oversized labels
+    static std::optional<Name> parse(std::string_view text);
+    /// uncompressed wire form; std::nullopt unless data holds exactly one valid name
+    static std::optional<Name> fromWire(std::string_view data);
+
+    /// std::nullopt if label is empty or longer than 63 bytes
+    std::optional<Name> prepend(std::string_view label) const;
+    std::optional<Name> append(const Name& suffix) const;
+
+    bool isRoot() const { return wire_.size() == 1; }
+    std::string_view firstLabel() const;
+    /// the name without its first label
+    Name parent() const;
+
+    /// dotted text with a trailing dot; dots inside labels are not escaped
+    std::string toString() const;
+    const std::string& wire() const { return wire_; }
+    /// lowercased wire form, usable as a map key
+    std::string key() const;
+
+    bool operator==(const Name& other) const;
+    bool operator!=(const Name& other) const { return !(*this == other); }
+
+private:
+    explicit Name(std::string wire) : wire_(std::move(wire)) {}
+
+    std::string wire_;
+};
+
+struct Question {
+    Name name;
+    uint16_t type = TypeANY;
+    /// QU bit, the querier asks for a unicast reply
+    bool unicastResponse = false;
+};
+
+struct SrvData {
+    uint16_t port = 0;
+    Name target;
+};
+
+struct Record {
+    Name name;
+    uint16_t type = 0;
+    /// set on unique records, see RFC 6762, section 10.2
+    bool cacheFlush = false;
+    uint32_t ttl = 0;
+    /// names inside PTR, SRV and NSEC data are stored expanded
+    std::string rdata;
+
+    static Record ptr(const Name& name, const Name& target, uint32_t ttl);
+    static Record srv(const Name& name, uint16_t port, const Name& target, uint32_t ttl);
+    static Record txt(const Name& name, const TxtRecord& txt, uint32_t ttl);
+    static Record address(const Name& name, const IPAddress& address, uint32_t ttl);
+    /// asserts that only the listed types exist for name, see RFC 6762, section 6.1
+    static Record nsec(const Name& name, std::initializer_list<uint16_t> types, uint32_t ttl);
+
+    std::optional<Name> ptrTarget() const;
+    std::optional<SrvData> srvData() const;
+    TxtRecord txtData() const;
+    std::optional<IPAddress> addressData(uint32_t interfaceIndex) const;
+    /// NSEC only; whether type is listed as existing
+    bool nsecHas(uint16_t type) const;
+
+    /// same name, type and data; TTL and cache-flush bit are ignored
+    bool sameData(const Record& other) const;
+    /// lexicographic order of RFC 6762, section 8.2, used to break probe ties
+    int compareData(const Record& other) const;
+
+    /// lowercased name key and type, the cache and lookup key
+    std::string key() const;
+};
+
+std::string recordKey(const Name& name, uint16_t type);
+
+struct Message {
+    uint16_t id = 0;
+    uint16_t flags = 0;
+    std::vector<Question> questions;
+    std::vector<Record> answers;
+    std::vector<Record> authorities;
+    std::vector<Record> additionals;
+
+    bool isResponse() const { return (flags & kFlagResponse) != 0; }
+    bool truncated() const { return (flags & kFlagTruncated) != 0; }
+};
+
+/// std::nullopt for malformed messages
+std::optional<Message> parseMessage(const uint8_t* data, size_t size);
+
+/// Builds one message with name compression. Sections must be filled in
+/// order; add() leaves the message untouched and returns false when the
+/// entry would push it past the size limit.
+class MessageWriter {
+public:
+    enum Section { Answer = 0, Authority = 1, Additional = 2 };
+
+    explicit MessageWriter(uint16_t id = 0, uint16_t flags = 0, size_t limit = kMaxMessageSize);
+
+    bool add(const Question& question);
+    bool add(Section section, const Record& record);
+
+    bool empty() const { return questions_ == 0 && counts_[Answer] == 0 && counts_[Authority] == 0 && counts_[Additional] == 0; }
+    size_t count(Section section) const { return counts_[section]; }
+    size_t size() const { return buffer_.size(); }
+    size_t limit() const { return limit_; }
+    void setFlags(uint16_t flags) { flags_ = flags; }
+
+    /// the message bytes, header counts included
+    const std::string& finish();
+
+private:
+    void writeName(const Name& name, std::vector<std::string>& added);
+    void writeU16(uint16_t value);
+    void writeU32(uint32_t value);
+    bool fits(size_t mark, std::vector<std::string>& added);
+
+    std::string buffer_;
+    size_t limit_;
+    uint16_t id_;
+    uint16_t flags_;
+    uint16_t questions_ = 0;
+    uint16_t counts_[3] = {0, 0, 0};
+    /// lowercased name suffix to its offset in the message
+    std::unordered_map<std::string, uint16_t> offsets_;
+};
+
+}
+
+#endif //KNOTDNSSD_MDNS_MESSAGE_H
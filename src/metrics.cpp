@@ -0,0 +1,81 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#include "knot/dnssd.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace knot {
+
+namespace detail {
+
+MetricsRegistry& metricsRegistry() {
+    // never destroyed, the reactor thread may still record during static destruction
+    static auto* instance = new MetricsRegistry();
+    return *instance;
+}
+
+}
+
+uint64_t LatencyHistogram::percentile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    q = std::min(std::max(q, 0.0), 1.0);
+    auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * static_cast<double>(count))));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            // the last bucket is open-ended, its lower bound is the best there is
+            return uint64_t(1) << (i + 1 < kBuckets ? i : i - 1);
+        }
+    }
+    return uint64_t(1) << (kBuckets - 2);
+}
+
+void setMetricsEnabled(bool enabled) {
+    detail::metricsRegistry().enabled.store(enabled, std::memory_order_relaxed);
+}
+
+Metrics metrics() {
+    const detail::MetricsRegistry& registry = detail::metricsRegistry();
+    Metrics metrics;
+    metrics.servicesAdded = registry.servicesAdded.load(std::memory_order_relaxed);
+    metrics.servicesRemoved = registry.servicesRemoved.load(std::memory_order_relaxed);
+    metrics.resolves = registry.resolves.load(std::memory_order_relaxed);
+    metrics.queries = registry.queries.load(std::memory_order_relaxed);
+    metrics.completed = registry.completed.load(std::memory_order_relaxed);
+    metrics.timeouts = registry.timeouts.load(std::memory_order_relaxed);
+    metrics.cancellations = registry.cancellations.load(std::memory_order_relaxed);
+    metrics.failures = registry.failures.load(std::memory_order_relaxed);
+    metrics.reconnects = registry.reconnects.load(std::memory_order_relaxed);
+    metrics.cacheHits = registry.cacheHits.load(std::memory_order_relaxed);
+    metrics.cacheMisses = registry.cacheMisses.load(std::memory_order_relaxed);
+    metrics.logsDropped = registry.logsDropped.load(std::memory_order_relaxed);
+    metrics.inFlight = registry.inFlight.load(std::memory_order_relaxed);
+    metrics.resolveLatency = registry.resolveLatency.snapshot();
+    metrics.queryLatency = registry.queryLatency.snapshot();
+    metrics.callbackTime = registry.callbackTime.snapshot();
+    return metrics;
+}
+
+void resetMetrics() {
+    detail::MetricsRegistry& registry = detail::metricsRegistry();
+    for (auto* counter : {&registry.servicesAdded, &registry.servicesRemoved, &registry.resolves, &registry.queries,
+                          &registry.completed, &registry.timeouts, &registry.cancellations, &registry.failures,
+                          &registry.reconnects, &registry.cacheHits, &registry.cacheMisses, &registry.logsDropped}) {
+        counter->store(0, std::memory_order_relaxed);
+    }
+    registry.resolveLatency.reset();
+    registry.queryLatency.reset();
+    registry.callbackTime.reset();
+}
+
+}
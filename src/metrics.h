@@ -0,0 +1,157 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_METRICS_H
+#define KNOTDNSSD_METRICS_H
+
+#include "knot/dnssd.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+namespace knot::detail {
+
+/// Lock-free counterpart of LatencyHistogram.
+class AtomicHistogram {
+public:
+    void record(std::chrono::steady_clock::duration elapsed) {
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        uint64_t value = micros > 0 ? static_cast<uint64_t>(micros) : 0;
+        size_t bucket = 0;
+        while (bucket + 1 < LatencyHistogram::kBuckets && value >= (uint64_t(1) << bucket)) {
+            ++bucket;
+        }
+        buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sumMicros_.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    LatencyHistogram snapshot() const {
+        LatencyHistogram histogram;
+        for (size_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+            histogram.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+        }
+        histogram.count = count_.load(std::memory_order_relaxed);
+        histogram.sumMicros = sumMicros_.load(std::memory_order_relaxed);
+        return histogram;
+    }
+
+    void reset() {
+        for (auto& bucket : buckets_) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        count_.store(0, std::memory_order_relaxed);
+        sumMicros_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> buckets_[LatencyHistogram::kBuckets] = {};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sumMicros_{0};
+};
+
+/// Process-wide counters behind knot::metrics().
+///
+/// Every recording site first checks enabled(), a single relaxed load, so a
+/// disabled registry costs one predictable branch. Counters are relaxed: a
+/// snapshot is not a consistent cut, each value is merely monotonic.
+struct MetricsRegistry {
+    std::atomic<bool> enabled{false};
+
+    std::atomic<uint64_t> servicesAdded{0};
+    std::atomic<uint64_t> servicesRemoved{0};
+    std::atomic<uint64_t> resolves{0};
+    std::atomic<uint64_t> queries{0};
+    std::atomic<uint64_t> completed{0};
+    std::atomic<uint64_t> timeouts{0};
+    std::atomic<uint64_t> cancellations{0};
+    std::atomic<uint64_t> failures{0};
+    std::atomic<uint64_t> reconnects{0};
+    std::atomic<uint64_t> cacheHits{0};
+    std::atomic<uint64_t> cacheMisses{0};
+    std::atomic<uint64_t> logsDropped{0};
+    std::atomic<int64_t> inFlight{0};
+
+    AtomicHistogram resolveLatency;
+    AtomicHistogram queryLatency;
+    AtomicHistogram callbackTime;
+};
+
+MetricsRegistry& metricsRegistry();
+
+inline bool metricsEnabled() {
+    return metricsRegistry().enabled.load(std::memory_order_relaxed);
+}
+
+/// increments counter if metrics are enabled
+inline void count(std::atomic<uint64_t> MetricsRegistry::* counter) {
+    MetricsRegistry& registry = metricsRegistry();
+    if (registry.enabled.load(std::memory_order_relaxed)) {
+        (registry.*counter).fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/// reactor thread; called from the finish hook of every operation counted in inFlight
+inline void recordFinish(Status status) {
+    MetricsRegistry& registry = metricsRegistry();
+    registry.inFlight.fetch_sub(1, std::memory_order_relaxed);
+    if (!registry.enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    switch (status) {
+        case Status::Ok: registry.completed.fetch_add(1, std::memory_order_relaxed); break;
+        case Status::Timeout: registry.timeouts.fetch_add(1, std::memory_order_relaxed); break;
+        case Status::Cancelled: registry.cancellations.fetch_add(1, std::memory_order_relaxed); break;
+        case Status::Failed: registry.failures.fetch_add(1, std::memory_order_relaxed); break;
+    }
+}
+
+/// Wraps a user callback so its execution time is recorded. Decided once, at
+/// wrap time: with metrics disabled the callback is returned untouched.
+template<typename... Args>
+Fn<void(Args...)> timed(Fn<void(Args...)> callback) {
+    if (!callback || !metricsEnabled()) {
+        return callback;
+    }
+    return [callback = std::move(callback)](Args... args) {
+        auto begin = std::chrono::steady_clock::now();
+        callback(std::forward<Args>(args)...);
+        metricsRegistry().callbackTime.record(std::chrono::steady_clock::now() - begin);
+    };
+}
+
+/// Records the time from now until the callback receives an answer into histogram.
+template<typename Value>
+Fn<void(const std::optional<Value>&)> measured(Fn<void(const std::optional<Value>&)> callback, AtomicHistogram MetricsRegistry::* histogram) {
+    if (!metricsEnabled()) {
+        return callback;
+    }
+    return [callback = std::move(callback), histogram, begin = std::chrono::steady_clock::now()](const std::optional<Value>& value) {
+        if (value) {
+            (metricsRegistry().*histogram).record(std::chrono::steady_clock::now() - begin);
+        }
+        callback(value);
+    };
+}
+
+/// counts the events before handing them on
+inline BrowseCallback counted(BrowseCallback callback) {
+    if (!metricsEnabled()) {
+        return callback;
+    }
+    return [callback = std::move(callback)](const BrowseReply& reply) {
+        count(reply.event == ServiceAdded ? &MetricsRegistry::servicesAdded : &MetricsRegistry::servicesRemoved);
+        callback(reply);
+    };
+}
+
+}
+
+#endif //KNOTDNSSD_METRICS_H
@@ -0,0 +1,344 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#if defined(USE_MOCK)
+
+#include "knot/dnssd.h"
+#include "backend.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+// In-process stand-in for the daemon: registrations, browses and lookups are
+// matched against each other inside the library. Only the mock hosts resolve
+// to an address, everything else stays unanswered, like a peer that vanished.
+// The daemon lives on the first event loop, as if in a process of its own:
+// operations on other shards reach it, and hear back, through posted tasks.
+
+namespace knot {
+
+/// host name every mock registration is published under, resolves to loopback
+static const char* const kMockHost = "knotdnssd-mock.local.";
+static const char* const kDefaultDomain = "local.";
+/// hosts that resolve like the mock host, but answer for one address family
+/// kLateAnswer after the other, to race the two families against each other
+static const char* const kLateIPv6Host = "knotdnssd-mock-late6.local.";
+static const char* const kLateIPv4Host = "knotdnssd-mock-late4.local.";
+static constexpr std::chrono::milliseconds kLateAnswer(300);
+
+static std::string domain_or_default(const std::string& domain) {
+    return domain.empty() ? std::string(kDefaultDomain) : domain;
+}
+
+static std::string instance_key(const std::string& name, const std::string& regType, const std::string& domain) {
+    std::string key = name;
+    key.push_back('\0');
+    key.append(regType);
+    key.push_back('\0');
+    key.append(domain);
+    return key;
+}
+
+static std::string absolute_host(const std::string& hostName) {
+    std::string host = hostName;
+    if (!host.empty() && host.back() != '.') {
+        host.push_back('.');
+    }
+    return host;
+}
+
+static bool is_mock_host(const std::string& hostName) {
+    return absolute_host(hostName) == kMockHost;
+}
+
+/// the family a late host answers for last, if hostName is one
+static std::optional<IPFamily> late_family(const std::string& hostName) {
+    std::string host = absolute_host(hostName);
+    if (host == kLateIPv6Host) {
+        return IPv6;
+    }
+    if (host == kLateIPv4Host) {
+        return IPv4;
+    }
+    return std::nullopt;
+}
+
+/// runs task on the daemon loop, right away when already there
+static void on_daemon(Fn<void()> task) {
+    detail::Reactor& loop = detail::reactor();
+    if (loop.isLoopThread()) {
+        task();
+    } else {
+        loop.post(std::move(task));
+    }
+}
+
+/// runs task on the loop of op, where its callbacks belong
+static void on_client(const detail::OperationPtr& op, Fn<void()> task) {
+    if (op->reactor().isLoopThread()) {
+        task();
+    } else {
+        op->reactor().post(std::move(task));
+    }
+}
+
+static IPAddress loopback(IPFamily family) {
+    static const uint8_t v4[4] = {127, 0, 0, 1};
+    static const uint8_t v6[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    return family == IPv6 ? *IPAddress::fromBytes(v6, sizeof(v6)) : *IPAddress::fromBytes(v4, sizeof(v4));
+}
+
+struct Published {
+    std::string name;
+    std::string regType;
+    std::string domain;
+    uint16_t port = 0;
+    TxtRecord txt;
+    std::vector<std::string> subtypes;
+    /// 0 for every interface
+    uint32_t interfaceIndex = 0;
+};
+
+struct Browser {
+    detail::OperationPtr op;
+    detail::BrowseRequest request;
+    std::string domain;
+};
+
+struct PendingResolve {
+    detail::OperationPtr op;
+    detail::ResolveRequest request;
+    std::string key;
+};
+
+class MockDaemon {
+public:
+    /// publishes the service, renaming it "name (2)" and so on when the name is taken
+    std::string publish(const ServiceRegistration& service, uint32_t interfaceIndex) {
+        std::string domain = domain_or_default(service.domain);
+        std::string name = service.serviceName.empty() ? std::string("knotdnssd-mock") : service.serviceName;
+        for (int suffix = 2; services_.count(instance_key(name, service.regType, domain)); ++suffix) {
+            name = service.serviceName + " (" + std::to_string(suffix) + ")";
+        }
+        std::string key = instance_key(name, service.regType, domain);
+        services_[key] = Published{name, service.regType, domain, service.port, service.txt, service.subtypes, interfaceIndex};
+        notify(services_[key], ServiceAdded);
+        answerPending(key);
+        return key;
+    }
+
+    void withdraw(const std::string& key) {
+        auto it = services_.find(key);
+        if (it == services_.end()) {
+            return;
+        }
+        Published service = std::move(it->second);
+        services_.erase(it);
+        notify(service, ServiceRemoved);
+    }
+
+    void updateTxt(const std::string& key, const TxtRecord& txt) {
+        auto it = services_.find(key);
+        if (it != services_.end()) {
+            it->second.txt = txt;
+            answerPending(key);
+        }
+    }
+
+    void browse(Browser* browser) {
+        browsers_.push_back(browser);
+        std::vector<Published> matches;
+        for (const auto& [key, service] : services_) {
+            if (matches_browser(*browser, service)) {
+                matches.push_back(service);
+            }
+        }
+        on_client(browser->op, [op = browser->op, request = browser->request, matches = std::move(matches)] {
+            for (size_t i = 0; i < matches.size() && op->active(); ++i) {
+                const Published& service = matches[i];
+                request.callback({service.name.c_str(), service.regType.c_str(), service.domain.c_str(), ServiceAdded, i + 1 < matches.size(), service.interfaceIndex});
+            }
+            // like mDNSResponder, all-for-now only ends a reply, a browse that
+            // finds nothing hears nothing at all
+            if (op->active() && request.allForNow && !matches.empty()) {
+                request.allForNow();
+            }
+        });
+    }
+
+    void stopBrowse(Browser* browser) {
+        browsers_.erase(std::remove(browsers_.begin(), browsers_.end(), browser), browsers_.end());
+    }
+
+    /// answers right away if the instance exists, otherwise once it is
+    /// published; watching resolves again on every TXT update
+    void resolve(PendingResolve* resolve) {
+        pending_.push_back(resolve);
+        answerPending(resolve->key);
+    }
+
+    void stopResolve(PendingResolve* resolve) {
+        pending_.erase(std::remove(pending_.begin(), pending_.end(), resolve), pending_.end());
+    }
+
+private:
+    static bool matches_browser(const Browser& browser, const Published& service) {
+        const std::string& subtype = browser.request.subtype;
+        uint32_t interfaceIndex = browser.request.scope.interfaceIndex;
+        return browser.request.regType == service.regType && browser.domain == service.domain
+               && (interfaceIndex == 0 || service.interfaceIndex == 0 || interfaceIndex == service.interfaceIndex)
+               && (subtype.empty() || std::find(service.subtypes.begin(), service.subtypes.end(), subtype) != service.subtypes.end());
+    }
+
+    /// a single event, which ends its reply
+    static void reply(const detail::OperationPtr& op, const BrowseCallback& callback, const Fn<void()>& allForNow, const Published& service, BrowseEvent event) {
+        if (op->active()) {
+            callback({service.name.c_str(), service.regType.c_str(), service.domain.c_str(), event, false, service.interfaceIndex});
+        }
+        if (op->active() && allForNow) {
+            allForNow();
+        }
+    }
+
+    void notify(const Published& service, BrowseEvent event) {
+        for (Browser* browser : std::vector<Browser*>(browsers_)) {
+            if (!browser->op->active() || !matches_browser(*browser, service)) {
+                continue;
+            }
+            if (browser->op->reactor().isLoopThread()) {
+                reply(browser->op, browser->request.callback, browser->request.allForNow, service, event);
+                continue;
+            }
+            browser->op->reactor().post([op = browser->op, callback = browser->request.callback, allForNow = browser->request.allForNow, service, event] {
+                reply(op, callback, allForNow, service, event);
+            });
+        }
+    }
+
+    void answerPending(const std::string& key) {
+        auto service = services_.find(key);
+        if (service == services_.end()) {
+            return;
+        }
+        for (PendingResolve* resolve : std::vector<PendingResolve*>(pending_)) {
+            if (resolve->key != key || !resolve->op->active()) {
+                continue;
+            }
+            ResolveReply reply{std::string(kMockHost), loopback(IPv4), service->second.port, service->second.txt};
+            on_client(resolve->op, [op = resolve->op, request = resolve->request, reply = std::move(reply)] {
+                if (!op->active()) {
+                    return;
+                }
+                if (!request.watch) {
+                    op->complete(Status::Ok);
+                }
+                if (detail::accepts(request.filter, reply.txt.data(), reply.txt.size())) {
+                    request.callback(reply, detail::kHostRecordTtl);
+                }
+            });
+        }
+    }
+
+    std::map<std::string, Published> services_;
+    std::vector<Browser*> browsers_;
+    std::vector<PendingResolve*> pending_;
+};
+
+static MockDaemon& daemon() {
+    // never destroyed, the reactor thread may still run during static destruction
+    static auto* instance = new MockDaemon();
+    return *instance;
+}
+
+void detail::startRegister(const OperationPtr& op, RegisterRequest request) {
+    auto keys = std::make_shared<std::vector<std::string>>();
+    on_daemon([keys, services = request.services, interfaceIndex = request.scope.interfaceIndex] {
+        for (const ServiceRegistration& service : services) {
+            keys->push_back(daemon().publish(service, interfaceIndex));
+        }
+    });
+    request.registration->updateTxt = [keys](size_t index, const TxtRecord& txt) {
+        on_daemon([keys, index, txt] {
+            if (index < keys->size()) {
+                daemon().updateTxt((*keys)[index], txt);
+            }
+        });
+    };
+    op->setTeardown([keys] {
+        on_daemon([keys] {
+            for (const std::string& key : *keys) {
+                daemon().withdraw(key);
+            }
+        });
+    });
+}
+
+void detail::startBrowse(const OperationPtr& op, BrowseRequest request) {
+    auto* browser = new Browser{op, std::move(request), std::string()};
+    browser->domain = domain_or_default(browser->request.domain);
+    op->setTeardown([browser] {
+        on_daemon([browser] {
+            daemon().stopBrowse(browser);
+            delete browser;
+        });
+    });
+    on_daemon([browser] { daemon().browse(browser); });
+}
+
+void detail::startResolve(const OperationPtr& op, ResolveRequest request) {
+    auto* resolve = new PendingResolve{op, std::move(request), std::string()};
+    resolve->key = instance_key(resolve->request.serviceName, resolve->request.regType, domain_or_default(resolve->request.domain));
+    op->setTeardown([resolve] {
+        on_daemon([resolve] {
+            daemon().stopResolve(resolve);
+            delete resolve;
+        });
+    });
+    on_daemon([resolve] { daemon().resolve(resolve); });
+}
+
+void detail::startQuery(const OperationPtr& op, QueryRequest request) {
+    op->setTeardown([] {});
+    if (is_mock_host(request.hostName)) {
+        op->complete(Status::Ok);
+        request.callback(loopback(request.family), kHostRecordTtl);
+    }
+}
+
+void detail::startAddresses(const OperationPtr& op, AddressRequest request) {
+    std::optional<IPFamily> late = late_family(request.hostName);
+    if (!is_mock_host(request.hostName) && !late) {
+        op->setTeardown([] {});
+        return;
+    }
+    auto answer = [op, request = std::move(request)](IPFamily family) {
+        if (op->active()) {
+            request.onAddress(loopback(family));
+        }
+        if (op->active()) {
+            request.familyDone(family);
+        }
+    };
+    if (!late) {
+        op->setTeardown([] {});
+        answer(IPv6);
+        answer(IPv4);
+        return;
+    }
+    Reactor& loop = op->reactor();
+    Reactor::Id timer = loop.addTimer(Reactor::Clock::now() + kLateAnswer, [answer, family = *late] { answer(family); });
+    op->setTeardown([&loop, timer] { loop.removeTimer(timer); });
+    answer(*late == IPv6 ? IPv4 : IPv6);
+}
+
+}
+
+#endif  // USE_MOCK
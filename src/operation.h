@@ -0,0 +1,235 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_OPERATION_H
+#define KNOTDNSSD_OPERATION_H
+
+#include "knot/dnssd.h"
+#include "reactor.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace knot::detail {
+
+/// Shared state behind knot::Operation.
+///
+/// A backend starts the operation on the reactor thread and installs a
+/// teardown function that releases its daemon objects. cancel() may be
+/// called from any thread: it flips active() immediately so no further user
+/// callbacks are delivered and runs the teardown on the reactor thread.
+/// The first status reported decides how the operation ended; one that is
+/// torn down without a report counts as cancelled.
+class OperationState : public std::enable_shared_from_this<OperationState> {
+public:
+    explicit OperationState(Reactor& reactor) : reactor_(reactor) {}
+
+    Reactor& reactor() const { return reactor_; }
+
+    /// false once cancel() was requested or the operation finished
+    bool active() const { return !cancelRequested_.load(std::memory_order_acquire); }
+
+    bool finished() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return finished_;
+    }
+
+    /// reactor thread only
+    void setTeardown(std::function<void()> teardown) { teardown_ = std::move(teardown); }
+
+    /// reactor thread only; runs after the backend teardown, or right away if
+    /// the operation is finishing or finished already (a shared cache query
+    /// can finish it before the hook installation posted by create() comes
+    /// around, a teardown or another hook can add one)
+    void onFinish(std::function<void()> hook) {
+        if (finishing_) {
+            hook();
+            return;
+        }
+        finishHooks_.push_back(std::move(hook));
+    }
+
+    void cancel() {
+        if (cancelRequested_.exchange(true, std::memory_order_acq_rel)) {
+            return;
+        }
+        reactor_.post([self = shared_from_this()] { self->finish(); });
+    }
+
+    /// any thread; cancel() on behalf of the caller, callbacks still queued
+    /// on an executor are dropped as well
+    void abandon() {
+        abandoned_.store(true, std::memory_order_release);
+        cancel();
+    }
+
+    bool abandoned() const { return abandoned_.load(std::memory_order_acquire); }
+
+    /// any thread; the first reported status wins
+    void report(Status status) {
+        int pending = kPending;
+        status_.compare_exchange_strong(pending, static_cast<int>(status), std::memory_order_acq_rel);
+    }
+
+    /// any thread; records why the operation ends and cancels it
+    void complete(Status status) {
+        report(status);
+        cancel();
+    }
+
+    /// set at the latest when the operation finishes
+    std::optional<Status> status() const {
+        int status = status_.load(std::memory_order_acquire);
+        return status == kPending ? std::nullopt : std::optional<Status>(static_cast<Status>(status));
+    }
+
+    /// reactor thread only; releases backend objects and wakes waiters
+    void finish() {
+        finishing_ = true;
+        cancelRequested_.store(true, std::memory_order_release);
+        report(Status::Cancelled);
+        std::function<void()> teardown = std::move(teardown_);
+        teardown_ = nullptr;
+        if (teardown) {
+            teardown();
+        }
+        std::vector<std::function<void()>> hooks = std::move(finishHooks_);
+        finishHooks_.clear();
+        for (auto& hook : hooks) {
+            hook();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (finished_) {
+                return;
+            }
+            finished_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    void wait() const {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return finished_; });
+    }
+
+    bool waitFor(std::chrono::milliseconds timeout) const {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return cv_.wait_for(lock, timeout, [this] { return finished_; });
+    }
+
+private:
+    static constexpr int kPending = -1;
+
+    Reactor& reactor_;
+    std::atomic<bool> cancelRequested_{false};
+    std::atomic<bool> abandoned_{false};
+    std::atomic<int> status_{kPending};
+    std::function<void()> teardown_;
+    std::vector<std::function<void()>> finishHooks_;
+    /// reactor thread only, finish() has begun
+    bool finishing_ = false;
+    mutable std::mutex mutex_;
+    mutable std::condition_variable cv_;
+    bool finished_ = false;
+};
+
+using OperationPtr = std::shared_ptr<OperationState>;
+
+/// Times the operation out unless it finishes within timeout. onTimeout runs
+/// on the reactor thread right before the cancellation, so it can still
+/// report the outcome to the caller.
+inline void setDeadline(const OperationPtr& op, std::chrono::milliseconds timeout, std::function<void()> onTimeout) {
+    op->reactor().post([op, timeout, onTimeout = std::move(onTimeout)] {
+        if (!op->active()) {
+            return;
+        }
+        Reactor& reactor = op->reactor();
+        Reactor::Id timer = reactor.addTimer(Reactor::Clock::now() + timeout, [op, onTimeout] {
+            if (!op->active()) {
+                return;
+            }
+            op->report(Status::Timeout);
+            if (onTimeout) {
+                onTimeout();
+            }
+            op->cancel();
+        });
+        op->onFinish([&reactor, timer] { reactor.removeTimer(timer); });
+    });
+}
+
+/// Shared state behind knot::CancellationToken. The wakeup descriptor stays
+/// readable once cancelled, so any reactor watching it wakes immediately.
+class CancellationState {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    bool cancelled() const { return cancelled_.load(std::memory_order_acquire); }
+
+    void cancel() {
+        if (cancelled_.load(std::memory_order_acquire)) {
+            return;
+        }
+        cancelledAt_.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        cancelled_.store(true, std::memory_order_release);
+        wakeup_.notify();
+    }
+
+    NativeSocket fd() const { return wakeup_.fd(); }
+
+    /// reactor thread; records how long the operation took to tear down after cancel()
+    void recordTeardown() {
+        auto latency = Clock::now().time_since_epoch().count() - cancelledAt_.load(std::memory_order_relaxed);
+        auto previous = teardownLatency_.load(std::memory_order_relaxed);
+        while (latency > previous && !teardownLatency_.compare_exchange_weak(previous, latency, std::memory_order_relaxed)) {
+        }
+    }
+
+    Clock::duration teardownLatency() const { return Clock::duration(teardownLatency_.load(std::memory_order_relaxed)); }
+
+private:
+    Wakeup wakeup_;
+    std::atomic<bool> cancelled_{false};
+    std::atomic<Clock::rep> cancelledAt_{0};
+    std::atomic<Clock::rep> teardownLatency_{0};
+};
+
+using CancellationPtr = std::shared_ptr<CancellationState>;
+
+/// Ties the operation to the token: the reactor watches the token descriptor
+/// and tears the operation down as soon as it becomes readable.
+inline void bindCancellation(const OperationPtr& op, const CancellationPtr& token) {
+    op->reactor().post([op, token] {
+        if (!op->active()) {
+            return;
+        }
+        // recorded from a finish hook so waiters never observe a stale value
+        auto teardown = [op, token] {
+            op->abandon();
+            op->onFinish([token] { token->recordTeardown(); });
+            op->finish();
+        };
+        if (token->cancelled()) {
+            teardown();
+            return;
+        }
+        Reactor& reactor = op->reactor();
+        Reactor::Id watch = reactor.addWatch(token->fd(), Reactor::Readable, [teardown](unsigned) { teardown(); });
+        op->onFinish([&reactor, watch] { reactor.removeWatch(watch); });
+    });
+}
+
+}
+
+#endif //KNOTDNSSD_OPERATION_H
@@ -0,0 +1,98 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_QUEUE_H
+#define KNOTDNSSD_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace knot::detail {
+
+/// Bounded lock-free queue after Dmitry Vyukov: any thread may push, one
+/// consumer at a time pops. Every cell carries a sequence number that tells
+/// whether it is free for the push at that position or ready for the pop.
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        cells_ = std::make_unique<Cell[]>(size);
+        mask_ = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    /// moves from value only on success
+    bool tryPush(T& value) {
+        size_t position = enqueue_.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &cells_[position & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (diff == 0) {
+                if (enqueue_.compare_exchange_weak(position, position + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                position = enqueue_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// single consumer
+    bool tryPop(T& value) {
+        size_t position = dequeue_.load(std::memory_order_relaxed);
+        Cell& cell = cells_[position & mask_];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1) < 0) {
+            return false;
+        }
+        dequeue_.store(position + 1, std::memory_order_relaxed);
+        value = std::move(cell.value);
+        cell.value = T();
+        cell.sequence.store(position + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// pushes that claimed a cell and pops not yet done, possibly unpublished
+    size_t size() const {
+        size_t enqueued = enqueue_.load(std::memory_order_seq_cst);
+        size_t dequeued = dequeue_.load(std::memory_order_seq_cst);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence{0};
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> enqueue_{0};
+    alignas(64) std::atomic<size_t> dequeue_{0};
+};
+
+}
+
+#endif //KNOTDNSSD_QUEUE_H
@@ -0,0 +1,371 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#include "reactor.h"
+#include "log.h"
+
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#endif
+
+namespace knot::detail {
+
+#if defined(_WIN32)
+
+Wakeup::Wakeup() : readFd_(INVALID_SOCKET), writeFd_(INVALID_SOCKET) {
+    static const bool initialized = [] {
+        WSADATA wsaData;
+        return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+    }();
+    if (!initialized) {
+        KNOTDNSSD_LOG_ERROR("WSAStartup failed");
+        return;
+    }
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int len = sizeof(addr);
+    if (sock == INVALID_SOCKET
+        || bind(sock, reinterpret_cast<sockaddr*>(&addr), len) != 0
+        || getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &len) != 0
+        || connect(sock, reinterpret_cast<sockaddr*>(&addr), len) != 0) {
+        KNOTDNSSD_LOG_ERROR("Failed to create wakeup socket");
+        if (sock != INVALID_SOCKET) {
+            closesocket(sock);
+        }
+        return;
+    }
+    u_long nonBlocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonBlocking);
+    readFd_ = sock;
+    writeFd_ = sock;
+}
+
+Wakeup::~Wakeup() {
+    if (readFd_ != INVALID_SOCKET) {
+        closesocket(readFd_);
+    }
+}
+
+void Wakeup::notify() {
+    char byte = 1;
+    send(writeFd_, &byte, 1, 0);
+}
+
+void Wakeup::drain() {
+    char buffer[64];
+    while (recv(readFd_, buffer, sizeof(buffer), 0) > 0) {
+    }
+}
+
+#elif defined(__linux__)
+
+Wakeup::Wakeup() {
+    readFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (readFd_ == -1) {
+        KNOTDNSSD_LOG_ERROR("Failed to create eventfd");
+    }
+    writeFd_ = readFd_;
+}
+
+Wakeup::~Wakeup() {
+    if (readFd_ != -1) {
+        close(readFd_);
+    }
+}
+
+void Wakeup::notify() {
+    uint64_t one = 1;
+    ssize_t ignored = write(writeFd_, &one, sizeof(one));
+    (void) ignored;
+}
+
+void Wakeup::drain() {
+    uint64_t value;
+    ssize_t ignored = read(readFd_, &value, sizeof(value));
+    (void) ignored;
+}
+
+#else
+
+Wakeup::Wakeup() {
+    int fds[2] = {-1, -1};
+    if (pipe(fds) != 0) {
+        KNOTDNSSD_LOG_ERROR("Failed to create wakeup pipe");
+    }
+    for (int fd : fds) {
+        if (fd != -1) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    readFd_ = fds[0];
+    writeFd_ = fds[1];
+}
+
+Wakeup::~Wakeup() {
+    if (readFd_ != -1) {
+        close(readFd_);
+    }
+    if (writeFd_ != -1) {
+        close(writeFd_);
+    }
+}
+
+void Wakeup::notify() {
+    char byte = 1;
+    ssize_t ignored = write(writeFd_, &byte, 1);
+    (void) ignored;
+}
+
+void Wakeup::drain() {
+    char buffer[64];
+    while (read(readFd_, buffer, sizeof(buffer)) > 0) {
+    }
+}
+
+#endif
+
+#if defined(_WIN32)
+using PollFd = WSAPOLLFD;
+static int knotdnssd_poll(PollFd* fds, size_t count, int timeoutMs) {
+    return WSAPoll(fds, static_cast<ULONG>(count), timeoutMs);
+}
+#else
+using PollFd = struct pollfd;
+static int knotdnssd_poll(PollFd* fds, size_t count, int timeoutMs) {
+    return poll(fds, static_cast<nfds_t>(count), timeoutMs);
+}
+#endif
+
+static short toPollEvents(unsigned events) {
+    short result = 0;
+    if (events & Reactor::Readable) {
+        result |= POLLIN;
+    }
+    if (events & Reactor::Writable) {
+        result |= POLLOUT;
+    }
+    return result;
+}
+
+static unsigned fromPollEvents(short revents) {
+    unsigned result = 0;
+    if (revents & POLLIN) {
+        result |= Reactor::Readable;
+    }
+    if (revents & POLLOUT) {
+        result |= Reactor::Writable;
+    }
+    if (revents & (POLLERR | POLLNVAL)) {
+        result |= Reactor::Error;
+    }
+    if (revents & POLLHUP) {
+        result |= Reactor::HangUp;
+    }
+    return result;
+}
+
+Reactor::Reactor() {
+    thread_ = std::thread([this] { run(); });
+}
+
+Reactor::~Reactor() {
+    stop();
+}
+
+void Reactor::stop() {
+    stopping_ = true;
+    wakeup_.notify();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void Reactor::post(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(postedMutex_);
+        posted_.push_back(std::move(task));
+    }
+    wakeup_.notify();
+}
+
+size_t Reactor::queued() {
+    std::lock_guard<std::mutex> lock(postedMutex_);
+    return posted_.size();
+}
+
+bool Reactor::isLoopThread() const {
+    return std::this_thread::get_id() == thread_.get_id();
+}
+
+Reactor::Id Reactor::addWatch(NativeSocket fd, unsigned events, IoHandler handler) {
+    Id id = nextId_++;
+    watches_.emplace(id, Watch{fd, events, std::make_shared<IoHandler>(std::move(handler))});
+    return id;
+}
+
+void Reactor::updateWatch(Id id, unsigned events) {
+    auto it = watches_.find(id);
+    if (it != watches_.end()) {
+        it->second.events = events;
+    }
+}
+
+void Reactor::removeWatch(Id id) {
+    watches_.erase(id);
+}
+
+bool Reactor::readable(NativeSocket fd) {
+    PollFd pfd{};
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return knotdnssd_poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+Reactor::Id Reactor::addTimer(Clock::time_point when, Task task) {
+    Id id = nextId_++;
+    timers_.emplace(id, Timer{when, std::make_shared<Task>(std::move(task))});
+    timerQueue_.emplace(when, id);
+    return id;
+}
+
+void Reactor::removeTimer(Id id) {
+    auto it = timers_.find(id);
+    if (it == timers_.end()) {
+        return;
+    }
+    timerQueue_.erase({it->second.when, id});
+    timers_.erase(it);
+}
+
+size_t Reactor::runPosted() {
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(postedMutex_);
+        tasks.swap(posted_);
+    }
+    for (auto& task : tasks) {
+        task();
+    }
+    return tasks.size();
+}
+
+size_t Reactor::runTimers() {
+    size_t count = 0;
+    auto now = Clock::now();
+    while (!timerQueue_.empty() && timerQueue_.begin()->first <= now) {
+        Id id = timerQueue_.begin()->second;
+        timerQueue_.erase(timerQueue_.begin());
+        auto it = timers_.find(id);
+        std::shared_ptr<Task> task = std::move(it->second.task);
+        timers_.erase(it);
+        (*task)();
+        ++count;
+    }
+    return count;
+}
+
+int Reactor::pollTimeoutMs() const {
+    if (timerQueue_.empty()) {
+        return -1;
+    }
+    auto delay = timerQueue_.begin()->first - Clock::now();
+    if (delay <= Clock::duration::zero()) {
+        return 0;
+    }
+    // round up so a timer never fires early and spins the loop
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(delay + std::chrono::milliseconds(1) - Clock::duration(1));
+    return static_cast<int>(std::min<std::chrono::milliseconds::rep>(ms.count(), 60 * 1000));
+}
+
+/// Poll failures that persist (out of memory, too many descriptors) are retried
+/// with a delay doubling up to the maximum rather than spinning the loop.
+constexpr std::chrono::milliseconds kPollRetryMin(1);
+constexpr std::chrono::milliseconds kPollRetryMax(1000);
+
+void Reactor::run() {
+    std::vector<PollFd> fds;
+    std::vector<Id> ids;
+    std::chrono::milliseconds retryDelay(0);
+    uint64_t dispatches = 0;
+    uint64_t busy = 0;
+    auto busySince = Clock::now();
+
+    while (!stopping_) {
+        dispatches += runPosted();
+        dispatches += runTimers();
+
+        fds.clear();
+        ids.clear();
+        PollFd wakeupFd{};
+        wakeupFd.fd = wakeup_.fd();
+        wakeupFd.events = POLLIN;
+        fds.push_back(wakeupFd);
+        for (const auto& [id, watch] : watches_) {
+            PollFd pfd{};
+            pfd.fd = watch.fd;
+            pfd.events = toPollEvents(watch.events);
+            fds.push_back(pfd);
+            ids.push_back(id);
+        }
+
+        int timeout = pollTimeoutMs();
+        auto idleSince = Clock::now();
+        dispatches_.store(dispatches, std::memory_order_relaxed);
+        busy += std::chrono::duration_cast<std::chrono::nanoseconds>(idleSince - busySince).count();
+        busyNanos_.store(busy, std::memory_order_relaxed);
+        int ready = knotdnssd_poll(fds.data(), fds.size(), timeout);
+        busySince = Clock::now();
+        if (ready < 0) {
+#if !defined(_WIN32)
+            if (errno == EINTR) {
+                continue;
+            }
+#endif
+            // once per run of failures, the delay grows until poll recovers
+            if (retryDelay.count() == 0) {
+                KNOTDNSSD_LOG_ERROR("Reactor poll failed, retrying");
+            }
+            retryDelay = std::clamp(retryDelay * 2, kPollRetryMin, kPollRetryMax);
+            std::this_thread::sleep_for(retryDelay);
+            continue;
+        }
+        retryDelay = std::chrono::milliseconds(0);
+
+        if (fds[0].revents) {
+            wakeup_.drain();
+        }
+        for (size_t i = 1; i < fds.size(); ++i) {
+            if (!fds[i].revents) {
+                continue;
+            }
+            // a previous handler may have removed this watch
+            auto it = watches_.find(ids[i - 1]);
+            if (it == watches_.end()) {
+                continue;
+            }
+            std::shared_ptr<IoHandler> handler = it->second.handler;
+            (*handler)(fromPollEvents(fds[i].revents));
+            ++dispatches;
+        }
+    }
+}
+
+}
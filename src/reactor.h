@@ -0,0 +1,146 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_REACTOR_H
+#define KNOTDNSSD_REACTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace knot::detail {
+
+#if defined(_WIN32)
+using NativeSocket = uintptr_t;
+#else
+using NativeSocket = int;
+#endif
+
+/// Self-wakeup primitive: eventfd on Linux, a pipe on other POSIX systems and
+/// a connected loopback socket on Windows. notify() is async-signal-safe and
+/// may be called from any thread.
+class Wakeup {
+public:
+    Wakeup();
+    ~Wakeup();
+
+    Wakeup(const Wakeup&) = delete;
+    Wakeup& operator=(const Wakeup&) = delete;
+
+    NativeSocket fd() const { return readFd_; }
+    void notify();
+    void drain();
+
+private:
+    NativeSocket readFd_;
+    NativeSocket writeFd_;
+};
+
+/// Single-threaded event loop shared by every operation of a backend.
+///
+/// post() may be called from any thread. Everything else must be called on the
+/// loop thread, which is where all handlers and tasks run.
+class Reactor {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Id = uint64_t;
+    using Task = std::function<void()>;
+    using IoHandler = std::function<void(unsigned events)>;
+
+    enum Event : unsigned {
+        Readable = 1u << 0,
+        Writable = 1u << 1,
+        Error = 1u << 2,
+        HangUp = 1u << 3,
+    };
+
+    Reactor();
+    ~Reactor();
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    /// joins the loop thread; tasks still posted are dropped
+    void stop();
+
+    void post(Task task);
+    bool isLoopThread() const;
+
+    Id addWatch(NativeSocket fd, unsigned events, IoHandler handler);
+    void updateWatch(Id id, unsigned events);
+    void removeWatch(Id id);
+    /// whether fd could be read from right now, without waiting
+    static bool readable(NativeSocket fd);
+    /// Handles everything already queued on fd in one wakeup: calls process,
+    /// which consumes one message, until fd is empty. false as soon as
+    /// process fails.
+    template <typename Process>
+    static bool drain(NativeSocket fd, Process&& process) {
+        do {
+            if (!process()) {
+                return false;
+            }
+        } while (readable(fd));
+        return true;
+    }
+
+    Id addTimer(Clock::time_point when, Task task);
+    void removeTimer(Id id);
+
+    /// any thread; posted tasks, timers and socket events handled so far
+    uint64_t dispatches() const { return dispatches_.load(std::memory_order_relaxed); }
+    /// any thread; time the loop spent handling them rather than polling
+    std::chrono::nanoseconds busy() const { return std::chrono::nanoseconds(busyNanos_.load(std::memory_order_relaxed)); }
+    /// any thread; posted tasks not yet run
+    size_t queued();
+
+private:
+    struct Watch {
+        NativeSocket fd;
+        unsigned events;
+        std::shared_ptr<IoHandler> handler;
+    };
+
+    struct Timer {
+        Clock::time_point when;
+        std::shared_ptr<Task> task;
+    };
+
+    void run();
+    /// both return how many handlers ran
+    size_t runPosted();
+    size_t runTimers();
+    int pollTimeoutMs() const;
+
+    Wakeup wakeup_;
+    std::atomic<bool> stopping_{false};
+    std::mutex postedMutex_;
+    std::vector<Task> posted_;
+
+    Id nextId_ = 1;
+    std::map<Id, Watch> watches_;
+    std::map<Id, Timer> timers_;
+    std::set<std::pair<Clock::time_point, Id>> timerQueue_;
+
+    // written by the loop thread only, once per iteration
+    std::atomic<uint64_t> dispatches_{0};
+    std::atomic<uint64_t> busyNanos_{0};
+
+    std::thread thread_;
+};
+
+}
+
+#endif //KNOTDNSSD_REACTOR_H
@@ -0,0 +1,496 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#include "knot/dnssd.h"
+#include "cache.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <share.h>
+#include <sys/stat.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// File layout, little-endian and without padding, so it is read straight out
+// of the mapping:
+//
+//   header    "KNSS", u16 version, u16 reserved, i64 saved at (Unix seconds)
+//   records   u8 kind, then
+//     Instance  str directory type, str directory domain, str name, str type, str domain
+//     Resolve   str cache key, i64 expires, u8 parts, [str host], [address], u16 port, str TXT
+//     Address   str cache key, i64 expires, address
+//
+// str is a u16 length and the bytes, address is u8 family, 16 bytes, u32
+// interface index and u32 scope id. Expiry times are Unix seconds as well,
+// the steady clock of the cache does not survive a restart.
+
+namespace knot::detail {
+
+namespace {
+
+constexpr char kMagic[4] = {'K', 'N', 'S', 'S'};
+constexpr uint16_t kVersion = 1;
+
+enum RecordKind : uint8_t {
+    InstanceRecord = 1,
+    ResolveRecord = 2,
+    AddressRecord = 3,
+};
+
+enum ResolveParts : uint8_t {
+    HasHostName = 1,
+    HasAddress = 2,
+};
+
+using SystemClock = std::chrono::system_clock;
+using SteadyClock = std::chrono::steady_clock;
+
+int64_t toUnix(SteadyClock::time_point expires) {
+    auto remaining = std::chrono::duration_cast<std::chrono::seconds>(expires - SteadyClock::now());
+    return std::chrono::duration_cast<std::chrono::seconds>(SystemClock::now().time_since_epoch()).count() + remaining.count();
+}
+
+SteadyClock::time_point fromUnix(int64_t expires) {
+    int64_t now = std::chrono::duration_cast<std::chrono::seconds>(SystemClock::now().time_since_epoch()).count();
+    return SteadyClock::now() + std::chrono::seconds(expires - now);
+}
+
+class Writer {
+public:
+    void u8(uint8_t value) { out_.push_back(static_cast<char>(value)); }
+
+    void u16(uint16_t value) {
+        u8(static_cast<uint8_t>(value));
+        u8(static_cast<uint8_t>(value >> 8));
+    }
+
+    void u32(uint32_t value) {
+        u16(static_cast<uint16_t>(value));
+        u16(static_cast<uint16_t>(value >> 16));
+    }
+
+    void i64(int64_t value) {
+        auto bits = static_cast<uint64_t>(value);
+        u32(static_cast<uint32_t>(bits));
+        u32(static_cast<uint32_t>(bits >> 32));
+    }
+
+    /// false if it does not fit the u16 length
+    bool str(std::string_view value) {
+        if (value.size() > UINT16_MAX) {
+            return false;
+        }
+        u16(static_cast<uint16_t>(value.size()));
+        out_.append(value);
+        return true;
+    }
+
+    void address(const IPAddress& address) {
+        u8(address.family);
+        out_.append(reinterpret_cast<const char*>(address.bytes.data()), address.bytes.size());
+        u32(address.interfaceIndex);
+        u32(address.scopeId);
+    }
+
+    /// rolls a record back that turned out not to fit
+    size_t mark() const { return out_.size(); }
+    void rewind(size_t mark) { out_.resize(mark); }
+
+    const std::string& data() const { return out_; }
+
+private:
+    std::string out_;
+};
+
+/// Bounds-checked cursor; once a read overruns, every later one fails too.
+class Reader {
+public:
+    Reader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+    bool done() const { return position_ == size_; }
+    bool ok() const { return ok_; }
+
+    uint8_t u8() {
+        const uint8_t* bytes = take(1);
+        return bytes ? bytes[0] : 0;
+    }
+
+    uint16_t u16() {
+        const uint8_t* bytes = take(2);
+        return bytes ? static_cast<uint16_t>(bytes[0] | bytes[1] << 8) : 0;
+    }
+
+    uint32_t u32() {
+        uint32_t low = u16();
+        return low | static_cast<uint32_t>(u16()) << 16;
+    }
+
+    int64_t i64() {
+        uint64_t low = u32();
+        return static_cast<int64_t>(low | static_cast<uint64_t>(u32()) << 32);
+    }
+
+    std::string_view str() {
+        uint16_t size = u16();
+        const uint8_t* bytes = take(size);
+        return bytes ? std::string_view(reinterpret_cast<const char*>(bytes), size) : std::string_view();
+    }
+
+    IPAddress address() {
+        IPAddress address;
+        address.family = u8() == IPv6 ? IPv6 : IPv4;
+        if (const uint8_t* bytes = take(address.bytes.size())) {
+            std::memcpy(address.bytes.data(), bytes, address.bytes.size());
+        }
+        address.interfaceIndex = u32();
+        address.scopeId = u32();
+        return address;
+    }
+
+private:
+    const uint8_t* take(size_t size) {
+        if (!ok_ || size_ - position_ < size) {
+            ok_ = false;
+            return nullptr;
+        }
+        const uint8_t* bytes = data_ + position_;
+        position_ += size;
+        return bytes;
+    }
+
+    const uint8_t* data_;
+    size_t size_;
+    size_t position_ = 0;
+    bool ok_ = true;
+};
+
+/// Whole file, read-only; mapped where the platform allows.
+class MappedFile {
+public:
+    explicit MappedFile(const char* path) {
+#if defined(_WIN32)
+        FILE* file = fopen(path, "rb");
+        if (!file) {
+            return;
+        }
+        char buffer[4096];
+        size_t read;
+        while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            copy_.append(buffer, read);
+        }
+        fclose(file);
+        data_ = reinterpret_cast<const uint8_t*>(copy_.data());
+        size_ = copy_.size();
+#else
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return;
+        }
+        struct stat info{};
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* mapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                data_ = static_cast<const uint8_t*>(mapping);
+                size_ = static_cast<size_t>(info.st_size);
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~MappedFile() {
+#if !defined(_WIN32)
+        if (data_) {
+            munmap(const_cast<uint8_t*>(data_), size_);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+#if defined(_WIN32)
+    std::string copy_;
+#endif
+};
+
+/// Writes data to a new file next to path, named uniquely so that concurrent
+/// saves never share one, and flushes it to disk. Its name goes to temporary.
+bool writeTemporary(const char* path, const std::string& data, std::string& temporary) {
+    temporary = std::string(path) + ".XXXXXX";
+#if defined(_WIN32)
+    int fd = -1;
+    if (_mktemp_s(temporary.data(), temporary.size() + 1) != 0 ||
+        _sopen_s(&fd, temporary.c_str(), _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _SH_DENYRW, _S_IREAD | _S_IWRITE) != 0) {
+        return false;
+    }
+    bool written = true;
+    for (size_t offset = 0; written && offset < data.size();) {
+        int chunk = _write(fd, data.data() + offset, static_cast<unsigned>(std::min<size_t>(data.size() - offset, INT_MAX)));
+        written = chunk > 0;
+        offset += written ? static_cast<size_t>(chunk) : 0;
+    }
+    written = written && _commit(fd) == 0;
+    written = _close(fd) == 0 && written;
+#else
+    int fd = mkstemp(temporary.data());
+    if (fd == -1) {
+        return false;
+    }
+    bool written = true;
+    for (size_t offset = 0; written && offset < data.size();) {
+        ssize_t chunk = write(fd, data.data() + offset, data.size() - offset);
+        if (chunk == -1 && errno == EINTR) {
+            continue;
+        }
+        written = chunk > 0;
+        offset += written ? static_cast<size_t>(chunk) : 0;
+    }
+    written = written && fsync(fd) == 0;
+    written = close(fd) == 0 && written;
+#endif
+    if (!written) {
+        std::remove(temporary.c_str());
+    }
+    return written;
+}
+
+/// Puts temporary in the place of path in one step: readers see either the
+/// old file or the new one, never none.
+bool replaceFile(const std::string& temporary, const char* path) {
+#if defined(_WIN32)
+    // rename() does not replace an existing file there
+    return MoveFileExA(temporary.c_str(), path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if (std::rename(temporary.c_str(), path) != 0) {
+        return false;
+    }
+    // the rename itself only lasts once the directory is on disk too
+    std::string directory(path);
+    size_t slash = directory.rfind('/');
+    directory = slash == std::string::npos ? "." : slash == 0 ? "/" : directory.substr(0, slash);
+    int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    return true;
+#endif
+}
+
+/// Directory instances of the last loadSnapshot(), by directory type and domain.
+struct WarmStart {
+    std::mutex mutex;
+    std::map<std::pair<std::string, std::string>, std::vector<ServiceInstance>> instances;
+};
+
+WarmStart& warmStart() {
+    // never destroyed, directories may be created during static destruction
+    static auto* instance = new WarmStart();
+    return *instance;
+}
+
+struct ParsedResolve {
+    std::string key;
+    int64_t expires;
+    ResolveReply reply;
+};
+
+struct ParsedAddress {
+    std::string key;
+    int64_t expires;
+    IPAddress address;
+};
+
+}
+
+std::vector<ServiceInstance> warmInstances(const std::string& regType, const std::string& domain) {
+    WarmStart& warm = warmStart();
+    std::lock_guard<std::mutex> lock(warm.mutex);
+    auto it = warm.instances.find({regType, domain});
+    return it != warm.instances.end() ? it->second : std::vector<ServiceInstance>();
+}
+
+}
+
+namespace knot {
+
+bool saveSnapshot(const char* path) {
+    using namespace detail;
+    Writer writer;
+    writer.u8(static_cast<uint8_t>(kMagic[0]));
+    writer.u8(static_cast<uint8_t>(kMagic[1]));
+    writer.u8(static_cast<uint8_t>(kMagic[2]));
+    writer.u8(static_cast<uint8_t>(kMagic[3]));
+    writer.u16(kVersion);
+    writer.u16(0);
+    writer.i64(std::chrono::duration_cast<std::chrono::seconds>(SystemClock::now().time_since_epoch()).count());
+
+    // records that do not fit the format are left out, they are only a head start
+    for (const DirectoryInstance& entry : directoryInstances()) {
+        size_t mark = writer.mark();
+        writer.u8(InstanceRecord);
+        if (!writer.str(entry.regType) || !writer.str(entry.domain) || !writer.str(entry.instance.serviceName) ||
+            !writer.str(entry.instance.regType) || !writer.str(entry.instance.replyDomain)) {
+            writer.rewind(mark);
+        }
+    }
+    resolveCache().forEach([&writer](const std::string& key, const ResolveReply& reply, SteadyClock::time_point expires) {
+        size_t mark = writer.mark();
+        writer.u8(ResolveRecord);
+        bool fits = writer.str(key);
+        writer.i64(toUnix(expires));
+        writer.u8((reply.hostName ? HasHostName : 0) | (reply.ip ? HasAddress : 0));
+        if (reply.hostName) {
+            fits = writer.str(*reply.hostName) && fits;
+        }
+        if (reply.ip) {
+            writer.address(*reply.ip);
+        }
+        writer.u16(reply.port);
+        fits = writer.str(std::string_view(reinterpret_cast<const char*>(reply.txt.data()), reply.txt.size())) && fits;
+        if (!fits) {
+            writer.rewind(mark);
+        }
+    });
+    queryCache().forEach([&writer](const std::string& key, const IPAddress& address, SteadyClock::time_point expires) {
+        size_t mark = writer.mark();
+        writer.u8(AddressRecord);
+        if (!writer.str(key)) {
+            writer.rewind(mark);
+            return;
+        }
+        writer.i64(toUnix(expires));
+        writer.address(address);
+    });
+
+    // written aside and moved over the old file, so a reader never sees half of it
+    std::string temporary;
+    if (!writeTemporary(path, writer.data(), temporary)) {
+        return false;
+    }
+    if (!replaceFile(temporary, path)) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool loadSnapshot(const char* path, std::chrono::seconds maxAge) {
+    using namespace detail;
+    MappedFile file(path);
+    if (!file.data()) {
+        return false;
+    }
+    Reader reader(file.data(), file.size());
+    for (char expected : kMagic) {
+        if (reader.u8() != static_cast<uint8_t>(expected)) {
+            return false;
+        }
+    }
+    if (reader.u16() != kVersion) {
+        return false;
+    }
+    reader.u16();
+    int64_t savedAt = reader.i64();
+    int64_t horizon = std::chrono::duration_cast<std::chrono::seconds>(SystemClock::now().time_since_epoch() - maxAge).count();
+
+    // everything is parsed before anything is applied, a damaged file changes nothing
+    std::vector<DirectoryInstance> instances;
+    std::vector<ParsedResolve> resolves;
+    std::vector<ParsedAddress> addresses;
+    while (reader.ok() && !reader.done()) {
+        switch (reader.u8()) {
+            case InstanceRecord: {
+                DirectoryInstance entry;
+                entry.regType = reader.str();
+                entry.domain = reader.str();
+                entry.instance.serviceName = reader.str();
+                entry.instance.regType = reader.str();
+                entry.instance.replyDomain = reader.str();
+                instances.push_back(std::move(entry));
+                break;
+            }
+            case ResolveRecord: {
+                ParsedResolve entry;
+                entry.key = reader.str();
+                entry.expires = reader.i64();
+                uint8_t parts = reader.u8();
+                if (parts & HasHostName) {
+                    entry.reply.hostName = std::string(reader.str());
+                }
+                if (parts & HasAddress) {
+                    entry.reply.ip = reader.address();
+                }
+                entry.reply.port = reader.u16();
+                std::string_view txt = reader.str();
+                entry.reply.txt = TxtRecord::fromWire(txt.data(), txt.size());
+                resolves.push_back(std::move(entry));
+                break;
+            }
+            case AddressRecord: {
+                ParsedAddress entry;
+                entry.key = reader.str();
+                entry.expires = reader.i64();
+                entry.address = reader.address();
+                addresses.push_back(std::move(entry));
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    if (!reader.ok()) {
+        return false;
+    }
+
+    if (savedAt >= horizon) {
+        WarmStart& warm = warmStart();
+        std::lock_guard<std::mutex> lock(warm.mutex);
+        warm.instances.clear();
+        for (DirectoryInstance& entry : instances) {
+            warm.instances[{std::move(entry.regType), std::move(entry.domain)}].push_back(std::move(entry.instance));
+        }
+    }
+    for (ParsedResolve& entry : resolves) {
+        if (entry.expires >= horizon) {
+            resolveCache().seed(entry.key, std::move(entry.reply), fromUnix(entry.expires));
+        }
+    }
+    for (const ParsedAddress& entry : addresses) {
+        if (entry.expires >= horizon) {
+            queryCache().seed(entry.key, entry.address, fromUnix(entry.expires));
+        }
+    }
+    return true;
+}
+
+}
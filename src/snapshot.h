@@ -0,0 +1,33 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_SNAPSHOT_H
+#define KNOTDNSSD_SNAPSHOT_H
+
+#include "knot/dnssd.h"
+
+#include <string>
+#include <vector>
+
+namespace knot::detail {
+
+/// Instance of the directory browsing regType in domain, as passed to its constructor.
+struct DirectoryInstance {
+    std::string regType;
+    std::string domain;
+    ServiceInstance instance;
+};
+
+/// every instance of every live directory
+std::vector<DirectoryInstance> directoryInstances();
+
+/// what loadSnapshot() read for directories of regType in domain
+std::vector<ServiceInstance> warmInstances(const std::string& regType, const std::string& domain);
+
+}
+
+#endif //KNOTDNSSD_SNAPSHOT_H
@@ -0,0 +1,151 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#include "knot/dnssd.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace knot {
+
+static bool keys_equal(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+void TxtRecord::const_iterator::load() {
+    // zero-length strings carry nothing (an empty record is a single zero byte)
+    while (position_ < wire_.size() && wire_[position_] == 0) {
+        ++position_;
+    }
+    if (position_ >= wire_.size()) {
+        position_ = wire_.size();
+        return;
+    }
+    std::string_view text = wire_.substr(position_ + 1, static_cast<uint8_t>(wire_[position_]));
+    size_t equals = text.find('=');
+    if (equals == std::string_view::npos) {
+        entry_ = {text, std::nullopt};
+    } else {
+        entry_ = {text.substr(0, equals), text.substr(equals + 1)};
+    }
+}
+
+TxtRecord::TxtRecord(const std::unordered_map<std::string, std::string>& txt) {
+    for (const auto& [key, value] : txt) {
+        set(key, value);
+    }
+}
+
+TxtRecord::TxtRecord(std::initializer_list<std::pair<std::string_view, std::string_view>> txt) {
+    for (const auto& [key, value] : txt) {
+        set(key, value);
+    }
+}
+
+/// length of the complete strings at the start of the wire data
+static size_t valid_length(const char* bytes, size_t size) {
+    size_t valid = 0;
+    while (valid < size && valid + 1 + static_cast<uint8_t>(bytes[valid]) <= size) {
+        valid += 1 + static_cast<uint8_t>(bytes[valid]);
+    }
+    return valid;
+}
+
+TxtRecord TxtRecord::fromWire(const void* data, size_t size) {
+    TxtRecord record;
+    auto* bytes = static_cast<const char*>(data);
+    record.wire_.assign(bytes, valid_length(bytes, size));
+    return record;
+}
+
+bool TxtRecord::set(std::string_view key, std::string_view value) {
+    if (key.empty() || key.size() + 1 + value.size() > 255) {
+        return false;
+    }
+    remove(key);
+    wire_.push_back(static_cast<char>(key.size() + 1 + value.size()));
+    wire_.append(key);
+    wire_.push_back('=');
+    wire_.append(value);
+    return true;
+}
+
+bool TxtRecord::set(std::string_view key) {
+    if (key.empty() || key.size() > 255) {
+        return false;
+    }
+    remove(key);
+    wire_.push_back(static_cast<char>(key.size()));
+    wire_.append(key);
+    return true;
+}
+
+bool TxtRecord::remove(std::string_view key) {
+    TxtView view = this->view();
+    const_iterator it = view.find(key);
+    if (it == view.end()) {
+        return false;
+    }
+    wire_.erase(it.position_, 1 + static_cast<uint8_t>(wire_[it.position_]));
+    return true;
+}
+
+std::optional<std::string_view> TxtRecord::get(std::string_view key) const {
+    return view().get(key);
+}
+
+bool TxtRecord::contains(std::string_view key) const {
+    return view().contains(key);
+}
+
+std::unordered_map<std::string, std::string> TxtRecord::toMap() const {
+    std::unordered_map<std::string, std::string> result;
+    TxtView view = this->view();
+    for (auto it = view.begin(); it != view.end(); ++it) {
+        // the first occurrence of a key wins, in any case, see RFC 6763, section 6.4
+        if (view.find(it->key) == it) {
+            result.emplace(it->key, it->value.value_or(std::string_view()));
+        }
+    }
+    return result;
+}
+
+TxtView TxtRecord::view() const {
+    return TxtView(wire_.data(), wire_.size());
+}
+
+TxtView::TxtView(const void* data, size_t size) {
+    auto* bytes = static_cast<const char*>(data);
+    if (bytes) {
+        wire_ = std::string_view(bytes, valid_length(bytes, size));
+    }
+}
+
+TxtView::const_iterator TxtView::find(std::string_view key) const {
+    for (auto it = begin(); it != end(); ++it) {
+        if (keys_equal(it->key, key)) {
+            return it;
+        }
+    }
+    return end();
+}
+
+std::optional<std::string_view> TxtView::get(std::string_view key) const {
+    const_iterator it = find(key);
+    if (it == end()) {
+        return std::nullopt;
+    }
+    return it->value ? it->value : std::string_view();
+}
+
+bool TxtView::contains(std::string_view key) const {
+    return find(key) != end();
+}
+
+}
@@ -8,7 +8,6 @@
 #include "util.h"
 
 #include <string.h>
-#include <stdbool.h>
 
 #if defined(_WIN32)
 #include <winsock2.h>
@@ -18,34 +17,17 @@
 #include <arpa/inet.h>
 #endif
 
-const char* knotdnssd_parse_inet_addr(uint16_t rdlen, const void* rdata) {
-    bool is_v6 = rdlen == 16;
-    char buffer[INET6_ADDRSTRLEN];
-    const char* result;
-#if defined(_WIN32)
-    WSADATA wsaData;
-    int r = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (r != 0) {
-        return NULL;
-    }
-#endif
-    if (is_v6) {
-        struct sockaddr_in6 sa = {0};
-        sa.sin6_family = AF_INET6;
-        memcpy(&sa.sin6_addr, rdata, 16);
-        result = inet_ntop(AF_INET6, &(sa.sin6_addr), buffer, INET6_ADDRSTRLEN);
-    } else {
-        struct sockaddr_in sa = {0};
-        sa.sin_family = AF_INET;
-        memcpy(&sa.sin_addr, rdata, 4);
-        result = inet_ntop(AF_INET, &(sa.sin_addr), buffer, INET_ADDRSTRLEN);
+// inet_ntop is a pure conversion and needs no WSAStartup on Windows
+const char* knotdnssd_format_inet_addr(uint16_t rdlen, const void* rdata, char* buffer, size_t size) {
+    if (rdlen == 16) {
+        struct in6_addr addr;
+        memcpy(&addr, rdata, 16);
+        return inet_ntop(AF_INET6, &addr, buffer, (socklen_t) size);
     }
-#if defined(_WIN32)
-    WSACleanup();
-#endif
-    /*if (result == NULL) {
-        return NULL;
+    if (rdlen == 4) {
+        struct in_addr addr;
+        memcpy(&addr, rdata, 4);
+        return inet_ntop(AF_INET, &addr, buffer, (socklen_t) size);
     }
-    return strdup(result);*/
-    return result;
+    return NULL;
 }
@@ -12,9 +12,15 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
-const char* knotdnssd_parse_inet_addr(uint16_t rdlen, const void* rdata);
+/// large enough for any IPv6 address in text form
+#define KNOTDNSSD_INET_ADDRSTRLEN 46
+
+/// Formats a 4 (IPv4) or 16 (IPv6) byte address into the caller's buffer.
+/// Returns buffer, or NULL if rdlen is invalid or the buffer is too small.
+const char* knotdnssd_format_inet_addr(uint16_t rdlen, const void* rdata, char* buffer, size_t size);
 
 #ifdef __cplusplus
 } // extern "C"
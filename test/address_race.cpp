@@ -0,0 +1,101 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+// resolveAddressesAsync prefers IPv6 and holds an IPv4 answer back for the
+// resolution delay only. The mock's late hosts answer for one family 300ms
+// after the other.
+
+#include "check.h"
+#include "knot/dnssd.h"
+
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+struct Race {
+    std::mutex mutex;
+    std::vector<knot::IPFamily> order;
+    std::optional<knot::IPFamily> first;
+    milliseconds firstAfter{0};
+    milliseconds completeAfter{0};
+    bool complete = false;
+};
+
+static milliseconds since(Clock::time_point start) {
+    return std::chrono::duration_cast<milliseconds>(Clock::now() - start);
+}
+
+static void run(Race& race, const char* hostName, milliseconds resolutionDelay) {
+    auto start = Clock::now();
+    knot::AddressHandlers handlers;
+    handlers.onAddress = [&race](const knot::IPAddress& address) {
+        std::lock_guard<std::mutex> lock(race.mutex);
+        race.order.push_back(address.family);
+    };
+    handlers.onFirstUsable = [&race, start](const knot::IPAddress& address) {
+        std::lock_guard<std::mutex> lock(race.mutex);
+        race.first = address.family;
+        race.firstAfter = since(start);
+    };
+    handlers.onComplete = [&race, start] {
+        std::lock_guard<std::mutex> lock(race.mutex);
+        race.completeAfter = since(start);
+        race.complete = true;
+    };
+    handlers.resolutionDelay = resolutionDelay;
+    knot::Operation operation = knot::resolveAddressesAsync(hostName, std::move(handlers));
+    KNOTDNSSD_CHECK(operation.waitFor(milliseconds(5000)));
+    KNOTDNSSD_CHECK(operation.status() == knot::Status::Ok);
+    // the callbacks may still be on their way when the operation is done
+    KNOTDNSSD_CHECK(knot::test::eventually([&race] {
+        std::lock_guard<std::mutex> lock(race.mutex);
+        return race.complete;
+    }));
+}
+
+static void checkLateIPv4() {
+    // IPv6 comes first and is used right away
+    Race race;
+    run(race, "knotdnssd-mock-late4.local.", milliseconds(50));
+    std::lock_guard<std::mutex> lock(race.mutex);
+    KNOTDNSSD_CHECK(race.order == std::vector<knot::IPFamily>({knot::IPv6, knot::IPv4}));
+    KNOTDNSSD_CHECK(race.first == knot::IPv6);
+    KNOTDNSSD_CHECK(race.firstAfter < milliseconds(250));
+    KNOTDNSSD_CHECK(race.completeAfter >= milliseconds(300));
+}
+
+static void checkLateIPv6WithinDelay() {
+    // the IPv4 answer waits, and IPv6 arrives before the delay is up
+    Race race;
+    run(race, "knotdnssd-mock-late6.local.", milliseconds(1000));
+    std::lock_guard<std::mutex> lock(race.mutex);
+    KNOTDNSSD_CHECK(race.order == std::vector<knot::IPFamily>({knot::IPv4, knot::IPv6}));
+    KNOTDNSSD_CHECK(race.first == knot::IPv6);
+    KNOTDNSSD_CHECK(race.firstAfter >= milliseconds(300) && race.firstAfter < milliseconds(900));
+}
+
+static void checkLateIPv6AfterDelay() {
+    // the delay runs out before IPv6 arrives, so IPv4 is used
+    Race race;
+    run(race, "knotdnssd-mock-late6.local.", milliseconds(100));
+    std::lock_guard<std::mutex> lock(race.mutex);
+    KNOTDNSSD_CHECK(race.order == std::vector<knot::IPFamily>({knot::IPv4, knot::IPv6}));
+    KNOTDNSSD_CHECK(race.first == knot::IPv4);
+    KNOTDNSSD_CHECK(race.firstAfter >= milliseconds(100) && race.firstAfter < milliseconds(300));
+    KNOTDNSSD_CHECK(race.completeAfter >= milliseconds(300));
+}
+
+int main() {
+    checkLateIPv4();
+    checkLateIPv6WithinDelay();
+    checkLateIPv6AfterDelay();
+    return knot::test::result();
+}
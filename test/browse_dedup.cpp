@@ -0,0 +1,81 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+// A deduplicated browse reports an instance once however many interfaces see
+// it, and removes it once the last of them lets go; events repeated on one
+// interface count once.
+
+#include "browse_dedup.h"
+#include "check.h"
+#include "reactor.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using knot::detail::BrowseDedup;
+
+struct Seen {
+    knot::BrowseEvent event;
+    std::vector<uint32_t> interfaces;
+};
+
+static knot::BrowseReply event(knot::BrowseEvent kind, uint32_t interfaceIndex) {
+    knot::BrowseReply reply{"dedup-a", "_dedup._tcp.", "local.", kind};
+    reply.interfaceIndex = interfaceIndex;
+    return reply;
+}
+
+static void checkRepeatedAdd() {
+    knot::detail::Reactor reactor;
+    std::vector<Seen> seen;
+    BrowseDedup dedup(std::make_shared<knot::detail::OperationState>(reactor), [&seen](const knot::BrowseReply& reply) {
+        seen.push_back({reply.event, std::vector<uint32_t>(reply.interfaces, reply.interfaces + reply.interfaceCount)});
+    });
+
+    // the daemon announces the instance twice on interface 2, then withdraws it there once
+    dedup.apply(event(knot::ServiceAdded, 2));
+    dedup.apply(event(knot::ServiceAdded, 2));
+    KNOTDNSSD_CHECK(seen.size() == 1);
+    dedup.apply(event(knot::ServiceRemoved, 2));
+    KNOTDNSSD_CHECK(seen.size() == 2);
+    KNOTDNSSD_CHECK(seen.size() == 2 && seen[1].event == knot::ServiceRemoved && seen[1].interfaces.empty());
+
+    // a remove for an instance that is gone already is dropped
+    dedup.apply(event(knot::ServiceRemoved, 2));
+    KNOTDNSSD_CHECK(seen.size() == 2);
+}
+
+static void checkInterfaces() {
+    knot::detail::Reactor reactor;
+    std::vector<Seen> seen;
+    BrowseDedup dedup(std::make_shared<knot::detail::OperationState>(reactor), [&seen](const knot::BrowseReply& reply) {
+        seen.push_back({reply.event, std::vector<uint32_t>(reply.interfaces, reply.interfaces + reply.interfaceCount)});
+    });
+
+    // one burst over two interfaces gives one add that lists both
+    knot::BrowseReply first = event(knot::ServiceAdded, 3);
+    first.moreComing = true;
+    dedup.apply(first);
+    dedup.apply(event(knot::ServiceAdded, 2));
+    KNOTDNSSD_CHECK(seen.size() == 1);
+    KNOTDNSSD_CHECK(!seen.empty() && seen[0].event == knot::ServiceAdded);
+    KNOTDNSSD_CHECK(!seen.empty() && seen[0].interfaces == std::vector<uint32_t>({2, 3}));
+
+    // a remove on an interface the instance was never seen on changes nothing
+    dedup.apply(event(knot::ServiceRemoved, 4));
+    dedup.apply(event(knot::ServiceRemoved, 2));
+    KNOTDNSSD_CHECK(seen.size() == 1);
+    dedup.apply(event(knot::ServiceRemoved, 3));
+    KNOTDNSSD_CHECK(seen.size() == 2 && seen[1].event == knot::ServiceRemoved);
+}
+
+int main() {
+    checkRepeatedAdd();
+    checkInterfaces();
+    return knot::test::result();
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+#ifndef KNOTDNSSD_TEST_CHECK_H
+#define KNOTDNSSD_TEST_CHECK_H
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+namespace knot::test {
+
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+/// polls condition until it holds or timeout passes; callbacks arrive on the
+/// event loop thread, so checks of their effects wait for them this way
+template <typename Condition>
+bool eventually(Condition&& condition, std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+/// exit code of a test executable
+inline int result() {
+    if (failures() > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures());
+        return 1;
+    }
+    return 0;
+}
+
+}
+
+/// reports a failed condition and carries on with the test
+#define KNOTDNSSD_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++::knot::test::failures(); \
+        } \
+    } while (false)
+
+#endif //KNOTDNSSD_TEST_CHECK_H
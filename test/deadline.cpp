@@ -0,0 +1,105 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+// Lookups nobody answers end with Status::Timeout once their deadline passes,
+// and blocking calls made on the event loop thread fail instead of hanging.
+// The mock backend never answers for hosts and instances it does not know.
+
+#include "check.h"
+#include "knot/dnssd.h"
+
+#include <atomic>
+#include <chrono>
+#include <optional>
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+static milliseconds since(Clock::time_point start) {
+    return std::chrono::duration_cast<milliseconds>(Clock::now() - start);
+}
+
+static void checkOptionTimeout() {
+    std::atomic<int> calls{0};
+    std::atomic<bool> answered{false};
+    knot::OperationOptions options;
+    options.timeout = milliseconds(200);
+    auto start = Clock::now();
+    knot::Operation query = knot::queryIPv4AddressAsync("nobody.local.", [&](const std::optional<knot::IPAddress>& address) {
+        ++calls;
+        answered = address.has_value();
+    }, options);
+    KNOTDNSSD_CHECK(query.waitFor(milliseconds(2000)));
+    milliseconds elapsed = since(start);
+    KNOTDNSSD_CHECK(query.status() == knot::Status::Timeout);
+    KNOTDNSSD_CHECK(elapsed >= milliseconds(200) && elapsed < milliseconds(1000));
+    // the callback learns about the timeout once, without an address
+    KNOTDNSSD_CHECK(knot::test::eventually([&] { return calls == 1; }));
+    KNOTDNSSD_CHECK(!answered);
+}
+
+static void checkDefaultTimeout() {
+    knot::setDefaultTimeout(milliseconds(300));
+    std::atomic<int> calls{0};
+    auto start = Clock::now();
+    knot::Operation resolve = knot::resolveServiceAsync("nobody", "_deadline._tcp", nullptr, [&](const std::optional<knot::ResolveReply>& reply) {
+        calls += reply ? 100 : 1;
+    });
+    KNOTDNSSD_CHECK(resolve.waitFor(milliseconds(2000)));
+    milliseconds elapsed = since(start);
+    KNOTDNSSD_CHECK(resolve.status() == knot::Status::Timeout);
+    KNOTDNSSD_CHECK(elapsed >= milliseconds(300) && elapsed < milliseconds(1100));
+    KNOTDNSSD_CHECK(knot::test::eventually([&] { return calls == 1; }));
+
+    // the blocking variant ends the same way
+    start = Clock::now();
+    knot::Status status = knot::queryIPv6Address("nobody.local.", [](const std::optional<knot::IPAddress>&) {});
+    KNOTDNSSD_CHECK(status == knot::Status::Timeout);
+    KNOTDNSSD_CHECK(since(start) < milliseconds(1100));
+
+    // zero disables the deadline
+    knot::setDefaultTimeout(milliseconds(0));
+    knot::Operation open = knot::queryIPv4AddressAsync("nobody.local.", [](const std::optional<knot::IPAddress>&) {});
+    KNOTDNSSD_CHECK(!open.waitFor(milliseconds(400)));
+    open.cancel();
+    knot::setDefaultTimeout(milliseconds(10000));
+}
+
+static void checkBlockingOnLoopThread() {
+    knot::Registration registration = knot::registerServiceAsync("deadline-a", "_deadline._tcp", nullptr, 8080, {});
+    std::atomic<bool> called{false};
+    std::atomic<bool> quick{true};
+    std::optional<knot::Status> resolved;
+    std::optional<knot::Status> queried;
+    knot::Operation browse = knot::browseServicesAsync("_deadline._tcp", nullptr, [&](const knot::BrowseReply& reply) {
+        if (reply.event != knot::ServiceAdded || called) {
+            return;
+        }
+        // would wait for the loop that is running this callback
+        auto start = Clock::now();
+        resolved = knot::resolveService(reply.serviceName, reply.regType, reply.replyDomain, [](const std::optional<knot::ResolveReply>&) {});
+        queried = knot::queryIPv4Address("knotdnssd-mock.local.", [](const std::optional<knot::IPAddress>&) {});
+        quick = since(start) < milliseconds(500);
+        called = true;
+    });
+    KNOTDNSSD_CHECK(knot::test::eventually([&] { return called.load(); }));
+    browse.cancel();
+    KNOTDNSSD_CHECK(resolved == knot::Status::Failed);
+    KNOTDNSSD_CHECK(queried == knot::Status::Failed);
+    KNOTDNSSD_CHECK(quick);
+
+    // the same calls work from an ordinary thread
+    knot::Status status = knot::resolveService("deadline-a", "_deadline._tcp", nullptr, [](const std::optional<knot::ResolveReply>&) {});
+    KNOTDNSSD_CHECK(status == knot::Status::Ok);
+}
+
+int main() {
+    checkOptionTimeout();
+    checkDefaultTimeout();
+    checkBlockingOnLoopThread();
+    return knot::test::result();
+}
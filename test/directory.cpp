@@ -0,0 +1,127 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+// ServiceDirectory snapshots follow registrations and withdrawals, a pinned
+// view stays intact while the directory moves on, and instances of a
+// warm-start snapshot go away when nothing confirms them.
+
+#include "check.h"
+#include "knot/dnssd.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static std::vector<std::string> names(const knot::ServiceDirectory& directory) {
+    std::vector<std::string> result;
+    knot::ServiceDirectory::View view = directory.view();
+    for (const auto& instance : view->instances) {
+        result.push_back(instance->serviceName);
+    }
+    return result;
+}
+
+static void checkAddRemove() {
+    knot::ServiceDirectory directory("_directory._tcp", nullptr);
+    KNOTDNSSD_CHECK(directory.view()->instances.empty());
+
+    knot::Registration b = knot::registerServiceAsync("dir-b", "_directory._tcp", nullptr, 8080, {});
+    knot::Registration a = knot::registerServiceAsync("dir-a", "_directory._tcp", nullptr, 8080, {});
+    KNOTDNSSD_CHECK(knot::test::eventually([&] { return names(directory) == std::vector<std::string>{"dir-a", "dir-b"}; }));
+    uint64_t version = directory.view()->version;
+    KNOTDNSSD_CHECK(directory.view()->find("dir-b") != nullptr);
+    KNOTDNSSD_CHECK(directory.view()->find("dir-c") == nullptr);
+
+    // a view pinned before the withdrawal keeps what it saw
+    knot::ServiceDirectory::View pinned = directory.view();
+    b.cancel();
+    KNOTDNSSD_CHECK(knot::test::eventually([&] { return names(directory) == std::vector<std::string>{"dir-a"}; }));
+    KNOTDNSSD_CHECK(directory.view()->version > version);
+    KNOTDNSSD_CHECK(pinned->version == version);
+    KNOTDNSSD_CHECK(pinned->instances.size() == 2);
+    KNOTDNSSD_CHECK(pinned->find("dir-b") != nullptr && pinned->find("dir-b")->serviceName == "dir-b");
+
+    a.cancel();
+    KNOTDNSSD_CHECK(knot::test::eventually([&] { return directory.view()->instances.empty(); }));
+}
+
+static void checkReadersDuringChurn() {
+    knot::ServiceDirectory directory("_churn._tcp", nullptr);
+    std::atomic<bool> stop{false};
+    std::atomic<bool> consistent{true};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 3; ++i) {
+        readers.emplace_back([&] {
+            while (!stop) {
+                knot::ServiceDirectory::View view = directory.view();
+                // every instance of a snapshot stays readable, and in order
+                for (size_t j = 1; j < view->instances.size(); ++j) {
+                    if (!(view->instances[j - 1]->serviceName < view->instances[j]->serviceName)) {
+                        consistent = false;
+                    }
+                }
+            }
+        });
+    }
+    std::vector<knot::Registration> registrations;
+    size_t live = 0;
+    for (int i = 0; i < 100; ++i) {
+        char name[16];
+        std::snprintf(name, sizeof(name), "churn-%03d", i);
+        registrations.push_back(knot::registerServiceAsync(name, "_churn._tcp", nullptr, 8080, {}));
+        ++live;
+        // withdraws two in three of the first half as it goes
+        if (i % 3 == 0) {
+            registrations[i / 2].cancel();
+            --live;
+        }
+    }
+    KNOTDNSSD_CHECK(knot::test::eventually([&] { return directory.view()->find("churn-099") != nullptr; }));
+    stop = true;
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    KNOTDNSSD_CHECK(consistent);
+    KNOTDNSSD_CHECK(knot::test::eventually([&] { return directory.view()->instances.size() == live; }));
+}
+
+static void checkUnconfirmedSettle() {
+    constexpr const char* kPath = "knotdnssd_test_directory.bin";
+    {
+        knot::Registration ghost = knot::registerServiceAsync("ghost", "_settle._tcp", nullptr, 8080, {});
+        knot::ServiceDirectory directory("_settle._tcp", nullptr);
+        KNOTDNSSD_CHECK(knot::test::eventually([&] { return directory.view()->find("ghost") != nullptr; }));
+        KNOTDNSSD_CHECK(knot::saveSnapshot(kPath));
+    }
+    KNOTDNSSD_CHECK(knot::loadSnapshot(kPath));
+    std::remove(kPath);
+
+    // the instance is gone, so the browse finds nothing and the daemon never
+    // says that all is known; the directory settles on its own
+    auto start = Clock::now();
+    knot::ServiceDirectory directory("_settle._tcp", nullptr);
+    {
+        knot::ServiceDirectory::View view = directory.view();
+        KNOTDNSSD_CHECK(view->provisional);
+        KNOTDNSSD_CHECK(view->find("ghost") != nullptr);
+    }
+    KNOTDNSSD_CHECK(knot::test::eventually([&] { return directory.view()->instances.empty(); }, std::chrono::seconds(10)));
+    KNOTDNSSD_CHECK(Clock::now() - start >= std::chrono::seconds(2));
+    KNOTDNSSD_CHECK(!directory.view()->provisional);
+}
+
+int main() {
+    checkAddRemove();
+    checkReadersDuringChurn();
+    checkUnconfirmedSettle();
+    return knot::test::result();
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+// Reactor::drain against a socketpair standing in for a daemon connection:
+// replies queued before the loop wakes up are all handled in that wakeup.
+
+#include "check.h"
+#include "reactor.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using knot::detail::Reactor;
+
+constexpr uint32_t kReplies = 500;
+
+/// consumes one fixed-size reply, as DNSServiceProcessResult does
+static bool readReply(int fd, uint32_t& reply) {
+    return read(fd, &reply, sizeof(reply)) == sizeof(reply);
+}
+
+int main() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        std::perror("socketpair");
+        return 1;
+    }
+    int daemon = fds[0];
+    int client = fds[1];
+    // written at once, so all of them are queued before the loop first looks
+    std::vector<uint32_t> replies(kReplies);
+    for (uint32_t i = 0; i < kReplies; ++i) {
+        replies[i] = i;
+    }
+    KNOTDNSSD_CHECK(write(daemon, replies.data(), replies.size() * sizeof(uint32_t)) == static_cast<ssize_t>(replies.size() * sizeof(uint32_t)));
+
+    std::atomic<uint32_t> wakeups{0};
+    std::atomic<uint32_t> handled{0};
+    std::atomic<bool> ordered{true};
+    std::atomic<bool> failed{false};
+    {
+        Reactor reactor;
+        Reactor::Id watch = 0;
+        reactor.post([&] {
+            watch = reactor.addWatch(client, Reactor::Readable, [&](unsigned) {
+                ++wakeups;
+                bool ok = Reactor::drain(client, [&] {
+                    uint32_t reply = 0;
+                    if (!readReply(client, reply)) {
+                        return false;
+                    }
+                    ordered = ordered && reply == handled;
+                    ++handled;
+                    return true;
+                });
+                failed = failed || !ok;
+            });
+        });
+        KNOTDNSSD_CHECK(knot::test::eventually([&] { return handled == kReplies; }));
+        KNOTDNSSD_CHECK(wakeups == 1);
+        KNOTDNSSD_CHECK(ordered);
+        KNOTDNSSD_CHECK(!failed);
+
+        // a process call that fails stops the drain
+        std::atomic<bool> removed{false};
+        reactor.post([&] {
+            reactor.removeWatch(watch);
+            removed = true;
+        });
+        KNOTDNSSD_CHECK(knot::test::eventually([&] { return removed.load(); }));
+        uint32_t more[3] = {0, 1, 2};
+        KNOTDNSSD_CHECK(write(daemon, more, sizeof(more)) == sizeof(more));
+        std::atomic<uint32_t> calls{0};
+        std::atomic<bool> done{false};
+        reactor.post([&] {
+            bool ok = Reactor::drain(client, [&] {
+                ++calls;
+                return false;
+            });
+            failed = !ok;
+            done = true;
+        });
+        KNOTDNSSD_CHECK(knot::test::eventually([&] { return done.load(); }));
+        KNOTDNSSD_CHECK(calls == 1);
+        KNOTDNSSD_CHECK(failed);
+        reactor.stop();
+    }
+    close(daemon);
+    close(client);
+    return knot::test::result();
+}
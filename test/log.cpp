@@ -0,0 +1,151 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+// The log rate limit drops what exceeds the burst of a place and reports how
+// many it dropped with the next message from there; so does a full queue
+// while the sink is busy.
+
+#include "check.h"
+#include "log.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Logged {
+    std::string message;
+    uint64_t suppressed;
+};
+
+/// records what reaches the sink; while held, the sink waits in its first call
+class Capture {
+public:
+    knot::LogSink sink() {
+        return [this](knot::LogLevel, std::string_view message, uint64_t suppressed) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            entered_ = true;
+            changed_.notify_all();
+            changed_.wait(lock, [this] { return !held_; });
+            logged_.push_back({std::string(message), suppressed});
+        };
+    }
+
+    void hold() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        held_ = true;
+        entered_ = false;
+    }
+
+    /// until the sink is waiting
+    void waitEntered() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this] { return entered_; });
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        held_ = false;
+        changed_.notify_all();
+    }
+
+    std::vector<Logged> logged() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return logged_;
+    }
+
+    bool waitFor(size_t count) {
+        return knot::test::eventually([this, count] { return logged().size() >= count; });
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    bool held_ = false;
+    bool entered_ = false;
+    std::vector<Logged> logged_;
+};
+
+static void limited(int i) {
+    KNOTDNSSD_LOG_INFO("limited %d", i);
+}
+
+static void flooded(int i) {
+    KNOTDNSSD_LOG_INFO("flooded %d", i);
+}
+
+static void checkRateLimit(Capture& capture) {
+    knot::LogOptions options;
+    options.burst = 3;
+    options.interval = std::chrono::milliseconds(300);
+    knot::setLogSink(capture.sink(), options);
+    knot::resetMetrics();
+
+    for (int i = 0; i < 10; ++i) {
+        limited(i);
+    }
+    KNOTDNSSD_CHECK(capture.waitFor(3));
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    // the next interval admits again, with the count of what was dropped
+    limited(10);
+    KNOTDNSSD_CHECK(capture.waitFor(4));
+
+    std::vector<Logged> logged = capture.logged();
+    KNOTDNSSD_CHECK(logged.size() == 4);
+    if (logged.size() == 4) {
+        KNOTDNSSD_CHECK(logged[0].message == "limited 0" && logged[0].suppressed == 0);
+        KNOTDNSSD_CHECK(logged[2].message == "limited 2" && logged[2].suppressed == 0);
+        KNOTDNSSD_CHECK(logged[3].message == "limited 10" && logged[3].suppressed == 7);
+    }
+    KNOTDNSSD_CHECK(knot::metrics().logsDropped == 7);
+}
+
+static void checkQueueFull(Capture& capture) {
+    knot::LogOptions options;
+    options.burst = 0;
+    knot::setLogSink(capture.sink(), options);
+    knot::resetMetrics();
+    size_t before = capture.logged().size();
+
+    // the sink waits inside its first call, so nothing is taken off the queue
+    capture.hold();
+    flooded(-1);
+    capture.waitEntered();
+    constexpr int kFlood = 1000;
+    for (int i = 0; i < kFlood; ++i) {
+        flooded(i);
+    }
+    uint64_t dropped = knot::metrics().logsDropped;
+    KNOTDNSSD_CHECK(dropped > 0);
+    capture.release();
+
+    KNOTDNSSD_CHECK(capture.waitFor(before + 1 + kFlood - dropped));
+    flooded(kFlood);
+    KNOTDNSSD_CHECK(capture.waitFor(before + 2 + kFlood - dropped));
+
+    std::vector<Logged> logged = capture.logged();
+    KNOTDNSSD_CHECK(logged.size() == before + 2 + kFlood - dropped);
+    // what fit into the queue came through in order, the rest is counted with the next message
+    if (logged.size() == before + 2 + kFlood - dropped) {
+        KNOTDNSSD_CHECK(logged[before].message == "flooded -1");
+        KNOTDNSSD_CHECK(logged[before + 1].message == "flooded 0");
+        KNOTDNSSD_CHECK(logged.back().message == "flooded " + std::to_string(kFlood));
+        KNOTDNSSD_CHECK(logged.back().suppressed == dropped);
+    }
+}
+
+int main() {
+    knot::setMetricsEnabled(true);
+    Capture capture;
+    checkRateLimit(capture);
+    checkQueueFull(capture);
+    // the default sink again, the capture is about to go away
+    knot::setLogSink(nullptr);
+    return knot::test::result();
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+// Finish hooks run once the operation finishes, also those added while it
+// finishes or after it finished.
+
+#include "check.h"
+#include "operation.h"
+#include "reactor.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+using knot::detail::OperationState;
+
+int main() {
+    knot::detail::Reactor reactor;
+    auto op = std::make_shared<OperationState>(reactor);
+    std::string ran;
+    std::atomic<bool> done{false};
+    reactor.post([&] {
+        op->setTeardown([&] {
+            ran += "t";
+            op->onFinish([&] { ran += "T"; });
+        });
+        op->onFinish([&] {
+            ran += "h";
+            op->onFinish([&] { ran += "H"; });
+        });
+        op->finish();
+        op->onFinish([&] { ran += "a"; });
+        done = true;
+    });
+    KNOTDNSSD_CHECK(knot::test::eventually([&] { return done.load(); }));
+    KNOTDNSSD_CHECK(op->finished());
+    // hooks added by the teardown or by a hook run right away, in place
+    KNOTDNSSD_CHECK(ran == "tThHa");
+    return knot::test::result();
+}
@@ -0,0 +1,176 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+// saveSnapshot() and loadSnapshot() round trip a directory and both caches,
+// and a damaged file is refused without touching anything.
+
+#include "cache.h"
+#include "check.h"
+#include "snapshot.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+using knot::detail::queryCache;
+using knot::detail::resolveCache;
+using Clock = std::chrono::steady_clock;
+
+constexpr const char* kPath = "knotdnssd_test_snapshot.bin";
+
+static std::string readFile(const char* path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static void writeFile(const char* path, const std::string& data) {
+    std::ofstream(path, std::ios::binary | std::ios::trunc).write(data.data(), static_cast<std::streamsize>(data.size()));
+}
+
+static size_t cachedEntries() {
+    size_t count = 0;
+    resolveCache().forEach([&count](const std::string&, const knot::ResolveReply&, Clock::time_point) { ++count; });
+    queryCache().forEach([&count](const std::string&, const knot::IPAddress&, Clock::time_point) { ++count; });
+    return count;
+}
+
+static knot::ResolveReply makeReply() {
+    uint8_t bytes[16] = {0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0x02, 0x11, 0x22, 0xff, 0xfe, 0x33, 0x44, 0x55};
+    knot::ResolveReply reply;
+    reply.hostName = "snapshot-host.local.";
+    reply.ip = knot::IPAddress::fromBytes(bytes, sizeof(bytes), 3);
+    reply.ip->scopeId = 3;
+    reply.port = 8080;
+    reply.txt = {{"path", "/"}, {"bin", std::string_view("\0\xff=", 3)}};
+    reply.txt.set("flag");
+    return reply;
+}
+
+static void checkRoundTrip() {
+    knot::Registration registration = knot::registerServiceAsync("snapshot-a", "_snapshot._tcp", nullptr, 8080, {{"k", "v"}});
+    knot::ServiceDirectory directory("_snapshot._tcp", nullptr);
+    KNOTDNSSD_CHECK(knot::test::eventually([&] { return directory.view()->find("snapshot-a") != nullptr; }));
+
+    knot::clearCache();
+    knot::ResolveReply reply = makeReply();
+    uint8_t ipv4[4] = {192, 0, 2, 7};
+    knot::IPAddress address = *knot::IPAddress::fromBytes(ipv4, sizeof(ipv4), 2);
+    auto expires = Clock::now() + std::chrono::minutes(10);
+    resolveCache().seed("fresh", reply, expires);
+    // expired longer ago than loadSnapshot's maxAge, it is left out on load
+    resolveCache().seed("old", reply, Clock::now() - std::chrono::hours(2));
+    queryCache().seed("address", address, expires);
+
+    KNOTDNSSD_CHECK(knot::saveSnapshot(kPath));
+    // the temporary file is gone after the move
+    std::string prefix = std::string(kPath) + ".";
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        KNOTDNSSD_CHECK(entry.path().filename().string().rfind(prefix, 0) != 0);
+    }
+
+    knot::clearCache();
+    KNOTDNSSD_CHECK(cachedEntries() == 0);
+    KNOTDNSSD_CHECK(knot::loadSnapshot(kPath, std::chrono::hours(1)));
+
+    size_t resolves = 0;
+    resolveCache().forEach([&](const std::string& key, const knot::ResolveReply& loaded, Clock::time_point loadedExpires) {
+        ++resolves;
+        KNOTDNSSD_CHECK(key == "fresh");
+        KNOTDNSSD_CHECK(loaded.hostName == reply.hostName);
+        KNOTDNSSD_CHECK(loaded.ip && *loaded.ip == *reply.ip);
+        KNOTDNSSD_CHECK(loaded.ip && loaded.ip->interfaceIndex == 3);
+        KNOTDNSSD_CHECK(loaded.port == 8080);
+        KNOTDNSSD_CHECK(loaded.txt == reply.txt);
+        KNOTDNSSD_CHECK(loaded.txt.get("bin") == std::string_view("\0\xff=", 3));
+        // whole seconds on disk
+        KNOTDNSSD_CHECK(loadedExpires > expires - std::chrono::seconds(2) && loadedExpires < expires + std::chrono::seconds(2));
+    });
+    KNOTDNSSD_CHECK(resolves == 1);
+
+    size_t addresses = 0;
+    queryCache().forEach([&](const std::string& key, const knot::IPAddress& loaded, Clock::time_point) {
+        ++addresses;
+        KNOTDNSSD_CHECK(key == "address");
+        KNOTDNSSD_CHECK(loaded == address);
+        KNOTDNSSD_CHECK(loaded.interfaceIndex == 2);
+    });
+    KNOTDNSSD_CHECK(addresses == 1);
+
+    std::vector<knot::ServiceInstance> instances = knot::detail::warmInstances("_snapshot._tcp", "");
+    KNOTDNSSD_CHECK(instances.size() == 1);
+    KNOTDNSSD_CHECK(!instances.empty() && instances[0].serviceName == "snapshot-a");
+}
+
+static void checkConcurrentSaves() {
+    // each save writes a temporary file of its own, none of them fails or
+    // leaves a torn file behind
+    std::atomic<int> failed{0};
+    std::vector<std::thread> savers;
+    for (int i = 0; i < 4; ++i) {
+        savers.emplace_back([&failed] {
+            for (int round = 0; round < 25; ++round) {
+                failed += knot::saveSnapshot(kPath) ? 0 : 1;
+            }
+        });
+    }
+    for (std::thread& saver : savers) {
+        saver.join();
+    }
+    KNOTDNSSD_CHECK(failed == 0);
+    KNOTDNSSD_CHECK(knot::loadSnapshot(kPath));
+}
+
+static void checkDamagedFiles() {
+    std::string saved = readFile(kPath);
+    KNOTDNSSD_CHECK(saved.size() > 16);
+    knot::clearCache();
+
+    KNOTDNSSD_CHECK(!knot::loadSnapshot("knotdnssd_test_missing.bin"));
+
+    // cut inside the header, then inside the last record
+    for (size_t size : {size_t(0), size_t(3), size_t(6), size_t(12), saved.size() - 1}) {
+        writeFile(kPath, saved.substr(0, size));
+        KNOTDNSSD_CHECK(!knot::loadSnapshot(kPath));
+    }
+    // every other cut must not read past the end either
+    for (size_t size = 1; size < saved.size(); ++size) {
+        writeFile(kPath, saved.substr(0, size));
+        knot::loadSnapshot(kPath);
+        knot::clearCache();
+    }
+
+    std::string badMagic = saved;
+    badMagic[0] = 'X';
+    writeFile(kPath, badMagic);
+    KNOTDNSSD_CHECK(!knot::loadSnapshot(kPath));
+
+    std::string badVersion = saved;
+    badVersion[4] = static_cast<char>(badVersion[4] + 1);
+    writeFile(kPath, badVersion);
+    KNOTDNSSD_CHECK(!knot::loadSnapshot(kPath));
+
+    std::string unknownRecord = saved.substr(0, 16) + std::string(1, '\x7f');
+    writeFile(kPath, unknownRecord);
+    KNOTDNSSD_CHECK(!knot::loadSnapshot(kPath));
+
+    // a refused file changes nothing
+    KNOTDNSSD_CHECK(cachedEntries() == 0);
+    std::remove(kPath);
+}
+
+int main() {
+    checkRoundTrip();
+    checkConcurrentSaves();
+    checkDamagedFiles();
+    return knot::test::result();
+}
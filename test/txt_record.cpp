@@ -0,0 +1,133 @@
+/*
+ * This file is part of knotdnssd.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/knotdnssd/blob/master/README.md
+ */
+
+// Length-prefixed TXT parsing, see RFC 6763, section 6.
+
+#include "check.h"
+#include "knot/dnssd.h"
+
+#include <string>
+#include <string_view>
+
+using namespace std::string_view_literals;
+
+static knot::TxtRecord fromWire(std::string_view wire) {
+    return knot::TxtRecord::fromWire(wire.data(), wire.size());
+}
+
+static size_t count(const knot::TxtRecord& record) {
+    size_t entries = 0;
+    for (auto it = record.begin(); it != record.end(); ++it) {
+        ++entries;
+    }
+    return entries;
+}
+
+static void checkEmpty() {
+    // an empty record goes on the wire as a single zero byte
+    knot::TxtRecord record = fromWire("\0"sv);
+    KNOTDNSSD_CHECK(record.empty());
+    KNOTDNSSD_CHECK(count(record) == 0);
+    KNOTDNSSD_CHECK(!record.get("a"));
+
+    KNOTDNSSD_CHECK(fromWire(""sv).empty());
+    KNOTDNSSD_CHECK(knot::TxtView(nullptr, 0).begin() == knot::TxtView(nullptr, 0).end());
+
+    // zero-length strings between entries are skipped
+    knot::TxtRecord padded = fromWire("\0\x03" "a=1\0"sv);
+    KNOTDNSSD_CHECK(count(padded) == 1);
+    KNOTDNSSD_CHECK(padded.get("a") == "1"sv);
+}
+
+static void checkTruncated() {
+    // the last string claims 9 bytes but only 3 follow
+    std::string_view wire = "\x03" "a=1\x09" "b=2"sv;
+    knot::TxtRecord record = fromWire(wire);
+    KNOTDNSSD_CHECK(count(record) == 1);
+    KNOTDNSSD_CHECK(record.size() == 4);
+    KNOTDNSSD_CHECK(record.get("a") == "1"sv);
+    KNOTDNSSD_CHECK(!record.get("b"));
+
+    knot::TxtView view(wire.data(), wire.size());
+    KNOTDNSSD_CHECK(view.get("a") == "1"sv);
+    KNOTDNSSD_CHECK(!view.contains("b"));
+
+    // a lone length byte
+    KNOTDNSSD_CHECK(fromWire("\x05"sv).empty());
+}
+
+static void checkBooleanKey() {
+    knot::TxtRecord record = fromWire("\x04" "flag\x06" "empty="sv);
+    auto it = record.begin();
+    KNOTDNSSD_CHECK(it->key == "flag"sv);
+    KNOTDNSSD_CHECK(!it->value);
+    ++it;
+    KNOTDNSSD_CHECK(it->key == "empty"sv);
+    KNOTDNSSD_CHECK(it->value == ""sv);
+
+    // both read as present with an empty value
+    KNOTDNSSD_CHECK(record.contains("flag"));
+    KNOTDNSSD_CHECK(record.get("flag") == ""sv);
+    KNOTDNSSD_CHECK(record.get("empty") == ""sv);
+
+    knot::TxtRecord built;
+    KNOTDNSSD_CHECK(built.set("flag"));
+    KNOTDNSSD_CHECK(std::string_view(reinterpret_cast<const char*>(built.data()), built.size()) == "\x04" "flag"sv);
+}
+
+static void checkCaseInsensitive() {
+    knot::TxtRecord record = fromWire("\x08" "Path=/ab"sv);
+    KNOTDNSSD_CHECK(record.get("path") == "/ab"sv);
+    KNOTDNSSD_CHECK(record.get("PATH") == "/ab"sv);
+    KNOTDNSSD_CHECK(record.contains("pAtH"));
+
+    // set replaces the entry whatever case it was written in
+    KNOTDNSSD_CHECK(record.set("PATH", "/cd"));
+    KNOTDNSSD_CHECK(count(record) == 1);
+    KNOTDNSSD_CHECK(record.get("path") == "/cd"sv);
+    KNOTDNSSD_CHECK(record.remove("path"));
+    KNOTDNSSD_CHECK(record.empty());
+}
+
+static void checkDuplicates() {
+    // the first occurrence of a key wins, see RFC 6763, section 6.4
+    knot::TxtRecord record = fromWire("\x03" "k=1\x03" "K=2\x01" "k"sv);
+    KNOTDNSSD_CHECK(record.get("k") == "1"sv);
+    KNOTDNSSD_CHECK(record.toMap().size() == 1);
+    KNOTDNSSD_CHECK(record.toMap()["k"] == "1");
+    knot::TxtView view(record.data(), record.size());
+    KNOTDNSSD_CHECK(view.get("K") == "1"sv);
+}
+
+static void checkLimits() {
+    knot::TxtRecord record;
+    // key, '=' and value share the 255 bytes of one string
+    KNOTDNSSD_CHECK(record.set("k", std::string(253, 'v')));
+    KNOTDNSSD_CHECK(record.size() == 256);
+    KNOTDNSSD_CHECK(!record.set("k", std::string(254, 'v')));
+    KNOTDNSSD_CHECK(record.get("k") == std::string(253, 'v'));
+
+    KNOTDNSSD_CHECK(record.set(std::string(255, 'b')));
+    KNOTDNSSD_CHECK(!record.set(std::string(256, 'b')));
+    KNOTDNSSD_CHECK(!record.set(""));
+    KNOTDNSSD_CHECK(!record.set("", "v"));
+    KNOTDNSSD_CHECK(count(record) == 2);
+
+    // what set built parses back the same
+    knot::TxtRecord parsed = knot::TxtRecord::fromWire(record.data(), record.size());
+    KNOTDNSSD_CHECK(parsed == record);
+}
+
+int main() {
+    checkEmpty();
+    checkTruncated();
+    checkBooleanKey();
+    checkCaseInsensitive();
+    checkDuplicates();
+    checkLimits();
+    return knot::test::result();
+}